@@ -0,0 +1,114 @@
+//
+//  AttachmentCache.h
+//  MailBlock
+//
+//  Created by Sylvain Vriens on 25/04/2013.
+//
+//
+
+#pragma once
+
+#include "cinder/Cinder.h"
+#include "cinder/Thread.h"
+
+#include <list>
+#include <unordered_map>
+#include <atomic>
+
+namespace cinder {
+    namespace mail {
+        
+        class AttachmentCache;
+        typedef std::shared_ptr<AttachmentCache> AttachmentCacheRef;
+        
+        //encoded attachment bodies by the hash of their content, shared by all sending threads
+        //the least recently used bodies are dropped when the memory limit is reached
+        //the headers are not cached here, an attachment builds them once from its file name which the content does not decide
+        class AttachmentCache {
+        public:
+            typedef std::shared_ptr<const std::string> BodyRef;
+            
+            //the content a body is the encoding of, found by the hash and confirmed by the size and a second hash
+            //so content that collides on a single hash is never served the body of another
+            struct Source {
+                Source() : mHash(0), mCheck(0), mSize(0){}
+                Source(uint64_t hash, uint64_t check, uint64_t size) : mHash(hash), mCheck(check), mSize(size){}
+                
+                bool operator==(const Source& other) const{
+                    return mHash==other.mHash && mCheck==other.mCheck && mSize==other.mSize;
+                }
+                bool operator!=(const Source& other) const{
+                    return !(*this==other);
+                }
+                
+                uint64_t mHash;
+                uint64_t mCheck; //the content hashed with CHECK_SEED
+                uint64_t mSize;
+            };
+            
+            //the seed of the second hash of a source
+            static const uint64_t CHECK_SEED = 0x8f1bbcdcca62c1d6ULL;
+            
+            static AttachmentCacheRef create(size_t maxBytes=64*1024*1024){
+                return AttachmentCacheRef(new AttachmentCache(maxBytes));
+            }
+            
+            //hashes content, larger data can be fed in pieces by passing the previous hash as seed
+            static uint64_t hash(const void* data, size_t size, uint64_t seed=0);
+            
+            //the encoded body, or an empty reference when not cached or cached for other content with the same hash
+            BodyRef find(const Source& source);
+            
+            //a body for other content with the same hash is kept, this one is then not cached
+            void insert(const Source& source, const BodyRef& body);
+            
+            //whether a body of this size would be cached at all
+            bool accepts(size_t size) const{
+                return size<=mMaxEntryBytes;
+            }
+            
+            //total memory used by the bodies, older ones are dropped to stay under it
+            void setMaxBytes(size_t maxBytes);
+            
+            //bodies larger than this are never cached but streamed instead
+            void setMaxEntryBytes(size_t maxBytes){
+                mMaxEntryBytes = maxBytes;
+            }
+            
+            void clear();
+            
+            size_t getBytes() const{
+                return mBytes;
+            }
+            
+            size_t getHits() const{
+                return mHits;
+            }
+            
+            size_t getMisses() const{
+                return mMisses;
+            }
+        
+        protected:
+            AttachmentCache(size_t maxBytes) : mMaxBytes(maxBytes), mMaxEntryBytes(maxBytes/8), mBytes(0), mHits(0), mMisses(0){
+            }
+            
+            //drops the oldest bodies until the cache fits, the mutex has to be locked
+            void trim();
+            
+            typedef std::pair<Source, BodyRef> Entry;
+            typedef std::list<Entry> Entries;
+            
+            std::mutex                                          mMutex;
+            Entries                                             mEntries; //most recently used first
+            std::unordered_map<uint64_t, Entries::iterator>     mIndex;
+            
+            size_t                                              mMaxBytes;
+            std::atomic<size_t>                                 mMaxEntryBytes;
+            std::atomic<size_t>                                 mBytes;
+            std::atomic<size_t>                                 mHits;
+            std::atomic<size_t>                                 mMisses;
+        };
+        
+    }
+}
@@ -0,0 +1,66 @@
+//
+//  Encoding.h
+//  MailBlock
+//
+//  Created by Sylvain Vriens on 25/04/2013.
+//
+//
+
+#pragma once
+
+#include "Mail.h"
+
+#include <string>
+#include <cstddef>
+
+namespace cinder {
+    namespace mail {
+        
+        //size of the base64 encoding of size bytes, with a CRLF after every lineWidth characters (0 does not wrap)
+        size_t base64EncodedSize(size_t size, size_t lineWidth=MAIL_SMTP_BASE64_LINE_WIDTH);
+        
+        //base64 encodes into output, which must hold base64EncodedSize() bytes, and returns the amount written
+        //lines are separated by CRLF, there is no line ending after the last one
+        //uses SSSE3 or AVX2 when the cpu supports it
+        size_t encodeBase64(const void* input, size_t size, char* output, size_t lineWidth=MAIL_SMTP_BASE64_LINE_WIDTH);
+        
+        //same, appending to a string
+        void encodeBase64(const void* input, size_t size, std::string& output, size_t lineWidth=MAIL_SMTP_BASE64_LINE_WIDTH);
+        
+        //what a text contains, to pick its transfer encoding
+        struct TextScan {
+            TextScan() : mEightBit(0), mUnsafe(0), mLongestRun(0), mBinary(false){}
+            
+            size_t  mEightBit; //bytes above 127
+            size_t  mUnsafe; //bytes quoted-printable has to escape, including the eight bit ones
+            size_t  mLongestRun; //bytes without a space or line break, exact from 32 on, wrapped text never has longer lines than this or its width
+            bool    mBinary; //contains a NUL, which only base64 can carry
+        };
+        
+        //classifies every byte, 16 or 32 at a time when the cpu supports it
+        TextScan scanText(const void* input, size_t size);
+        
+        enum TransferEncoding {
+            ENCODING_7BIT,
+            ENCODING_8BIT,
+            ENCODING_QUOTED_PRINTABLE,
+            ENCODING_BASE64
+        };
+        
+        //the value of the Content-Transfer-Encoding header
+        const char* getTransferEncodingName(TransferEncoding encoding);
+        
+        //the smallest encoding that is valid for the text, 8bit only when the server takes it (RFC 6152)
+        //wrapped text is sent as it is when its lines fit, otherwise the shorter of quoted-printable and base64
+        TransferEncoding selectTransferEncoding(size_t size, const TextScan& scan, bool eightBit);
+        
+        //the size of the quoted-printable encoding, close enough to choose between encodings
+        size_t estimateQuotedPrintableSize(size_t size, const TextScan& scan);
+        
+        //quoted-printable (RFC 2045) of text appended to output, any line ending becomes CRLF
+        //a dot that starts a line is escaped as well, so the output can follow DATA as it is
+        //runs of plain characters are found 16 or 32 at a time and copied at once
+        void encodeQuotedPrintable(const void* input, size_t size, std::string& output);
+        
+    }
+}
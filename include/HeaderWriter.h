@@ -0,0 +1,175 @@
+//
+//  HeaderWriter.h
+//  MailBlock
+//
+//  Created by Sylvain Vriens on 25/04/2013.
+//
+//
+
+#pragma once
+
+#include "Mail.h"
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+namespace cinder {
+    namespace mail {
+        
+        //appends smtp commands and message headers to a buffer that keeps its memory when it is cleared
+        //it only allocates while growing to the largest message, after that writing costs no allocations
+        //a header started with beginHeader is folded to the line width, text that is not plain ascii is written as
+        //RFC 2047 encoded words in utf-8, with whichever of Q and B is shorter
+        class HeaderWriter {
+        public:
+            HeaderWriter(size_t capacity=MAIL_SMTP_HEADER_BUFFER_SIZE) : mAllocations(0), mLineStart(0), mSpace(false), mFoldable(false){
+                reserve(capacity);
+            }
+            
+            //empties the buffer, the memory stays
+            void clear(){
+                mData.clear();
+                mLineStart = 0;
+                mSpace = false;
+                mFoldable = false;
+            }
+            
+            void reserve(size_t size){
+                if(size<=mData.capacity()) return;
+                mData.reserve(size);
+                ++mAllocations;
+            }
+            
+            HeaderWriter& append(const char* data, size_t size){
+                if(mData.size() + size>mData.capacity()){
+                    reserve(std::max(mData.capacity()*2, mData.size() + size));
+                }
+                mData.append(data, size);
+                return *this;
+            }
+            
+            HeaderWriter& operator<<(const std::string& data){
+                return append(data.data(), data.size());
+            }
+            
+            HeaderWriter& operator<<(const char* data){
+                return append(data, strlen(data));
+            }
+            
+            HeaderWriter& operator<<(char c){
+                return append(&c, 1);
+            }
+            
+            //a command with an address and the line ending, like MAIL FROM:<address>
+            //parameters follow the address, like BODY=8BITMIME
+            HeaderWriter& writeCommand(const char* command, const std::string& address, const char* parameters=NULL){
+                *this << command << '<' << address << '>';
+                if(parameters){
+                    *this << parameters;
+                }
+                return *this << MAIL_SMTP_NEWLINE;
+            }
+            
+            //the MAIL FROM with its parameters and a RCPT TO per recipient
+            HeaderWriter& writeEnvelope(const std::string& sender, const std::vector<std::string>& recipients, const char* parameters=NULL){
+                writeCommand("MAIL FROM:", sender, parameters);
+                for(auto& recipient: recipients){
+                    writeCommand("RCPT TO:", recipient);
+                }
+                return *this;
+            }
+            
+            //the name and colon, the words that follow are separated by a space and folded when the line gets too long
+            HeaderWriter& beginHeader(const char* name){
+                mLineStart = mData.size();
+                *this << name << ':';
+                mSpace = true;
+                mFoldable = false;
+                return *this;
+            }
+            
+            //ends the line of the header
+            HeaderWriter& endHeader(){
+                *this << MAIL_SMTP_NEWLINE;
+                mLineStart = mData.size();
+                mSpace = false;
+                mFoldable = false;
+                return *this;
+            }
+            
+            //a single word that is never split, like an address
+            HeaderWriter& writeWord(const char* data, size_t size);
+            
+            HeaderWriter& writeWord(const std::string& word){
+                return writeWord(word.data(), word.size());
+            }
+            
+            //unstructured text like the subject, encoded when it is not plain ascii
+            HeaderWriter& writeText(const std::string& text);
+            
+            //a display name, quoted when it has special characters and encoded when it is not plain ascii
+            HeaderWriter& writePhrase(const std::string& phrase);
+            
+            //the name followed by the address in angle brackets, or just the bracketed address without a name
+            //with separator a comma follows the address, its column is counted when deciding to fold
+            HeaderWriter& writeAddress(const std::string& name, const std::string& address, bool separator=false);
+            
+            //the same command as a string of its own, without the line ending
+            static std::string createCommand(const char* command, const std::string& address){
+                size_t length = strlen(command);
+                std::string data;
+                data.reserve(length + address.size() + 2);
+                data.append(command, length);
+                data += '<';
+                data += address;
+                data += '>';
+                return data;
+            }
+            
+            const std::string& str() const{
+                return mData;
+            }
+            
+            const char* data() const{
+                return mData.data();
+            }
+            
+            size_t size() const{
+                return mData.size();
+            }
+            
+            bool empty() const{
+                return mData.empty();
+            }
+            
+            //hands the content to the string, the writer is empty and has to grow again
+            void swap(std::string& data){
+                mData.swap(data);
+                mData.clear();
+            }
+            
+            //times the buffer had to grow, a writer that is reused stops counting once it fits the largest message
+            size_t getAllocations() const{
+                return mAllocations;
+            }
+        
+        protected:
+            //encoded words for the text, split on whole characters, the safe characters of Q are those allowed in a phrase
+            //with fill the first word takes the rest of the current line
+            void writeEncoded(const char* data, size_t size, bool fill);
+            
+            //the space before the next word, or a fold when the word would not fit on the line
+            void separate(size_t size);
+            
+            std::string mData;
+            size_t      mAllocations;
+            
+            size_t      mLineStart; //offset of the current line
+            bool        mSpace; //whether the next word needs a space in front of it
+            bool        mFoldable; //whether the current line has a word, folding before the first one would leave it empty
+        };
+        
+    }
+}
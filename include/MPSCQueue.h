@@ -0,0 +1,74 @@
+//
+//  MPSCQueue.h
+//  MailBlock
+//
+//  Created by Sylvain Vriens on 25/04/2013.
+//
+//
+
+#pragma once
+
+#include <atomic>
+
+namespace cinder {
+    namespace mail {
+        
+        //an unbounded queue that any number of threads push to without locks and one thread pops from
+        //a push is a single exchange, so it never waits for another thread (Vyukov's MPSC queue)
+        template<typename T>
+        class MPSCQueue {
+        public:
+            MPSCQueue() : mHead(new Node()), mTail(mHead.load()){}
+            
+            ~MPSCQueue(){
+                T value;
+                while(pop(value));
+                delete mTail;
+            }
+            
+            //any thread
+            void push(const T& value){
+                Node* node = new Node(value);
+                Node* previous = mHead.exchange(node, std::memory_order_acq_rel);
+                //until this store the consumer sees the queue end at the previous node
+                previous->mNext.store(node, std::memory_order_release);
+            }
+            
+            //the consumer thread only, false when it is empty or the only push is still halfway
+            bool pop(T& value){
+                Node* tail = mTail;
+                Node* next = tail->mNext.load(std::memory_order_acquire);
+                if(!next) return false;
+                
+                //the next node becomes the empty front, its value is taken out
+                value = next->mValue;
+                next->mValue = T();
+                mTail = next;
+                delete tail;
+                return true;
+            }
+            
+            //the consumer thread only
+            bool empty() const{
+                return mTail->mNext.load(std::memory_order_acquire)==NULL;
+            }
+        
+        protected:
+            struct Node {
+                Node() : mNext(NULL){}
+                Node(const T& value) : mValue(value), mNext(NULL){}
+                
+                T                   mValue;
+                std::atomic<Node*>  mNext;
+            };
+            
+            std::atomic<Node*>  mHead; //the last pushed
+            Node*               mTail; //the empty front, owned by the consumer
+        
+        private:
+            MPSCQueue(const MPSCQueue&);
+            MPSCQueue& operator=(const MPSCQueue&);
+        };
+        
+    }
+}
@@ -11,7 +11,14 @@
 #define CINDER_MAIL
 #define MAIL_SMTP_PORT 25
 #define MAIL_SMTP_BASE64_LINE_WIDTH 76
+#define MAIL_SMTP_TEXT_LINE_WIDTH 100
 #define MAIL_SMTP_NEWLINE "\r\n"
+#define MAIL_SMTP_CHUNK_SIZE 65536
+#define MAIL_SMTP_READ_BUFFER_SIZE 4096
+#define MAIL_SMTP_READ_BUFFER_MAX 65536
+#define MAIL_SMTP_RETRY_TICK 0.1 //seconds per tick of the retry wheel
+#define MAIL_SMTP_HEADER_BUFFER_SIZE 4096 //initial bytes of a header writer
+#define MAIL_SMTP_HEADER_LINE_WIDTH 78 //headers are folded to fit (RFC 5322)
 
 #define MAIL_MSG_BOUNDARY   "=585ac769fba6306f9982300a8af93da7="
 #define MAIL_HTML_BOUNDARY  "=bd91c9aaf15895bc2251fedfa9d433b6="
@@ -15,7 +15,21 @@
 
 
 #include "Mail.h"
+#include "Session.h"
+#include "MessageWriter.h"
+#include "Spool.h"
+#include "TimerWheel.h"
+#include "RateLimit.h"
+#include "Resolver.h"
+#include "MPSCQueue.h"
 #include <queue>
+#include <deque>
+#include <condition_variable>
+#include <chrono>
+#include <random>
+#include <cmath>
+#include <unordered_map>
+#include <algorithm>
 
 #include <boost/asio.hpp>
 
@@ -31,6 +45,7 @@ namespace cinder {
         typedef std::shared_ptr<class Message> MessageRef;
         
         typedef signals::signal<void(MessageRef,bool)> SentSignalType;
+        typedef signals::signal<void(MessageRef,std::string,int)> RecipientSignalType;
         
         class Mailer {
         public:
@@ -55,13 +70,29 @@ namespace cinder {
             template<typename T, typename Y>
             ci::signals::connection	connectSent( T fn, Y *inst ) { return getSignalSent().connect( std::bind( fn, inst, std::_1, std::_2 ) ); }
             
+            //called for every recipient with the code the server replied to its RCPT TO
+            RecipientSignalType& getSignalRecipient(){
+                return mSignalRecipient;
+            }
+            template<typename T, typename Y>
+            ci::signals::connection	connectRecipient( T fn, Y *inst ) { return getSignalRecipient().connect( std::bind( fn, inst, std::_1, std::_2, std::_3 ) ); }
+            
+            //queues the message without locking or waiting, so it can be called from a render loop
+            //the delivery thread picks it up, the message should not be changed after it is sent
             void sendMessage(const MessageRef& msg){
-                {
-                    std::lock_guard<std::mutex> lock(mDataMutex);
-                    mMessages.push(msg);
-                }
-                
-                run();
+                submit(Submission(msg));
+            }
+            
+            //sends messages with the same content and sender in shared transactions, recipients are sorted by domain
+            //only messages that are identical apart from the date and their BCC are merged, so nobody sees more than before
+            //a recipient of several merged messages gets the mail once, every message is still signaled on its own
+            template<typename Iterator>
+            void sendBatch(Iterator begin, Iterator end){
+                submit(Submission(std::make_shared<std::vector<MessageRef> >(begin, end)));
+            }
+            
+            void sendBatch(const std::vector<MessageRef>& messages){
+                sendBatch(messages.begin(), messages.end());
             }
             
             void setLogin(const std::string & username,
@@ -81,358 +112,1418 @@ namespace cinder {
                 }
             }
             
-            ~Mailer(){
-                if(mThread){
-                    mThread->join();
+            //maximum number of messages sent over a single connection before it is closed
+            void setMaxMessagesPerSession(size_t count){
+                std::lock_guard<std::mutex> lock(mSessionMutex);
+                mMaxMessagesPerSession = std::max<size_t>(count, 1);
+            }
+            
+            //seconds an unused connection is kept open for reuse, it is closed once they have passed
+            void setSessionIdleTimeout(double seconds){
+                std::lock_guard<std::mutex> lock(mDataMutex);
+                std::lock_guard<std::mutex> sessionLock(mSessionMutex);
+                mSessionIdleTimeout = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+                
+                //moved to the new time
+                mIdleTimerArmed = false;
+                armIdleTimer();
+            }
+            
+            //number of authenticated connections kept open for reuse
+            void setMaxIdleSessions(size_t count){
+                std::lock_guard<std::mutex> lock(mSessionMutex);
+                mMaxIdleSessions = count;
+            }
+            
+            //maximum number of simultaneous connections to the server, messages wait for a free one
+            void setMaxSessions(size_t count){
+                {
+                    std::lock_guard<std::mutex> lock(mSessionMutex);
+                    mMaxSessions = std::max<size_t>(count, 1);
+                    for(auto& destination: mDestinations){
+                        destination.second->mConcurrency->setMaximum(getMaxSessionsLocked());
+                    }
+                }
+                ios.post(std::bind(&Mailer::dispatch, this));
+            }
+            
+            //maximum number of simultaneous connections to a single destination, the server or with direct delivery a recipient domain
+            //so a busy domain can not take every connection from the others, 0 leaves it to the maximum number of sessions
+            void setMaxSessionsPerDestination(size_t count){
+                {
+                    std::lock_guard<std::mutex> lock(mSessionMutex);
+                    mMaxDestinationSessions = count;
+                    for(auto& destination: mDestinations){
+                        destination.second->mConcurrency->setMaximum(getMaxSessionsLocked());
+                    }
+                }
+                ios.post(std::bind(&Mailer::dispatch, this));
+            }
+            
+            //starts with a single transaction at a time and probes upwards to the maximum number of sessions
+            //backs off when the server throttles with 421 or 451, or takes much longer than usual to accept a message
+            //every destination probes on its own, the server or with direct delivery every recipient domain
+            void setAdaptiveConcurrency(bool enabled){
+                {
+                    std::lock_guard<std::mutex> lock(mSessionMutex);
+                    mAdaptiveConcurrency = enabled;
+                }
+                ios.post(std::bind(&Mailer::dispatch, this));
+            }
+            
+            //the number of transactions that may run at the same time to the domain, or to the server without direct delivery
+            size_t getConcurrencyLimit(const std::string& domain=""){
+                std::lock_guard<std::mutex> lock(mSessionMutex);
+                if(!mAdaptiveConcurrency) return getMaxSessionsLocked();
+                
+                //a destination without sessions starts over with a single one
+                std::unordered_map<std::string, DestinationRef>::const_iterator itr = mDestinations.find(domain);
+                return itr==mDestinations.end() ? 1 : getConcurrencyLimitLocked(*itr->second);
+            }
+            
+            //messages per second to the server, 0 is unlimited
+            //messages over a limit wait without holding up the ones that are not
+            void setServerRate(double perSecond, double burst=1){
+                mRateLimits->setServerRate(perSecond, burst);
+                ios.post(std::bind(&Mailer::dispatch, this));
+            }
+            
+            //messages per second from every sender address
+            void setSenderRate(double perSecond, double burst=1){
+                mRateLimits->setSenderRate(perSecond, burst);
+                ios.post(std::bind(&Mailer::dispatch, this));
+            }
+            
+            //messages per second to every recipient domain, or to a single one when it is given
+            void setDomainRate(double perSecond, double burst=1, const std::string& domain=""){
+                mRateLimits->setDomainRate(perSecond, burst, domain);
+                ios.post(std::bind(&Mailer::dispatch, this));
+            }
+            
+            //delivers straight to the mail servers of the recipient domains instead of the server, in parallel per domain
+            //the servers are looked up with the resolver, the dns of the system when none is given, on the port of the mailer
+            //set it before sending
+            void setDirectDelivery(bool enabled, const ResolverRef& resolver=ResolverRef()){
+                std::lock_guard<std::mutex> lock(mDataMutex);
+                if(!enabled){
+                    mMXCache.reset();
+                }else{
+                    mMXCache = MXCache::create(resolver ? resolver : DNSResolver::create());
+                }
+            }
+            
+            //the looked up mail servers, empty without direct delivery
+            MXCacheRef getMXCache(){
+                std::lock_guard<std::mutex> lock(mDataMutex);
+                return mMXCache;
+            }
+            
+            //seconds a single step of the smtp conversation may take before the connection is dropped
+            void setTimeout(double seconds){
+                std::lock_guard<std::mutex> lock(mSessionMutex);
+                mTimeout = seconds;
+            }
+            
+            //keeps the queue on disk as well, the messages left by an earlier run are sent again
+            //messages are removed once they are sent or failed, so after a crash a message might be sent twice
+            //set it once, before sending
+            void setSpool(const SpoolRef& spool){
+                std::vector<uint64_t> pending = spool->getPending();
+                {
+                    std::lock_guard<std::mutex> lock(mDataMutex);
+                    mSpool = spool;
+                    
+                    //read from the spool when they are sent, so the backlog is not loaded into memory
+                    for(auto id: pending){
+                        DeliveryRef delivery(new Delivery());
+                        delivery->mSpoolId = id;
+                        mDeliveries.push(delivery);
+                    }
+                }
+                
+                if(!pending.empty()){
+                    run();
                 }
             }
-           
             
+            SpoolRef getSpool(){
+                std::lock_guard<std::mutex> lock(mDataMutex);
+                return mSpool;
+            }
+            
+            //temporary failures, 4xx replies and broken connections, are tried again after a growing delay
+            //the delay doubles every attempt up to the maximum, with jitter so retries do not come in waves
+            //permanent failures and the last attempt are signaled as failed, the recipient signal reports every attempt
+            void setRetryPolicy(size_t maxAttempts, double initialDelay=60, double maxDelay=3600){
+                std::lock_guard<std::mutex> lock(mDataMutex);
+                mMaxAttempts = maxAttempts;
+                mRetryDelay = std::max(initialDelay, 0.0);
+                mMaxRetryDelay = std::max(maxDelay, mRetryDelay);
+            }
+            
+            //deliveries waiting for a retry
+            size_t getRetryCount(){
+                std::lock_guard<std::mutex> lock(mDataMutex);
+                return mRetries.size();
+            }
+            
+            //maximum number of RCPT TO commands in a single transaction of a batch
+            void setMaxRecipientsPerTransaction(size_t count){
+                std::lock_guard<std::mutex> lock(mDataMutex);
+                mMaxRecipientsPerTransaction = std::max<size_t>(count, 1);
+            }
+            
+            //send the envelope in a single write when the server supports PIPELINING
+            void setPipelining(bool enabled){
+                std::lock_guard<std::mutex> lock(mDataMutex);
+                mPipelining = enabled;
+            }
+            
+            //bytes written to the server by all sessions
+            uint64_t getBytesWritten() const{
+                return mThroughput->getBytes();
+            }
+            
+            //average write rate since creation or the last reset
+            double getBytesPerSecond() const{
+                return mThroughput->getBytesPerSecond();
+            }
+            
+            void resetThroughput(){
+                mThroughput->reset();
+            }
+            
+            //encoded attachments shared between messages, to inspect or limit it
+            AttachmentCacheRef getAttachmentCache() const{
+                return mAttachmentCache;
+            }
+            
+            //number of threads driving the connections, raising it takes effect on the next send
+            void setWorkerCount(size_t count){
+                std::lock_guard<std::mutex> lock(mDataMutex);
+                mWorkerCount = std::max<size_t>(count, 1);
+            }
+            
+            ~Mailer(){
+                //everything sent becomes a delivery first
+                {
+                    std::lock_guard<std::mutex> lock(mParkMutex);
+                    mSubmitterStopping = true;
+                }
+                mParkCondition.notify_one();
+                mSubmitter->join();
+                
+                //let the workers finish the queue, they return once every session is closed
+                std::vector<DeliveryRef> waiting;
+                {
+                    std::lock_guard<std::mutex> lock(mDataMutex);
+                    mStopping = true;
+                    
+                    //waiting retries are failed, but stay in the spool for the next run
+                    mRetryTimer.cancel();
+                    mRetries.clear([&waiting](const DeliveryRef& delivery){
+                        waiting.push_back(delivery);
+                    });
+                }
+                for(auto& delivery: waiting){
+                    signal(delivery, std::vector<int>(), false);
+                }
+                mWork.reset();
+                ios.post(std::bind(&Mailer::closeIdleSessions, this));
+                
+                for(auto& worker: mWorkers){
+                    worker->join();
+                }
+                
+                //anything left when no worker was running
+                std::vector<SessionRef> sessions;
+                {
+                    std::lock_guard<std::mutex> lock(mSessionMutex);
+                    sessions.swap(mSessions);
+                }
+                for(auto& session: sessions){
+                    session->close();
+                }
+            }
+        
+        
         protected:
             
             Mailer(const std::string & server,
                    int32_t port,
                    const std::string & username,
                    const std::string & password,
-                   LoginType type) : mThreadRunning(false), mServer(server), mPort(port), mUsername(username), mPassword(password), mLoginType(type){
+                   LoginType type) : mStopping(false), mWorkerCount(1), mServer(server), mPort(port), mUsername(username), mPassword(password), mLoginType(type), mPipelining(true), mMaxRecipientsPerTransaction(100),
+                                     mMaxMessagesPerSession(100), mMaxIdleSessions(4), mMaxSessions(4), mMaxDestinationSessions(0), mOpenSessions(0), mSessionIdleTimeout(std::chrono::seconds(30)), mTimeout(30),
+                                     mIdleTimer(ios), mIdleTimerArmed(false), mAdaptiveConcurrency(false), mThrottleTimer(ios), mThrottleTimerArmed(false),
+                                     mMaxAttempts(5), mRetryDelay(60), mMaxRetryDelay(3600), mRetryTimer(ios), mRetryTimerArmed(false),
+                                     mParked(false), mSubmitterStopping(false){
+                mThroughput = Throughput::create();
+                mRateLimits = RateLimits::create();
+                mAttachmentCache = AttachmentCache::create();
+                mRetryStart = std::chrono::steady_clock::now();
+                mRandom.seed(std::random_device()());
+                
+                //started once, so sending never creates a thread
+                mSubmitter = std::shared_ptr<std::thread>(new std::thread(&Mailer::submitFunction, this));
             }
             
-            struct Response {
-                Response(std::string response) {
-                    try {
-                        mCode = fromString<int>(response.substr(0,3));
-                        mResponse = response.substr(4);
-                    }catch(...){
-                        mResponse = response;
-                        mCode = 0;
-                    }
-                };
-                
-                int getCode(){
-                    return mCode;
+            void run(bool threaded = true){
+                if(!threaded){
+                    //drive the conversations on the calling thread until everything is delivered
+                    dispatch();
+                    ios.run();
+                    ios.reset();
+                    return;
                 }
                 
-                const std::string& getResponse(){
-                    return mResponse;
+                {
+                    std::lock_guard<std::mutex> lock(mDataMutex);
+                    //start workers up to the requested amount, they keep running the io_service until destruction
+                    if(!mWork){
+                        mWork = std::shared_ptr<io_service::work>(new io_service::work(ios));
+                    }
+                    while(mWorkers.size()<mWorkerCount){
+                        mWorkers.push_back(std::shared_ptr<std::thread>(new std::thread(&Mailer::threadedFunction, this)));
+                    }
                 }
+                ios.post(std::bind(&Mailer::dispatch, this));
+            }
+            
+            void threadedFunction(){
+                ios.run();
+            }
+            
+            //a single message, or the messages of a batch
+            struct Submission {
+                Submission(){}
+                Submission(const MessageRef& msg) : mMessage(msg){}
+                Submission(const std::shared_ptr<std::vector<MessageRef> >& batch) : mBatch(batch){}
                 
-                int mCode;
-                std::string mResponse;
+                MessageRef                                  mMessage;
+                std::shared_ptr<std::vector<MessageRef> >   mBatch;
             };
             
-            struct Responses : public std::vector<Response> {
-                
-                Responses() : std::vector<Response>(){}
-                
-                Responses(const std::string& str) : std::vector<Response>(){
-                    push_back(Response(str));
+            //wait free apart from waking the delivery thread when it is parked
+            void submit(const Submission& submission){
+                mSubmissions.push(submission);
+                if(mParked.exchange(false)){
+                    //taking the lock makes sure it is waiting, so the wake up is not lost
+                    std::lock_guard<std::mutex> lock(mParkMutex);
+                    mParkCondition.notify_one();
+                }
+            }
+            
+            //turns the sent messages into deliveries and starts the workers, off the threads of the callers
+            //parks when there is nothing to do, and finishes the queue before it stops
+            void submitFunction(){
+                while(true){
+                    Submission submission;
+                    bool submitted = false;
+                    while(mSubmissions.pop(submission)){
+                        if(submission.mBatch){
+                            queueBatch(*submission.mBatch);
+                        }else{
+                            queueMessage(submission.mMessage);
+                        }
+                        submitted = true;
+                    }
+                    submission = Submission();
+                    if(submitted){
+                        run();
+                    }
+                    
+                    //a send after this sees it parked and wakes it up
+                    mParked = true;
+                    if(!mSubmissions.empty()){
+                        mParked = false;
+                        continue;
+                    }
+                    
+                    std::unique_lock<std::mutex> lock(mParkMutex);
+                    mParkCondition.wait(lock, [this](){ return !mParked || mSubmitterStopping; });
+                    if(mSubmitterStopping && mSubmissions.empty()) return;
+                }
+            }
+            
+            void queueMessage(const MessageRef& msg){
+                size_t maxRecipients;
+                bool direct;
+                {
+                    std::lock_guard<std::mutex> lock(mDataMutex);
+                    maxRecipients = mMaxRecipientsPerTransaction;
+                    direct = mMXCache!=NULL;
                 }
                 
-                Responses(const Response& response) : std::vector<Response>(){
-                    push_back(response);
+                std::vector<DeliveryRef> deliveries;
+                if(direct && !msg->getRecipients().empty()){
+                    //a transaction per domain, each to its own server
+                    MergeRef merge(new Merge());
+                    merge->mMessages.push_back(msg);
+                    splitMerge(merge, maxRecipients, true, deliveries);
+                }else{
+                    deliveries.push_back(createDelivery(msg));
+                }
+                spoolDeliveries(deliveries, deliveries.size()>1);
+                {
+                    std::lock_guard<std::mutex> lock(mDataMutex);
+                    for(auto& delivery: deliveries){
+                        mDeliveries.push(delivery);
+                    }
+                }
+            }
+            
+            void queueBatch(const std::vector<MessageRef>& messages){
+                size_t maxRecipients;
+                bool direct;
+                {
+                    std::lock_guard<std::mutex> lock(mDataMutex);
+                    maxRecipients = mMaxRecipientsPerTransaction;
+                    direct = mMXCache!=NULL;
                 }
                 
-                Responses(std::vector<std::string> responses) : std::vector<Response>(){
-                    for(auto& response: responses){
-                        if(response.size()){//skip empty lines
-                            push_back(Response(response));
+                std::vector<DeliveryRef> deliveries;
+                std::vector<MergeRef> merges;
+                std::unordered_map<uint64_t, std::vector<MergeRef> > contents;
+                for(auto& msg: messages){
+                    if(msg->getRecipients().empty()){
+                        //fails on its own like any other message without recipients
+                        deliveries.push_back(createDelivery(msg));
+                        continue;
+                    }
+                    
+                    //the hash only finds the candidates, a message is merged when its content is really the same
+                    //so content that collides is never sent to the recipients of another message
+                    std::vector<MergeRef>& candidates = contents[msg->getContentHash()];
+                    MergeRef merge;
+                    for(auto& candidate: candidates){
+                        if(msg->hasSameContent(*candidate->mMessages.front())){
+                            merge = candidate;
+                            break;
                         }
                     }
+                    if(!merge){
+                        merge = MergeRef(new Merge());
+                        candidates.push_back(merge);
+                        merges.push_back(merge);
+                    }
+                    merge->mMessages.push_back(msg);
                 }
                 
-                int getCode(){
-                    if(empty()){
-                        return 0;
-                    }
-                    return back().getCode();
+                for(auto& merge: merges){
+                    splitMerge(merge, maxRecipients, direct, deliveries);
                 }
+                spoolDeliveries(deliveries, true);
                 
-                std::string getResponse(){
-                    if(empty()){
-                        return "";
+                {
+                    std::lock_guard<std::mutex> lock(mDataMutex);
+                    for(auto& delivery: deliveries){
+                        mDeliveries.push(delivery);
                     }
-                    return back().getResponse();
                 }
+            }
+            
+            //messages with the same content sent together, they are signaled when their last delivery is done
+            struct Merge {
+                std::mutex                  mMutex;
+                std::vector<MessageRef>     mMessages;
+                std::vector<bool>           mAccepted; //whether any recipient of the message was accepted
+                size_t                      mPending; //deliveries that are not done yet
+            };
+            typedef std::shared_ptr<Merge> MergeRef;
+            
+            //the content of a merge and some of its recipients
+            struct Delivery {
+                Delivery() : mSpoolId(0), mAttempts(0){}
                 
-                operator int (){
-                    return getCode();
-                }
+                MessageRef                  mMessage; //the content that is sent, empty until a spooled one is read back
+                std::string                 mSender; //the address of the MAIL FROM, written with the recipients when sending
+                std::vector<std::string>    mRecipients;
+                std::vector<std::vector<size_t> > mOwners; //the messages of the merge every recipient belongs to
+                MergeRef                    mMerge;
+                uint64_t                    mSpoolId; //0 when it is not spooled
+                size_t                      mAttempts; //retries so far
+                std::string                 mDomain; //of every recipient with direct delivery, empty through the server
             };
+            typedef std::shared_ptr<Delivery> DeliveryRef;
             
-            typedef std::shared_ptr<boost::asio::ip::tcp::socket> SocketRef;
+            //the server, or with direct delivery a recipient domain, with the sessions to it and how many it takes at the same time
+            //it is forgotten once it has no sessions left, guarded by the session mutex
+            struct Destination {
+                Destination(size_t maximum) : mConcurrency(Concurrency::create(maximum)), mOpenSessions(0){}
+                
+                ConcurrencyRef              mConcurrency;
+                size_t                      mOpenSessions; //the idle ones as well
+                std::deque<DeliveryRef>     mWaiting; //until a transaction to it is done, guarded by the data mutex as well
+            };
+            typedef std::shared_ptr<Destination> DestinationRef;
             
-            void run(bool threaded = true){
-                if(!threaded){
-                    threadedFunction();
-                    return;
+            static DeliveryRef createDelivery(const MessageRef& msg){
+                MergeRef merge(new Merge());
+                merge->mMessages.push_back(msg);
+                merge->mAccepted.push_back(false);
+                merge->mPending = 1;
+                
+                DeliveryRef delivery(new Delivery());
+                delivery->mMessage = msg;
+                delivery->mSender = msg->getSender();
+                delivery->mRecipients = msg->getRecipients();
+                delivery->mOwners.assign(delivery->mRecipients.size(), std::vector<size_t>(1, 0));
+                delivery->mMerge = merge;
+                return delivery;
+            }
+            
+            //removes duplicate recipients, sorts them by domain and splits them over deliveries of at most the given size
+            //split by domain as well, every delivery goes to a single domain
+            static void splitMerge(const MergeRef& merge, size_t maxRecipients, bool byDomain, std::vector<DeliveryRef>& deliveries){
+                std::vector<std::string> recipients;
+                std::vector<std::vector<size_t> > owners;
+                std::unordered_map<std::string, size_t> index;
+                for(size_t i=0; i<merge->mMessages.size(); ++i){
+                    for(auto& recipient: merge->mMessages[i]->getRecipients()){
+                        std::pair<std::unordered_map<std::string, size_t>::iterator, bool> found = index.insert(std::make_pair(boost::algorithm::to_lower_copy(recipient), recipients.size()));
+                        if(found.second){
+                            recipients.push_back(recipient);
+                            owners.push_back(std::vector<size_t>());
+                        }
+                        std::vector<size_t>& owner = owners[found.first->second];
+                        if(owner.empty() || owner.back()!=i){
+                            owner.push_back(i);
+                        }
+                    }
                 }
                 
-                if(mThread){
-                    //if there is a thread, join it
-                    bool running;
-                    {
-                        std::lock_guard<std::mutex> lock(mDataMutex);
-                        running = mThreadRunning;
+                std::vector<std::string> domains;
+                domains.reserve(recipients.size());
+                for(auto& recipient: recipients){
+                    domains.push_back(getDomain(recipient));
+                }
+                std::vector<size_t> order(recipients.size());
+                for(size_t i=0; i<order.size(); ++i) order[i] = i;
+                std::stable_sort(order.begin(), order.end(), [&domains](size_t a, size_t b){ return domains[a]<domains[b]; });
+                
+                merge->mAccepted.assign(merge->mMessages.size(), false);
+                merge->mPending = 0;
+                
+                const MessageRef& msg = merge->mMessages.front();
+                std::string sender = msg->getSender();
+                for(size_t i=0, end=0; i<order.size(); i=end){
+                    end = std::min(i + maxRecipients, order.size());
+                    if(byDomain){
+                        const std::string& domain = domains[order[i]];
+                        end = std::find_if(order.begin() + i, order.begin() + end, [&domains, &domain](size_t j){ return domains[j]!=domain; }) - order.begin();
+                    }
+                    ++merge->mPending;
+                    
+                    DeliveryRef delivery(new Delivery());
+                    delivery->mMessage = msg;
+                    delivery->mMerge = merge;
+                    if(byDomain){
+                        delivery->mDomain = domains[order[i]];
                     }
-                    if(!running){
-                        mThread->join();
-                        mThread = std::shared_ptr<std::thread>();
+                    delivery->mSender = sender;
+                    delivery->mRecipients.reserve(end - i);
+                    for(size_t j=i; j<end; ++j){
+                        const std::string& recipient = recipients[order[j]];
+                        delivery->mRecipients.push_back(recipient);
+                        delivery->mOwners.push_back(owners[order[j]]);
                     }
+                    deliveries.push_back(delivery);
                 }
+            }
+            
+            void success(MessageRef msg){
+                signal(msg,true);
+            }
+            
+            void fail(MessageRef msg){
+                signal(msg, false);
+            }
+            
+            void signal(MessageRef msg, bool success){
+                mSignalSent(msg, success);
+            }
+            
+            //writes the deliveries to the spool when there is one, a batch is synced once at the end
+            void spoolDeliveries(const std::vector<DeliveryRef>& deliveries, bool batch){
+                SpoolRef spool = getSpool();
+                if(!spool) return;
                 
-                if(!mThread){
-                    mThread = std::shared_ptr<std::thread>(new std::thread(&Mailer::threadedFunction, this));
+                //the message is streamed into the spool like it is sent, so it is never in memory as a whole
+                //the deliveries of a merge share the message, so it is serialized once and copied for the others
+                MessageRef serialized;
+                uint64_t spooled = 0;
+                for(auto& delivery: deliveries){
+                    if(delivery->mMessage!=serialized || !spooled){
+                        serialized = delivery->mMessage;
+                        MessageWriterRef writer = MessageWriter::create(serialized, mAttachmentCache);
+                        delivery->mSpoolId = spool->append(createEnvelope(delivery), [writer](std::string& chunk){ return writer->next(chunk); }, !batch);
+                        spooled = delivery->mSpoolId;
+                    }else{
+                        delivery->mSpoolId = spool->appendCopy(createEnvelope(delivery), spooled, !batch);
+                    }
+                    
+                    //a delivery that could not be spooled is only kept in memory
+                    if(!delivery->mSpoolId){
+                        ci::app::console() << "unable to spool message" << std::endl;
+                    }
+                }
+                
+                //the batch is not durable, so it is taken out of the spool again and kept in memory
+                if(batch && !spool->sync()){
+                    ci::app::console() << "unable to sync spool" << std::endl;
+                    for(auto& delivery: deliveries){
+                        if(!delivery->mSpoolId) continue;
+                        spool->acknowledge(delivery->mSpoolId);
+                        delivery->mSpoolId = 0;
+                    }
                 }
             }
             
-            void threadedFunction(){
+            //reads a delivery of an earlier run back from the spool, false when it is gone
+            //an entry that can not be read is acknowledged, otherwise it would come back after every restart and keep its segment
+            bool loadDelivery(const DeliveryRef& delivery){
+                if(delivery->mMessage) return true;
+                
+                SpoolRef spool = getSpool();
+                if(!spool) return false;
+                
+                Message::Headers envelope;
+                std::string data;
+                if(!spool->read(delivery->mSpoolId, envelope, data)){
+                    ci::app::console() << "unable to read spooled message " << delivery->mSpoolId << ", dropped" << std::endl;
+                    spool->acknowledge(delivery->mSpoolId);
+                    return false;
+                }
+                
+                uint64_t id = delivery->mSpoolId;
+                *delivery = *createDelivery(Message::create(envelope, std::move(data)));
+                delivery->mSpoolId = id;
+                
+                //spooled with direct delivery, so all recipients share the domain
+                if(getMXCache() && !delivery->mRecipients.empty()){
+                    delivery->mDomain = getDomain(delivery->mRecipients.front());
+                }
+                return true;
+            }
+            
+            //marks the delivery as done, the messages are signaled after the last delivery of their merge
+            //a message is sent when one of its recipients was accepted
+            void signal(const DeliveryRef& delivery, const std::vector<int>& replies, bool acknowledge=true){
+                if(delivery->mSpoolId && acknowledge){
+                    getSpool()->acknowledge(delivery->mSpoolId);
+                }
+                
+                const MergeRef& merge = delivery->mMerge;
                 {
-                    std::lock_guard<std::mutex> lock(mDataMutex);
-                    mThreadRunning = true;
+                    std::lock_guard<std::mutex> lock(merge->mMutex);
+                    for(size_t i=0; i<replies.size() && i<delivery->mOwners.size(); ++i){
+                        if(replies[i]/100!=2) continue;
+                        for(auto& owner: delivery->mOwners[i]){
+                            merge->mAccepted[owner] = true;
+                        }
+                    }
+                    if(--merge->mPending) return;
                 }
                 
-                //the loop
-                //breaks on an empty message list
+                for(size_t i=0; i<merge->mMessages.size(); ++i){
+                    if(merge->mAccepted[i]){
+                        success(merge->mMessages[i]);
+                    }else{
+                        fail(merge->mMessages[i]);
+                    }
+                }
+            }
+            
+            //starts a transaction for every queued message that can get a session
+            void dispatch(){
                 while(true){
-                    MessageRef message;
+                    DeliveryRef delivery;
+                    SessionRef session;
+                    bool expired = false;
                     {
                         std::lock_guard<std::mutex> lock(mDataMutex);
-                        //break the loop if empty
-                        if(mMessages.empty()) break;
+                        if(mDeliveries.empty()) return;
                         
-                        message = mMessages.front();
-                        mMessages.pop();
+                        //over a rate limit, wait aside so the rest of the queue is not held up
+                        const DeliveryRef& front = mDeliveries.front();
+                        const std::string& sender = front->mSender;
+                        double wait = mRateLimits->getDelay(sender, front->mRecipients);
+                        if(wait>0){
+                            throttle(front, wait);
+                            mDeliveries.pop();
+                            continue;
+                        }
+                        
+                        std::lock_guard<std::mutex> sessionLock(mSessionMutex);
+                        if(mOpenSessions - mSessions.size()>=mMaxSessions){
+                            //every session is busy, a finished one will dispatch again
+                            return;
+                        }
+                        
+                        //as many transactions as the destination takes or is allowed, it waits aside until one of them is done
+                        Destination& destination = getDestination(front->mDomain);
+                        size_t idleSessions = std::count_if(mSessions.begin(), mSessions.end(), [&front](const SessionRef& session){
+                            return session->getDestination()==front->mDomain;
+                        });
+                        if(destination.mOpenSessions - idleSessions>=getConcurrencyLimitLocked(destination)){
+                            destination.mWaiting.push_back(front);
+                            mDeliveries.pop();
+                            continue;
+                        }
+                        
+                        //the most recently used idle session to the same destination
+                        std::vector<SessionRef>::reverse_iterator idle = std::find_if(mSessions.rbegin(), mSessions.rend(), [&front](const SessionRef& session){
+                            return session->getDestination()==front->mDomain;
+                        });
+                        if(idle!=mSessions.rend()){
+                            session = *idle;
+                            mSessions.erase(std::next(idle).base());
+                            expired = session->isIdleFor(mSessionIdleTimeout);
+                        }else if(mOpenSessions<mMaxSessions){
+                            //claim the slot before connecting
+                            ++mOpenSessions;
+                            ++destination.mOpenSessions;
+                        }else if(!mSessions.empty()){
+                            //the idle sessions to other domains take the slots, close the oldest
+                            session = mSessions.front();
+                            mSessions.erase(mSessions.begin());
+                            expired = true;
+                        }else{
+                            //everything busy, a released session will dispatch again
+                            return;
+                        }
+                        
+                        if(!expired){
+                            mRateLimits->take(sender, front->mRecipients);
+                            delivery = front;
+                            mDeliveries.pop();
+                        }
                     }
                     
-                    send(message);
+                    if(expired){
+                        closeSession(session);
+                    }else if(!loadDelivery(delivery)){
+                        //unreadable and dropped from the spool, give the session back
+                        std::lock_guard<std::mutex> lock(mDataMutex);
+                        std::lock_guard<std::mutex> sessionLock(mSessionMutex);
+                        if(session){
+                            mSessions.push_back(session);
+                            armIdleTimer();
+                        }else{
+                            --mOpenSessions;
+                            releaseDestination(delivery->mDomain, true);
+                        }
+                    }else if(session){
+                        resetSession(session, delivery);
+                    }else{
+                        openSession(delivery);
+                    }
                 }
-                
+            }
+            
+            //connects, checks the greeting, authenticates and sends the delivery
+            //the session slot has to be claimed already
+            void openSession(const DeliveryRef& delivery){
+                std::string server;
+                int32_t port;
+                MXCacheRef mx;
                 {
                     std::lock_guard<std::mutex> lock(mDataMutex);
-                    mThreadRunning = false;
+                    server = mServer;
+                    port = mPort;
+                    mx = mMXCache;
+                }
+                
+                if(mx){
+                    if(delivery->mDomain.empty()){
+                        abandonSession(createSession(delivery), delivery, Responses("554 no recipient domain"));
+                        return;
+                    }
+                    
+                    //the workers keep running while the lookup is done on another thread
+                    std::shared_ptr<io_service::work> work(new io_service::work(ios));
+                    mx->resolve(delivery->mDomain, [this, work, delivery, port](Resolver::Result result, const MXRecords& records){
+                        std::shared_ptr<std::vector<std::string> > servers(new std::vector<std::string>());
+                        for(auto& record: records){
+                            servers->push_back(record.mHost);
+                        }
+                        
+                        ios.post([this, work, delivery, port, result, servers](){
+                            if(result==Resolver::FOUND && !servers->empty()){
+                                connectSession(delivery, servers, 0, port);
+                            }else if(result==Resolver::FAILED){
+                                abandonSession(createSession(delivery), delivery, Responses("451 mail servers of the domain not found"));
+                            }else{
+                                abandonSession(createSession(delivery), delivery, Responses("556 domain does not accept mail"));
+                            }
+                        });
+                    });
+                    return;
                 }
+                
+                if(!server.size()){
+                    //no server set
+                    abandonSession(createSession(delivery), delivery, Responses("554 no server set"));
+                    return;
+                }
+                connectSession(delivery, std::make_shared<std::vector<std::string> >(1, server), 0, port);
             }
             
-            void success(MessageRef msg){
-                signal(msg,true);
+            //a session for the slot the delivery claimed, it reports to the concurrency of its destination
+            SessionRef createSession(const DeliveryRef& delivery){
+                SessionRef session = Session::create(ios);
+                session->setDestination(delivery->mDomain);
+                {
+                    std::lock_guard<std::mutex> lock(mSessionMutex);
+                    session->setTimeout(mTimeout);
+                    session->setConcurrency(getDestination(delivery->mDomain).mConcurrency);
+                }
+                session->setThroughput(mThroughput);
+                return session;
             }
             
-            void fail(MessageRef msg){
-                signal(msg, false);
+            //connects to the servers in order, the next one is tried when one is down or busy
+            void connectSession(const DeliveryRef& delivery, const std::shared_ptr<std::vector<std::string> >& servers, size_t index, int32_t port){
+                SessionRef session = createSession(delivery);
+                bool last = index + 1>=servers->size();
+                
+                session->connect((*servers)[index], port, [this, session, delivery, servers, index, port, last](bool connected){
+                    if(!connected){
+                        ci::app::console() << "unable to connect" << std::endl;
+                        if(!last){
+                            session->close();
+                            connectSession(delivery, servers, index + 1, port);
+                            return;
+                        }
+                        abandonSession(session, delivery, Responses());
+                        return;
+                    }
+                    
+                    //check if the server is indeed ready
+                    session->readReply([this, session, delivery, servers, index, port, last](const Responses& reply){
+                        checkThrottled(session, reply);
+                        if(reply!=220){//220 is OK
+                            if(!last && reply.isTransient()){
+                                quit(session);
+                                connectSession(delivery, servers, index + 1, port);
+                                return;
+                            }
+                            abandonSession(session, delivery, reply);
+                            return;
+                        }
+                        
+                        //authenticate, if set/needed
+                        authenticate(session, [this, session, delivery](const Responses& reply){
+                            if(reply!=250 && reply!=235){ //response should be ok or authentication succeeded
+                                abandonSession(session, delivery, reply);
+                                return;
+                            }
+                            
+                            transact(session, delivery, false);
+                        });
+                    });
+                });
             }
             
-            void signal(MessageRef msg, bool success){
-                mSignalSent(msg, success);
+            //clears the state of the previous transaction on a pooled session, which also tells us if the connection is still alive
+            void resetSession(const SessionRef& session, const DeliveryRef& delivery){
+                session->sendData("RSET", [this, session, delivery](const Responses& reply){
+                    if(reply!=250){
+                        //dropped by the server in the mean time, use the slot for a fresh one
+                        quit(session);
+                        openSession(delivery);
+                        return;
+                    }
+                    
+                    transact(session, delivery, true);
+                });
             }
             
-            //function that actually sends (and negotiates) the message
-            void send(const MessageRef& msg){
-                Responses reply;
+            //the state of a single delivery on a session
+            struct Transaction {
+                DeliveryRef                 mDelivery;
+                SessionRef                  mSession;
+                bool                        mReused;
                 
-                //get the socket by connecting
-                SocketRef socket = connect();
-                if(!socket){
-                    ci::app::console() << "unable to connect" << std::endl;
-                    fail(msg);
-                    return;
+                std::vector<int>            mReplies; //to every RCPT TO
+                size_t                      mAccepted;
+                
+                bool                        mEightBit; //whether the body is sent as 8bit (RFC 6152)
+                std::string                 mParameters; //added to MAIL FROM
+            };
+            typedef std::shared_ptr<Transaction> TransactionRef;
+            
+            //runs a single mail transaction on the session
+            void transact(const SessionRef& session, const DeliveryRef& delivery, bool reused){
+                TransactionRef transaction(new Transaction());
+                transaction->mDelivery = delivery;
+                transaction->mSession = session;
+                transaction->mReused = reused;
+                transaction->mReplies.assign(delivery->mRecipients.size(), 0);
+                transaction->mAccepted = 0;
+                
+                //text is only sent unencoded when the server takes it, addresses that are not ascii need SMTPUTF8 (RFC 6531)
+                const MessageRef& msg = delivery->mMessage;
+                transaction->mEightBit = msg && session->hasCapability("8BITMIME") && msg->isEightBit();
+                if(transaction->mEightBit){
+                    transaction->mParameters = " BODY=8BITMIME";
+                }
+                if(session->hasCapability("SMTPUTF8") && isEightBit(delivery)){
+                    transaction->mParameters += " SMTPUTF8";
                 }
                 
+                bool pipelining;
+                {
+                    std::lock_guard<std::mutex> lock(mDataMutex);
+                    pipelining = mPipelining;
+                }
                 
-                //check if the server is indeed ready
-                reply = readReply(socket);
-                if(reply!=220){//220 is OK
-                    disconnect(socket);
-                    fail(msg);
+                if(pipelining && session->hasCapability("PIPELINING")){
+                    sendEnvelope(transaction);
+                }else{
+                    sendHeader(transaction, 0);
+                }
+            }
+            
+            //whether the sender or a recipient has bytes above 127
+            static bool isEightBit(const DeliveryRef& delivery){
+                if(isEightBit(delivery->mSender)) return true;
+                for(auto& recipient: delivery->mRecipients){
+                    if(isEightBit(recipient)) return true;
+                }
+                return false;
+            }
+            
+            static bool isEightBit(const std::string& address){
+                for(auto c: address){
+                    if(static_cast<unsigned char>(c)>=0x80) return true;
+                }
+                return false;
+            }
+            
+            //sends the envelope one command at a time
+            void sendHeader(const TransactionRef& transaction, size_t index){
+                const DeliveryRef& delivery = transaction->mDelivery;
+                if(index>delivery->mRecipients.size()){
+                    if(!transaction->mAccepted){
+                        refused(transaction);
+                        return;
+                    }
+                    
+                    //Request the sending of data
+                    transaction->mSession->sendData("DATA", [this, transaction](const Responses& reply){
+                        checkThrottled(transaction->mSession, reply);
+                        if(reply!=354){ //data delimited with .
+                            finish(transaction, reply);
+                            return;
+                        }
+                        sendBody(transaction);
+                    });
                     return;
                 }
                 
-                //authenticate, if set/needed (TBI)
-                reply = authenticate(socket);
-                if(reply!=250 && reply!=235){ //response should be ok or authentication succeeded
-                    disconnect(socket);
-                    fail(msg);
-                    return;
+                auto handler = [this, transaction, index](const Responses& reply){
+                    if(index==0){
+                        checkThrottled(transaction->mSession, reply);
+                    }
+                    
+                    //the sender has to be accepted, refused recipients are skipped
+                    if(reply==0 || (index==0 && reply!=250)){
+                        finish(transaction, reply);
+                        return;
+                    }
+                    if(index>0){
+                        recipientReply(transaction, index-1, reply);
+                    }
+                    sendHeader(transaction, index+1);
+                };
+                if(index){
+                    transaction->mSession->sendCommand("RCPT TO:", delivery->mRecipients[index-1], handler);
+                }else{
+                    transaction->mSession->sendCommand("MAIL FROM:", delivery->mSender, handler, transaction->mParameters.empty() ? NULL : transaction->mParameters.c_str());
                 }
+            }
+            
+            //sends the sender, all recipients and DATA in one go and matches the replies afterwards
+            void sendEnvelope(const TransactionRef& transaction){
+                const DeliveryRef& delivery = transaction->mDelivery;
+                size_t count = delivery->mRecipients.size() + 2;
                 
-                //we are authenticate, let's initiate a message
-                //by sending the headers of a message
-                Message::Headers headers = msg->getHeaders();
-                for(auto& header: headers){
-                    reply = sendData(socket, header);
-                    if(reply!=250){
-                        disconnect(socket);
-                        fail(msg);
+                transaction->mSession->sendEnvelope(delivery->mSender, delivery->mRecipients, [this, transaction, count](const std::vector<Responses>& replies){
+                    if(replies.size()<count){
+                        //connection broken halfway
+                        finish(transaction, Responses());
+                        return;
+                    }
+                    
+                    for(size_t i=1; i+1<count; ++i){
+                        recipientReply(transaction, i-1, replies[i]);
+                    }
+                    
+                    const Responses& data = replies.back();
+                    checkThrottled(transaction->mSession, replies.front());
+                    checkThrottled(transaction->mSession, data);
+                    if(replies.front()!=250 || !transaction->mAccepted){
+                        Responses sender = replies.front();
+                        auto done = [this, transaction, sender](){
+                            if(sender!=250){
+                                finish(transaction, sender);
+                            }else{
+                                refused(transaction);
+                            }
+                        };
+                        if(data==354){
+                            //the server accepted DATA anyway, so end it with an empty message
+                            transaction->mSession->sendData(".", [done](const Responses&){
+                                done();
+                            });
+                            return;
+                        }
+                        done();
                         return;
                     }
+                    
+                    if(data!=354){ //data delimited with .
+                        finish(transaction, data);
+                        return;
+                    }
+                    sendBody(transaction);
+                }, "DATA", transaction->mParameters.empty() ? NULL : transaction->mParameters.c_str());
+            }
+            
+            void sendBody(const TransactionRef& transaction){
+                //stream the message so attachments are encoded while sending
+                MessageWriterRef writer = MessageWriter::create(transaction->mDelivery->mMessage, mAttachmentCache, MAIL_SMTP_CHUNK_SIZE, transaction->mEightBit);
+                transaction->mSession->sendStream([writer](Session::Buffers& buffers){ return writer->next(buffers); }, [this, transaction](const Responses& reply){
+                    finish(transaction, reply);
+                });
+            }
+            
+            //reports the reply to a RCPT TO
+            void recipientReply(const TransactionRef& transaction, size_t index, const Responses& reply){
+                if(reply/100==2){
+                    ++transaction->mAccepted;
+                }
+                
+                const DeliveryRef& delivery = transaction->mDelivery;
+                if(index<delivery->mRecipients.size()){
+                    transaction->mReplies[index] = reply.getCode();
+                    for(auto& owner: delivery->mOwners[index]){
+                        mSignalRecipient(delivery->mMerge->mMessages[owner], delivery->mRecipients[index], reply.getCode());
+                    }
                 }
+            }
+            
+            //handles the final reply of a transaction
+            void finish(const TransactionRef& transaction, const Responses& reply){
+                const SessionRef& session = transaction->mSession;
+                const DeliveryRef& delivery = transaction->mDelivery;
                 
-                //Request the sending of data
-                reply = sendData(socket, "DATA");
-                if(reply!=354){ //data delimited with .
-                    disconnect(socket);
-                    fail(msg);
+                if(reply==250){
+                    session->used();
+                    deferRecipients(transaction);
+                    signal(delivery, transaction->mReplies);
+                    releaseSession(session);
                     return;
                 }
                 
-                reply = sendData(socket, msg->getData(),false);
-                if(reply!=250){//OK
-                    disconnect(socket);
-                    fail(msg);
+                //a reused session might have been dropped by the server in the mean time
+                //so in that case we retry once on a fresh one, a refusal is final
+                if(transaction->mReused && (reply==0 || reply==421)){
+                    quit(session);
+                    openSession(delivery);
                     return;
                 }
                 
-                disconnect(socket);
-                
-                success(msg);
+                abandonSession(session, delivery, reply);
             }
             
-            //connects to the smtp server
-            SocketRef connect(){
-                SocketRef socket;
+            //no recipient was accepted, the session stays usable
+            void refused(const TransactionRef& transaction){
+                deferRecipients(transaction);
+                signal(transaction->mDelivery, transaction->mReplies);
+                releaseSession(transaction->mSession);
+            }
+            
+            //closes the session, a temporary failure is tried again later and anything else fails the messages
+            void abandonSession(const SessionRef& session, const DeliveryRef& delivery, const Responses& reply){
+                closeSession(session);
                 
-                std::string server;
-                int32_t port;
+                if(reply.isTransient() && scheduleRetry(delivery)) return;
+                
+                //when stopping, a spooled delivery is left for the next run
+                bool stopping;
                 {
                     std::lock_guard<std::mutex> lock(mDataMutex);
-                    server = mServer;
-                    port = mPort;
+                    stopping = mStopping;
                 }
+                signal(delivery, std::vector<int>(), !(reply.isTransient() && stopping));
+            }
+            
+            //retries the recipients that were refused temporarily, as a new delivery of the same merge
+            void deferRecipients(const TransactionRef& transaction){
+                const DeliveryRef& delivery = transaction->mDelivery;
                 
-                if(!server.size()){
-                    //no server set
-                    return socket;
+                DeliveryRef deferred(new Delivery());
+                deferred->mMessage = delivery->mMessage;
+                deferred->mMerge = delivery->mMerge;
+                deferred->mAttempts = delivery->mAttempts;
+                deferred->mDomain = delivery->mDomain;
+                deferred->mSender = delivery->mSender;
+                for(size_t i=0; i<delivery->mRecipients.size(); ++i){
+                    if(transaction->mReplies[i]/100!=4) continue;
+                    
+                    deferred->mRecipients.push_back(delivery->mRecipients[i]);
+                    deferred->mOwners.push_back(delivery->mOwners[i]);
                 }
+                if(deferred->mRecipients.empty()) return;
                 
-                //static smtp for now
-                boost::asio::ip::tcp::resolver resolver(ios);
-                boost::asio::ip::tcp::resolver::query query(server, ci::toString(port));
-                
-                try {
-                    boost::asio::ip::tcp::resolver::iterator endpoint_iterator = resolver.resolve(query);
-                    
-                    socket = SocketRef(new boost::asio::ip::tcp::socket(ios));
-                    boost::asio::connect(*socket, endpoint_iterator);
-                }catch(...){
-                    return SocketRef();
+                //the spooled entry of the delivery is acknowledged when it is signaled, so the deferred part gets its own
+                SpoolRef spool = getSpool();
+                if(delivery->mSpoolId){
+                    deferred->mSpoolId = spool->appendCopy(createEnvelope(deferred), delivery->mSpoolId);
                 }
                 
-                return socket;
+                //the messages are signaled when the retry is done as well
+                {
+                    std::lock_guard<std::mutex> lock(deferred->mMerge->mMutex);
+                    ++deferred->mMerge->mPending;
+                }
+                if(scheduleRetry(deferred)) return;
                 
+                //no retries left, so the recipients stay refused
+                {
+                    std::lock_guard<std::mutex> lock(deferred->mMerge->mMutex);
+                    --deferred->mMerge->mPending;
+                }
+                if(deferred->mSpoolId){
+                    spool->acknowledge(deferred->mSpoolId);
+                }
             }
             
-            //disconnect the socket
-            Mailer::Responses disconnect(SocketRef socket){
+            //queues the delivery again after the backoff delay, false when it should not be tried again
+            bool scheduleRetry(const DeliveryRef& delivery){
+                std::lock_guard<std::mutex> lock(mDataMutex);
+                if(mStopping || delivery->mAttempts>=mMaxAttempts) return false;
                 
+                //doubles every attempt, jittered between half and one and a half times
+                double delay = std::min(mRetryDelay * std::pow(2.0, double(delivery->mAttempts)), mMaxRetryDelay);
+                delay *= std::uniform_real_distribution<double>(0.5, 1.5)(mRandom);
+                ++delivery->mAttempts;
                 
-                Responses reply = sendData(socket, "QUIT");
-                try {
-                    if(socket->is_open()){
-                        socket->shutdown(boost::asio::ip::tcp::socket::shutdown_both);
-                        socket->close();
-                    }
-                }catch(...){
-                    
+                //an idle wheel is behind, bring it to now before counting from it
+                if(mRetries.empty()){
+                    mRetries.advance(getRetryTick(), [](const DeliveryRef&){});
                 }
+                mRetries.insert(delivery, static_cast<uint64_t>(std::ceil(delay / MAIL_SMTP_RETRY_TICK)));
                 
-                return reply;
+                if(!mRetryTimerArmed){
+                    armRetryTimer();
+                }
+                return true;
+            }
+            
+            //lowercase part after the @
+            static std::string getDomain(const std::string& address){
+                size_t at = address.rfind('@');
+                return boost::algorithm::to_lower_copy(at==std::string::npos ? std::string() : address.substr(at + 1));
+            }
+            
+            //the MAIL FROM and RCPT TO lines of the delivery, only made to spool it
+            static Message::Headers createEnvelope(const DeliveryRef& delivery){
+                Message::Headers envelope;
+                envelope.reserve(1 + delivery->mRecipients.size());
+                envelope.push_back(HeaderWriter::createCommand("MAIL FROM:", delivery->mSender));
+                for(auto& recipient: delivery->mRecipients){
+                    envelope.push_back(HeaderWriter::createCommand("RCPT TO:", recipient));
+                }
+                return envelope;
+            }
+            
+            //the most sessions to a single destination, the session mutex has to be locked
+            size_t getMaxSessionsLocked() const{
+                return mMaxDestinationSessions ? std::min(mMaxDestinationSessions, mMaxSessions) : mMaxSessions;
+            }
+            
+            //the session mutex has to be locked
+            size_t getConcurrencyLimitLocked(const Destination& destination) const{
+                if(!mAdaptiveConcurrency) return getMaxSessionsLocked();
+                return std::min(getMaxSessionsLocked(), destination.mConcurrency->getLimit());
+            }
+            
+            //created on first use, the session mutex has to be locked
+            Destination& getDestination(const std::string& domain){
+                DestinationRef& destination = mDestinations[domain];
+                if(!destination){
+                    destination = DestinationRef(new Destination(getMaxSessionsLocked()));
+                }
+                return *destination;
             }
             
-            Mailer::Responses authenticate(SocketRef socket){
-                Responses reply;
+            //a transaction to the destination is done, so the deliveries waiting for it get the places that are free
+            //with closed its session is gone as well, both mutexes have to be locked
+            void releaseDestination(const std::string& domain, bool closed){
+                std::unordered_map<std::string, DestinationRef>::iterator itr = mDestinations.find(domain);
+                if(itr==mDestinations.end()) return;
+                Destination& destination = *itr->second;
+                if(closed){
+                    --destination.mOpenSessions;
+                }
                 
-                //shake hands
-                reply = sendData(socket, "EHLO cinder.local");
-                if(reply!=250) return reply;
+                size_t idleSessions = std::count_if(mSessions.begin(), mSessions.end(), [&domain](const SessionRef& session){
+                    return session->getDestination()==domain;
+                });
+                size_t busy = destination.mOpenSessions - idleSessions;
+                size_t limit = getConcurrencyLimitLocked(destination);
+                for(size_t i=busy; i<limit && !destination.mWaiting.empty(); ++i){
+                    mDeliveries.push(destination.mWaiting.front());
+                    destination.mWaiting.pop_front();
+                }
+                
+                //starts probing from a single transaction again next time
+                if(!destination.mOpenSessions && destination.mWaiting.empty()){
+                    mDestinations.erase(itr);
+                }
+            }
+            
+            //a 421 or 451 to the greeting, MAIL FROM or DATA is the server asking for fewer transactions
+            //to a RCPT TO it is about the recipient, like greylisting, so those are not reported
+            static void checkThrottled(const SessionRef& session, const Responses& reply){
+                if(reply==421 || reply==451){
+                    session->report(reply);
+                }
+            }
+            
+            //holds the delivery back until the rate limits allow it, the mutex has to be locked
+            void throttle(const DeliveryRef& delivery, double wait){
+                mThrottled.push_back(delivery);
                 
-                //SSL stuff is done in the connection, no TLS upgrading supported
+                //one timer for the earliest, the others are checked again when it fires
+                std::chrono::steady_clock::time_point until = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(wait));
+                if(mThrottleTimerArmed && mThrottleUntil<=until) return;
                 
-                //we have set a user name and password, so we should login
-                if(mUsername.size() && mPassword.size()){
-                    //detect the login type, should be found in the reply
-                    
+                mThrottleTimerArmed = true;
+                mThrottleUntil = until;
+                mThrottleTimer.expires_from_now(boost::posix_time::microseconds(static_cast<int64_t>(std::ceil(wait * 1000000))));
+                mThrottleTimer.async_wait([this](const boost::system::error_code& error){
+                    //moving the timer to an earlier time cancels the previous wait
+                    if(error) return;
                     
-                    if(mLoginType==PLAIN){//plain login
-                        
-                        //we create a identity/password combination
-                        std::stringstream login;
-                        //                    login << mUsername; //we can leave this out
-                        login << '\0';
-                        login << mUsername;
-                        login << '\0';
-                        login << mPassword;
-                        
-                        reply = sendData(socket, "AUTH PLAIN " + ci::toBase64(login.str()));
-                        
-                    }else if(mLoginType==LOGIN){//TBI
-                        reply = sendData(socket, "AUTH LOGIN");
-                        if(reply!=334 && reply.getResponse()!="VXNlcm5hbWU6"){ //it should return 334 and const base64 encoded string
-                            return reply;
-                        }
-                        reply = sendData(socket, ci::toBase64(mUsername));
-                        if(reply!=334 && reply.getResponse()!="UGFzc3dvcmQ6"){ //it should return 334 and const base64 encoded string
-                            return reply;
+                    {
+                        std::lock_guard<std::mutex> lock(mDataMutex);
+                        mThrottleTimerArmed = false;
+                        for(auto& delivery: mThrottled){
+                            mDeliveries.push(delivery);
                         }
-                        
-                        reply = sendData(socket, ci::toBase64(mPassword));
+                        mThrottled.clear();
                     }
+                    dispatch();
+                });
+            }
+            
+            //the current tick of the retry wheel, the mutex has to be locked
+            uint64_t getRetryTick() const{
+                return static_cast<uint64_t>(std::chrono::duration<double>(std::chrono::steady_clock::now() - mRetryStart).count() / MAIL_SMTP_RETRY_TICK);
+            }
+            
+            //ticks while retries are waiting, the mutex has to be locked
+            void armRetryTimer(){
+                mRetryTimerArmed = true;
+                mRetryTimer.expires_from_now(boost::posix_time::milliseconds(static_cast<int64_t>(MAIL_SMTP_RETRY_TICK * 1000)));
+                mRetryTimer.async_wait([this](const boost::system::error_code& error){
+                    retryTick(error);
+                });
+            }
+            
+            //queues the retries that are due
+            void retryTick(const boost::system::error_code& error){
+                bool due = false;
+                {
+                    std::lock_guard<std::mutex> lock(mDataMutex);
+                    mRetryTimerArmed = false;
+                    if(error || mStopping) return;
                     
-                    
+                    mRetries.advance(getRetryTick(), [this, &due](const DeliveryRef& delivery){
+                        mDeliveries.push(delivery);
+                        due = true;
+                    });
+                    if(!mRetries.empty()){
+                        armRetryTimer();
+                    }
                 }
                 
-                return reply;
+                if(due){
+                    dispatch();
+                }
             }
             
-            //sends the data to the server and returns the responses
-            Mailer::Responses sendData(SocketRef socket, const std::string& data, bool appendNL=true){
-                
-                try {
-                    int bytesWritten = 0;
-                    if(!appendNL){
-                        bytesWritten = socket->write_some(boost::asio::buffer(data));
-                    }else{
-                        bytesWritten = socket->write_some(boost::asio::buffer(data+MAIL_SMTP_NEWLINE));
-                    }
-                    
-                    if(bytesWritten==0){
-                        return Responses();
+            //returns a session to the pool, or closes it when it has done enough work
+            void releaseSession(const SessionRef& session){
+                bool keep;
+                {
+                    std::lock_guard<std::mutex> lock(mDataMutex);
+                    std::lock_guard<std::mutex> sessionLock(mSessionMutex);
+                    keep = !(mStopping && mDeliveries.empty()) && session->getMessageCount()<mMaxMessagesPerSession && mSessions.size()<mMaxIdleSessions;
+                    if(keep){
+                        mSessions.push_back(session);
+                        releaseDestination(session->getDestination(), false);
+                        armIdleTimer();
                     }
-                    
-                    
-                    return readReply(socket);
-                }catch(...){
-                    //error
                 }
                 
-                return Responses();
+                if(keep){
+                    dispatch();
+                }else{
+                    closeSession(session);
+                }
+            }
+            
+            //closes the session, frees its slot and lets a waiting message use it
+            void closeSession(const SessionRef& session){
+                quit(session);
+                {
+                    std::lock_guard<std::mutex> lock(mDataMutex);
+                    std::lock_guard<std::mutex> sessionLock(mSessionMutex);
+                    --mOpenSessions;
+                    releaseDestination(session->getDestination(), true);
+                }
+                dispatch();
             }
             
-            //gets the respjnses from the server
-            Mailer::Responses readReply(SocketRef socket){
+            //closes all pooled sessions
+            void closeIdleSessions(){
+                std::vector<SessionRef> sessions;
+                {
+                    std::lock_guard<std::mutex> lock(mSessionMutex);
+                    sessions.swap(mSessions);
+                    mIdleTimer.cancel();
+                }
+                for(auto& session: sessions){
+                    closeSession(session);
+                }
+            }
+            
+            //waits for the pooled session that was used the longest ago, so it is closed when the idle timeout passes
+            //an idle connection holds a slot of the server otherwise, both mutexes have to be locked
+            void armIdleTimer(){
+                if(mIdleTimerArmed || mStopping || mSessions.empty()) return;
+                
+                std::chrono::steady_clock::time_point oldest = mSessions.front()->getLastUsed();
+                for(auto& session: mSessions){
+                    oldest = std::min(oldest, session->getLastUsed());
+                }
+                //a little later, so the session is idle for more than the timeout when it fires
+                int64_t wait = std::chrono::duration_cast<std::chrono::milliseconds>(oldest + mSessionIdleTimeout - std::chrono::steady_clock::now()).count() + 1;
                 
-                try{
-                    boost::array<char, 8192> buf; //very large buff just in case the server blabs a lot
+                mIdleTimerArmed = true;
+                mIdleTimer.expires_from_now(boost::posix_time::milliseconds(std::max<int64_t>(wait, 1)));
+                mIdleTimer.async_wait([this](const boost::system::error_code& error){
+                    //moving the timer to another time cancels the previous wait
+                    if(error) return;
+                    closeExpiredSessions();
+                });
+            }
+            
+            //closes the pooled sessions that are idle for longer than the timeout
+            void closeExpiredSessions(){
+                std::vector<SessionRef> expired;
+                {
+                    std::lock_guard<std::mutex> lock(mDataMutex);
+                    std::lock_guard<std::mutex> sessionLock(mSessionMutex);
+                    mIdleTimerArmed = false;
                     
-                    int bytesRead = socket->read_some(boost::asio::buffer(buf));
-                    if(bytesRead==0){
-                        return Responses();
+                    std::vector<SessionRef>::iterator end = std::stable_partition(mSessions.begin(), mSessions.end(), [this](const SessionRef& session){
+                        return !session->isIdleFor(mSessionIdleTimeout);
+                    });
+                    expired.assign(end, mSessions.end());
+                    mSessions.erase(end, mSessions.end());
+                    armIdleTimer();
+                }
+                for(auto& session: expired){
+                    closeSession(session);
+                }
+            }
+            
+            //says goodbye and closes the socket
+            void quit(const SessionRef& session){
+                if(!session->isOpen()){
+                    session->close();
+                    return;
+                }
+                session->sendData("QUIT", [session](const Responses&){
+                    session->close();
+                });
+            }
+            
+            void authenticate(const SessionRef& session, const Session::ReplyHandler& handler){
+                std::string username, password;
+                LoginType loginType;
+                {
+                    std::lock_guard<std::mutex> lock(mDataMutex);
+                    username = mUsername;
+                    password = mPassword;
+                    loginType = mLoginType;
+                }
+                
+                //shake hands
+                session->sendData("EHLO cinder.local", [session, handler, username, password, loginType](const Responses& reply){
+                    if(reply!=250){
+                        handler(reply);
+                        return;
                     }
                     
-                    std::string response(buf.data(),bytesRead);
+                    //remember what the server supports
+                    session->setCapabilities(reply);
                     
-                    return Responses(ci::split(response, MAIL_SMTP_NEWLINE));
-                }catch(...){
+                    //SSL stuff is done in the connection, no TLS upgrading supported
                     
-                }
-                
-                return Responses();
+                    //we have set a user name and password, so we should login
+                    if(!username.size() || !password.size()){
+                        handler(reply);
+                        return;
+                    }
+                    
+                    if(loginType==PLAIN){//plain login
+                        
+                        //we create a identity/password combination
+                        std::stringstream login;
+                        //                    login << mUsername; //we can leave this out
+                        login << '\0';
+                        login << username;
+                        login << '\0';
+                        login << password;
+                        
+                        session->sendData("AUTH PLAIN " + ci::toBase64(login.str()), handler);
+                        
+                    }else if(loginType==LOGIN){
+                        session->sendData("AUTH LOGIN", [session, handler, username, password](const Responses& reply){
+                            if(reply!=334 && reply.getResponse()!="VXNlcm5hbWU6"){ //it should return 334 and const base64 encoded string
+                                handler(reply);
+                                return;
+                            }
+                            session->sendData(ci::toBase64(username), [session, handler, password](const Responses& reply){
+                                if(reply!=334 && reply.getResponse()!="UGFzc3dvcmQ6"){ //it should return 334 and const base64 encoded string
+                                    handler(reply);
+                                    return;
+                                }
+                                
+                                session->sendData(ci::toBase64(password), handler);
+                            });
+                        });
+                    }else{
+                        handler(reply);
+                    }
+                });
             }
             
             //thread
             std::mutex                      mDataMutex;
-            bool                            mThreadRunning;
+            bool                            mStopping;
             
-            std::shared_ptr<std::thread>    mThread;
-            std::queue<MessageRef>         mMessages;
+            std::vector<std::shared_ptr<std::thread> >  mWorkers;
+            size_t                          mWorkerCount;
+            std::queue<DeliveryRef>         mDeliveries;
             
             //server settings
             std::string mServer;
@@ -440,15 +1531,66 @@ namespace cinder {
             std::string mUsername;
             std::string mPassword;
             LoginType mLoginType;
+            bool mPipelining;
+            size_t mMaxRecipientsPerTransaction;
+            SpoolRef mSpool;
             bool mSSL;
             
+            //session pool
+            std::mutex                      mSessionMutex;
+            std::vector<SessionRef>         mSessions;
+            size_t                          mMaxMessagesPerSession;
+            size_t                          mMaxIdleSessions;
+            size_t                          mMaxSessions;
+            size_t                          mMaxDestinationSessions; //0 when only the maximum sessions count
+            size_t                          mOpenSessions;
+            std::chrono::steady_clock::duration mSessionIdleTimeout;
+            double                          mTimeout;
+            
             //notifications
             SentSignalType  mSignalSent;
+            RecipientSignalType mSignalRecipient;
+            
+            ThroughputRef   mThroughput;
+            AttachmentCacheRef mAttachmentCache;
             
             io_service ios;
+            std::shared_ptr<io_service::work> mWork;
+            
+            //closes the pooled sessions once they are idle, guarded by the session mutex
+            deadline_timer                  mIdleTimer;
+            bool                            mIdleTimerArmed;
+            
+            //limits on how fast and how many at the same time, the throttled deliveries are guarded by the data mutex
+            RateLimitsRef                   mRateLimits;
+            MXCacheRef                      mMXCache; //guarded by the data mutex
+            std::unordered_map<std::string, DestinationRef> mDestinations; //guarded by the session mutex
+            bool                            mAdaptiveConcurrency; //guarded by the session mutex
+            std::vector<DeliveryRef>        mThrottled;
+            deadline_timer                  mThrottleTimer;
+            bool                            mThrottleTimerArmed;
+            std::chrono::steady_clock::time_point mThrottleUntil;
+            
+            //deliveries waiting to be tried again, guarded by the data mutex
+            TimerWheel<DeliveryRef>         mRetries;
+            size_t                          mMaxAttempts;
+            double                          mRetryDelay;
+            double                          mMaxRetryDelay;
+            deadline_timer                  mRetryTimer;
+            bool                            mRetryTimerArmed;
+            std::chrono::steady_clock::time_point mRetryStart;
+            std::mt19937                    mRandom;
+            
+            //sent messages on their way to the delivery thread
+            MPSCQueue<Submission>           mSubmissions;
+            std::atomic<bool>               mParked;
+            std::mutex                      mParkMutex;
+            std::condition_variable         mParkCondition;
+            bool                            mSubmitterStopping; //guarded by the park mutex
+            std::shared_ptr<std::thread>    mSubmitter;
             
         };
         
         
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,46 @@
+//
+//  MappedFile.h
+//  MailBlock
+//
+//  Created by Sylvain Vriens on 25/04/2013.
+//
+//
+
+#pragma once
+
+#include "cinder/Cinder.h"
+
+namespace cinder {
+    namespace mail {
+        
+        class MappedFile;
+        typedef std::shared_ptr<MappedFile> MappedFileRef;
+        
+        //a read only memory mapping of a file, read sequentially
+        //opening a file that is mapped already shares the mapping, so concurrent sends use the same pages
+        class MappedFile {
+        public:
+            //an empty reference when the file can not be mapped
+            static MappedFileRef open(const ci::fs::path& path);
+            
+            ~MappedFile();
+            
+            const char* getData() const{
+                return mData;
+            }
+            
+            size_t getSize() const{
+                return mSize;
+            }
+        
+        protected:
+            MappedFile() : mData(NULL), mSize(0){}
+            
+            bool map(const ci::fs::path& path);
+            
+            const char* mData;
+            size_t      mSize;
+        };
+        
+    }
+}
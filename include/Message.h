@@ -16,15 +16,29 @@
 #include "cinder/DataSource.h"
 
 #include "Mail.h"
+#include "MappedFile.h"
+#include "HeaderWriter.h"
+#include "Encoding.h"
+#include "AttachmentCache.h"
 
 #include <boost/algorithm/string/case_conv.hpp>
 #include <regex>
+#include <mutex>
+#include <functional>
 
 namespace cinder {
     namespace mail {
         
         typedef std::shared_ptr<class Message> MessageRef;
         
+        //wraps the text at the last space within the line width in a single pass, appended to the output
+        //line endings become CRLF and a dot that starts a line is doubled, so it can follow DATA as it is
+        void formatText(const char* data, size_t size, std::string& output);
+        
+        //the text of html in a single pass, appended to the output
+        //tags, scripts and styles are stripped, blocks become line breaks and entities are decoded
+        void stripHTML(const char* data, size_t size, std::string& output);
+        
         class Message {
         public:
             enum recipient_type {
@@ -46,19 +60,24 @@ namespace cinder {
                     if(mAddress.size()==0) return false;
                     return true;
                 }
-                std::string getAddress() const{
+                const std::string& getAddress() const{
                     return mAddress;
                 }
-                std::string getName() const{
+                const std::string& getName() const{
                     return mName;
                 }
                 std::string getFullAddress(bool includeName=true) const{
-                    std::stringstream ret;
-                    if(includeName && mName.size()){
-                        ret << "mNAme" << " ";
+                    HeaderWriter output(mName.size()*3 + mAddress.size() + 32);
+                    write(output, includeName);
+                    return output.str();
+                }
+                //the name is quoted or encoded when needed, with separator a comma follows for the next address of a list
+                void write(HeaderWriter& output, bool includeName=true, bool separator=false) const{
+                    if(includeName){
+                        output.writeAddress(mName, mAddress, separator);
+                    }else{
+                        output.writeAddress("", mAddress, separator);
                     }
-                    ret << "<" << mAddress << ">";
-                    return ret.str();
                 }
             protected:
                 
@@ -71,11 +90,78 @@ namespace cinder {
             class Attachment;
             typedef std::shared_ptr<Attachment> AttachmentRef;
             
+            typedef std::shared_ptr<const std::string> SharedText;
+            
+            //a piece of the serialized message, either text or an attachment that still needs encoding
+            //shared text is not copied, so many messages can point to the same pieces
+            struct Segment {
+                Segment(const std::string& data) : mData(data){}
+                Segment(const SharedText& shared) : mShared(shared){}
+                Segment(const AttachmentRef& attachment) : mAttachment(attachment){}
+                
+                const std::string& getData() const{
+                    return mShared ? *mShared : mData;
+                }
+                
+                std::string     mData;
+                SharedText      mShared;
+                AttachmentRef   mAttachment;
+            };
+            
+            //the serialized message, text is merged so attachments split the list
+            struct Segments : public std::vector<Segment> {
+                
+                Segments& operator<<(const std::string& data){
+                    if(empty() || back().mAttachment || back().mShared){
+                        push_back(Segment(data));
+                    }else{
+                        back().mData += data;
+                    }
+                    return *this;
+                }
+                
+                Segments& operator<<(const char* data){
+                    return *this << std::string(data);
+                }
+                
+                Segments& operator<<(const SharedText& shared){
+                    push_back(Segment(shared));
+                    return *this;
+                }
+                
+                Segments& operator<<(const AttachmentRef& attachment){
+                    push_back(Segment(attachment));
+                    return *this;
+                }
+                
+                Segments& operator<<(const Segments& segments){
+                    for(auto& segment: segments){
+                        if(segment.mAttachment || segment.mShared){
+                            push_back(segment);
+                        }else{
+                            *this << segment.mData;
+                        }
+                    }
+                    return *this;
+                }
+                
+                //everything in one string, encoding the attachments
+                std::string str() const;
+            };
+            
             //creator function
             static MessageRef create(){
                 return MessageRef(new Message());
             }
             
+            //a message that is serialized already, like one read back from a spool
+            static MessageRef create(const Headers& envelope, std::string data){
+                MessageRef msg(new Message());
+                msg->mEnvelope = envelope;
+                msg->mBody << std::make_shared<const std::string>(std::move(data));
+                return msg;
+            }
+            
             AttachmentRef addAttachment(const ci::DataSourceRef& dataSource, bool embed=false){
                 return addAttachment(Attachment::create(dataSource, embed));
             }
@@ -167,11 +253,38 @@ namespace cinder {
             }
             
             Headers getHeaders();
-            std::string getData() const;
+            
+            //text that is not plain ascii is written as 8bit when eightBit is set, which needs a server with 8BITMIME
+            //otherwise it is quoted-printable or base64, whichever is smaller
+            std::string getData(bool eightBit=false) const;
+            Segments getSegments(bool eightBit=false) const;
+            
+            //the same without temporary strings, appended to a writer that can be reused for every message
+            //the envelope is a MAIL FROM and RCPT TO line per recipient, the headers end with the empty line
+            void writeEnvelope(HeaderWriter& output) const;
+            void writeHeaders(HeaderWriter& output, bool date=true, bool eightBit=false) const;
+            
+            //whether the text has bytes above 127, so sending it as 8bit saves encoding it
+            bool isEightBit() const;
+            
+            //the address of the MAIL FROM
+            std::string getSender() const;
+            
+            //the addresses of the RCPT TO headers, in the same order
+            std::vector<std::string> getRecipients() const;
+            
+            //hash of everything that is sent except the date, messages with the same content have the same hash
+            uint64_t getContentHash() const;
+            
+            //whether everything that is sent except the date is the same, to confirm messages with the same hash
+            //attachments are the same when they are the same object, or have the same path and content
+            bool hasSameContent(const Message& other) const;
             
             
         protected:
-            Message(){
+            friend class MessageTemplate;
+            
+            Message() : mBodyEightBit(false){
                 mContent = Content::create();
             }
             
@@ -179,7 +292,14 @@ namespace cinder {
                 return !mAttachments.empty() || mContent->isMultiPart();
             }
             
-            std::string formatDate() const;
+            //the headers up to the empty line, and everything after it including the terminating dot
+            void writeHeaders(Segments& data, bool date=true, bool eightBit=false) const;
+            void writeBody(Segments& data, bool eightBit=false) const;
+            
+            void writeDate(HeaderWriter& output) const;
+            
+            //the headers without the date and the body, what the content hash and comparison are over
+            void writeContent(Segments& data) const;
             
             //some define from helpe classes later on
             class Content;
@@ -196,6 +316,20 @@ namespace cinder {
             std::vector<Address>        mBCC;
             std::string                 mSubject;
             
+            //the body rendered by a template, written instead of the content when set and it fits the session
+            //it is formatted text with the fields in place, when it is 8bit the fallback is sent without 8BITMIME
+            Segments                    mBody;
+            bool                        mBodyEightBit;
+            
+            //the same message rendered from the content of the template, so every part gets the encoding its text needs
+            //made the first time a session without 8BITMIME needs it, a server that takes 8bit never pays for it
+            std::function<MessageRef()> mRenderFallback;
+            mutable std::once_flag      mFallbackRendered;
+            mutable MessageRef          mFallback;
+            
+            //the envelope of a serialized message, then the body is the complete message
+            Headers                     mEnvelope;
+            
             //****************//
             // HELPER CLASSES //
             //****************//
@@ -216,25 +350,49 @@ namespace cinder {
                     return TextRef(new Text(content));
                 }
                 
-                virtual Headers getHeaders() const;
-                virtual std::string getData() const;
+                virtual Headers getHeaders(bool eightBit=false) const;
+                virtual std::string getData(bool eightBit=false) const;
                 
+                //the content is scanned once here, the encoding is picked from it for every message
                 void setContent(const std::string& content){
                     mContent = content;
+                    mScan = scanText(mContent.data(), mContent.size());
                 }
                 
                 std::string getText(){
                     return mContent;
                 }
+                
+                const std::string& getContent() const{
+                    return mContent;
+                }
+                
+                bool isEightBit() const{
+                    return mScan.mEightBit>0;
+                }
+                
+                TransferEncoding getTransferEncoding(bool eightBit) const{
+                    return selectTransferEncoding(mContent.size(), mScan, eightBit);
+                }
+                
+                //whether it is sent as formatted text when the server takes 8bit, so text can be inserted into it
+                bool isFormatted() const{
+                    TransferEncoding encoding = getTransferEncoding(true);
+                    return encoding==ENCODING_7BIT || encoding==ENCODING_8BIT;
+                }
             protected:
                 Text(const std::string& content=""){
-                    mContent = content;
+                    setContent(content);
                 }
                 
                 //format for max 100 chars per line and not single '.' on a line
                 std::string formatRFC(const std::string& data) const;
                 
+                //formatted for 7bit and 8bit, encoded for the others
+                static void encode(const char* data, size_t size, TransferEncoding encoding, std::string& output);
+                
                 std::string mContent;
+                TextScan    mScan;
             };
             
             class HTML : public Text {
@@ -252,15 +410,20 @@ namespace cinder {
                     return !mAttachments.empty();
                 }
                 
+                const std::vector<AttachmentRef>& getAttachments() const{
+                    return mAttachments;
+                }
+                
                 //will strip HTML and return text
                 std::string getText();
                 
-                virtual Headers getHeaders() const;
-                std::string getData() const;
+                virtual Headers getHeaders(bool eightBit=false) const;
+                std::string getData(bool eightBit=false) const;
+                Segments getSegments(bool eightBit=false) const;
                 
             protected:
                 HTML(const std::string& content=""){
-                    mContent = content;
+                    setContent(content);
                 }
                 
                 std::string findReplaceCID(const std::string& data) const;
@@ -283,7 +446,22 @@ namespace cinder {
                 }
                 
                 Headers getHeaders() const;
-                std::string getData() const;
+                std::string getData(bool eightBit=false) const;
+                Segments getSegments(bool eightBit=false) const;
+                
+                //the content type and transfer encoding of a message that is only text, nothing for a multipart one
+                void writeHeaders(HeaderWriter& output, bool eightBit=false) const;
+                
+                bool isEightBit() const{
+                    return (mText && mText->isEightBit()) || (mHTML && mHTML->isEightBit());
+                }
+                
+                bool isFormatted() const{
+                    return (!mText || mText->isFormatted()) && (!mHTML || mHTML->isFormatted());
+                }
+                
+                //a copy with the text and html passed through the function, the attachments are shared
+                ContentRef render(const std::function<std::string(const std::string&)>& text) const;
                 
                 void addAttachment(const AttachmentRef& attachment){
                     if(!mHTML){
@@ -343,17 +521,60 @@ namespace cinder {
                     return mDataSource->getFilePath().filename().string();
                 }
                 
-                Headers getHeaders() const;
+                ci::DataSourceRef getDataSource() const{
+                    return mDataSource;
+                }
+                
+                //maps the file into memory, an empty reference when the data is not a file
+                MappedFileRef map() const{
+                    if(!mDataSource->isFilePath()) return MappedFileRef();
+                    return MappedFile::open(mDataSource->getFilePath());
+                }
+                
+                //built once, the file name does not change
+                const Headers& getHeaders() const{
+                    return mHeaders;
+                }
                 std::string getData() const;
                 
+                //hash of the content, for sharing the encoding between attachments with the same data
+                uint64_t getContentHash() const{
+                    std::call_once(mHashed, &Attachment::hashContent, this);
+                    return mHash;
+                }
+                
+                //size of the content in bytes
+                size_t getContentSize() const{
+                    std::call_once(mHashed, &Attachment::hashContent, this);
+                    return mSize;
+                }
+                
+                //the hash, size and a second hash of the content, to look up its encoding without mixing up content with the same hash
+                AttachmentCache::Source getSource() const{
+                    std::call_once(mHashed, &Attachment::hashContent, this);
+                    return AttachmentCache::Source(mHash, mCheck, mSize);
+                }
+                
             protected:
                 Attachment(const ci::DataSourceRef& datasource, bool embedded=false){
                     mDataSource = datasource;
                     mEmbedded = embedded;
+                    mHeaders = createHeaders();
                 }
                 
+                Headers createHeaders() const;
+                
+                //reads the content once for the hashes and size
+                void hashContent() const;
+                
                 ci::DataSourceRef mDataSource;
                 bool mEmbedded;
+                Headers mHeaders;
+                
+                mutable std::once_flag mHashed;
+                mutable uint64_t mHash;
+                mutable uint64_t mCheck;
+                mutable size_t mSize;
             };
             
         protected:
@@ -0,0 +1,78 @@
+//
+//  MessageTemplate.h
+//  MailBlock
+//
+//  Created by Sylvain Vriens on 25/04/2013.
+//
+//
+
+#pragma once
+
+#include "Message.h"
+
+#include <map>
+
+namespace cinder {
+    namespace mail {
+        
+        class MessageTemplate;
+        typedef std::shared_ptr<MessageTemplate> MessageTemplateRef;
+        
+        //a message sent to many recipients that only differ in a few fields
+        //the body is formatted once, rendering a message only fills in the fields and shares the rest
+        //fields are written as {{name}} in the subject, the text and the html
+        //a message with values that are not plain ascii, or that make its lines too long, is formatted from its own content
+        //so the transfer encoding of every part is picked over the text with the values in place
+        class MessageTemplate {
+        public:
+            typedef std::map<std::string, std::string> Fields;
+            
+            //the message should not change anymore, its recipients are ignored
+            static MessageTemplateRef create(const MessageRef& message){
+                return MessageTemplateRef(new MessageTemplate(message));
+            }
+            
+            //a message to a single recipient
+            MessageRef render(const std::string& address, const std::string& name="", const Fields& fields=Fields()) const;
+            
+            //the names of the fields that are used
+            std::vector<std::string> getFields() const;
+        
+        protected:
+            MessageTemplate(const MessageRef& message);
+            
+            //a piece of the compiled body, text, a field or an attachment
+            struct Part {
+                Part() : mFirstLine(0), mLastLine(0), mBreak(false), mDot(false){}
+                
+                Message::SharedText mText;
+                std::string         mField;
+                AttachmentRef       mAttachment;
+                
+                //of the text, so the length of the lines with fields is known without scanning it again
+                size_t              mFirstLine; //characters before the first line break, all of them without one
+                size_t              mLastLine; //characters after the last line break
+                bool                mBreak; //whether it has a line break
+                bool                mDot; //starts with a dot that is not stuffed, the template did not start a line there
+            };
+            
+            //calls the handler for every piece of text and field in the data
+            template<typename TextHandler, typename FieldHandler>
+            static void parse(const std::string& data, TextHandler text, FieldHandler field);
+            
+            //the data with the values of the fields in place
+            static std::string substitute(const std::string& data, const Fields& fields);
+            
+            //a message to the recipient with the addresses, attachments and content of the source, and the subject filled in
+            static MessageRef createMessage(const MessageRef& source, const std::string& address, const std::string& name, const Fields& fields);
+            
+            //the content of the source with the fields in place, formatted from scratch
+            static Message::ContentRef renderContent(const MessageRef& source, const Fields& fields);
+            
+            MessageRef          mMessage;
+            std::vector<Part>   mParts;
+            bool                mFormatted; //whether every part is formatted text, otherwise a field can not be inserted
+        };
+        
+    }
+}
@@ -0,0 +1,74 @@
+//
+//  MessageWriter.h
+//  MailBlock
+//
+//  Created by Sylvain Vriens on 25/04/2013.
+//
+//
+
+#pragma once
+
+#include "Message.h"
+#include "AttachmentCache.h"
+
+#include <boost/asio/buffer.hpp>
+
+namespace cinder {
+    namespace mail {
+        
+        class MessageWriter;
+        typedef std::shared_ptr<MessageWriter> MessageWriterRef;
+        
+        //produces the serialized message in chunks of a fixed size
+        //attachments are read and encoded while writing, so they are never in memory as a whole
+        class MessageWriter {
+        public:
+            //attachments are taken from and added to the cache when one is given
+            //text is only written as 8bit when the server announced 8BITMIME, otherwise it is encoded when needed
+            static MessageWriterRef create(const MessageRef& msg, const AttachmentCacheRef& cache=AttachmentCacheRef(), size_t chunkSize=MAIL_SMTP_CHUNK_SIZE, bool eightBit=false){
+                return MessageWriterRef(new MessageWriter(msg->getSegments(eightBit), cache, chunkSize));
+            }
+            
+            typedef std::vector<boost::asio::const_buffer> Buffers;
+            
+            //replaces the buffers with the next part of the message, returns false when everything is written
+            //text is referenced in place, the buffers stay valid until the next call
+            bool next(Buffers& buffers);
+            
+            //same, but copies the chunk into a string
+            bool next(std::string& chunk);
+            
+            //total amount of bytes handed out so far
+            size_t getBytesWritten() const{
+                return mBytesWritten;
+            }
+        
+        protected:
+            MessageWriter(const Message::Segments& segments, const AttachmentCacheRef& cache, size_t chunkSize);
+            
+            //the cached encoding of an attachment, encoding and adding it when it fits
+            AttachmentCache::BodyRef lookup(const AttachmentRef& attachment);
+            
+            //appends encoded lines of the current attachment, returns false once the attachment is done
+            bool encode(std::string& chunk, size_t available);
+            
+            Message::Segments   mSegments;
+            AttachmentCacheRef  mCache;
+            size_t              mChunkSize;
+            
+            size_t              mSegment;
+            size_t              mOffset; //within a text segment, cached body or mapped file
+            
+            ci::IStreamRef      mStream; //of the current attachment, when it is not a file
+            MappedFileRef       mFile; //of the current attachment
+            AttachmentCache::BodyRef                mBody; //cached encoding of the current attachment
+            std::vector<AttachmentCache::BodyRef>   mHeld; //bodies the current buffers point to
+            bool                mFirstLine;
+            std::vector<char>   mInput;
+            std::string         mEncoded; //output of the current chunk, never reallocated
+            
+            size_t              mBytesWritten;
+        };
+        
+    }
+}
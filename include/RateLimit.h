@@ -0,0 +1,172 @@
+//
+//  RateLimit.h
+//  MailBlock
+//
+//  Created by Sylvain Vriens on 25/04/2013.
+//
+//
+
+#pragma once
+
+#include "cinder/Cinder.h"
+#include "cinder/Thread.h"
+
+#include <unordered_map>
+#include <chrono>
+
+namespace cinder {
+    namespace mail {
+        
+        class RateLimits;
+        typedef std::shared_ptr<RateLimits> RateLimitsRef;
+        
+        class Concurrency;
+        typedef std::shared_ptr<Concurrency> ConcurrencyRef;
+        
+        //allows a number of events per second with bursts up to its size, a rate of 0 allows everything
+        class TokenBucket {
+        public:
+            TokenBucket(double rate=0, double burst=1) : mRate(rate), mBurst(std::max(burst, 1.0)), mTokens(mBurst), mLast(-1){}
+            
+            //seconds until the next event is allowed, 0 when it is allowed now
+            double getDelay(double now){
+                refill(now);
+                if(mRate<=0 || mTokens>=1) return 0;
+                return (1 - mTokens) / mRate;
+            }
+            
+            void take(double now){
+                refill(now);
+                if(mRate>0) mTokens -= 1;
+            }
+            
+            //nothing was taken for a while, forgetting the bucket changes nothing
+            bool isFull(double now){
+                refill(now);
+                return mTokens>=mBurst;
+            }
+        
+        protected:
+            void refill(double now){
+                if(mLast>=0){
+                    mTokens = std::min(mBurst, mTokens + (now - mLast) * mRate);
+                }
+                mLast = now;
+            }
+            
+            double mRate;
+            double mBurst;
+            double mTokens;
+            double mLast;
+        };
+        
+        //messages per second to the server, from every sender and to every recipient domain
+        //a message takes a token from each of them, so the strictest one decides when it is sent
+        class RateLimits {
+        public:
+            static RateLimitsRef create(){
+                return RateLimitsRef(new RateLimits());
+            }
+            
+            //the server as a whole
+            void setServerRate(double perSecond, double burst=1);
+            
+            //every sender address on its own
+            void setSenderRate(double perSecond, double burst=1);
+            
+            //every recipient domain on its own, an empty domain sets the rate of the domains without their own
+            void setDomainRate(double perSecond, double burst=1, const std::string& domain="");
+            
+            //seconds until a message from the sender to the recipients is allowed, 0 when it can be sent now
+            double getDelay(const std::string& sender, const std::vector<std::string>& recipients);
+            
+            //counts the message against the limits, after it was allowed
+            void take(const std::string& sender, const std::vector<std::string>& recipients);
+        
+        protected:
+            RateLimits(){}
+            
+            struct Rate {
+                Rate() : mPerSecond(0), mBurst(1){}
+                Rate(double perSecond, double burst) : mPerSecond(perSecond), mBurst(burst){}
+                
+                double mPerSecond;
+                double mBurst;
+            };
+            
+            typedef std::unordered_map<std::string, TokenBucket> Buckets;
+            
+            //the buckets are created on first use, the mutex has to be locked for these
+            TokenBucket& getSender(const std::string& sender);
+            TokenBucket& getDomain(const std::string& domain);
+            void getDomains(const std::vector<std::string>& recipients, std::vector<std::string>& domains) const;
+            
+            bool isDomainLimited() const{
+                return mDomainRate.mPerSecond>0 || !mDomainRates.empty();
+            }
+            
+            //forgets full buckets, so a stream of new senders or domains does not grow the maps forever
+            void prune(Buckets& buckets, double now);
+            
+            static double now(){
+                return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+            }
+            
+            std::mutex                              mMutex;
+            TokenBucket                             mServer;
+            
+            Rate                                    mSenderRate;
+            Buckets                                 mSenders;
+            
+            Rate                                    mDomainRate;
+            std::unordered_map<std::string, Rate>   mDomainRates;
+            Buckets                                 mDomains;
+        };
+        
+        //the number of transactions a server can handle at the same time, found by probing (AIMD)
+        //grows by one every window of accepted messages, and is cut when the server throttles with 421 or 451,
+        //or when the replies to messages get much slower than usual
+        class Concurrency {
+        public:
+            static ConcurrencyRef create(size_t maximum){
+                return ConcurrencyRef(new Concurrency(maximum));
+            }
+            
+            //observes the reply to a message and how many seconds the server took, a negative time when it was not measured
+            //a reply that was not timed only counts when it throttles
+            void replied(int code, double seconds);
+            
+            size_t getLimit() const{
+                std::lock_guard<std::mutex> lock(mMutex);
+                return static_cast<size_t>(mWindow);
+            }
+            
+            //the limit never grows beyond it
+            void setMaximum(size_t maximum){
+                std::lock_guard<std::mutex> lock(mMutex);
+                mMaximum = std::max<double>(maximum, 1);
+                mWindow = std::min(mWindow, mMaximum);
+            }
+            
+            //recent reply time to messages in seconds
+            double getLatency() const{
+                std::lock_guard<std::mutex> lock(mMutex);
+                return mLatency;
+            }
+        
+        protected:
+            Concurrency(size_t maximum) : mMaximum(std::max<double>(maximum, 1)), mWindow(1), mLatency(0), mBaseLatency(0), mLastDecrease(0){}
+            
+            //multiplies the window, once per round trip as the replies in flight report the same congestion
+            void decrease(double factor, double now);
+            
+            mutable std::mutex  mMutex;
+            double              mMaximum;
+            double              mWindow;
+            double              mLatency;
+            double              mBaseLatency; //the long term average
+            double              mLastDecrease;
+        };
+        
+    }
+}
@@ -0,0 +1,180 @@
+//
+//  Resolver.h
+//  MailBlock
+//
+//  Created by Sylvain Vriens on 25/04/2013.
+//
+//
+
+#pragma once
+
+#include "cinder/Cinder.h"
+#include "cinder/Thread.h"
+
+#include <unordered_map>
+#include <condition_variable>
+#include <deque>
+#include <chrono>
+#include <random>
+
+namespace cinder {
+    namespace mail {
+        
+        //a mail server of a domain, lower priorities are tried first
+        struct MXRecord {
+            MXRecord() : mPriority(0){}
+            MXRecord(uint16_t priority, const std::string& host) : mPriority(priority), mHost(host){}
+            
+            uint16_t    mPriority;
+            std::string mHost;
+        };
+        typedef std::vector<MXRecord> MXRecords;
+        
+        class Resolver;
+        typedef std::shared_ptr<Resolver> ResolverRef;
+        
+        class MXCache;
+        typedef std::shared_ptr<MXCache> MXCacheRef;
+        
+        //looks up the mail servers of a domain, the handler may be called on any thread
+        class Resolver {
+        public:
+            enum Result {
+                FOUND,
+                NOT_FOUND,  //the domain does not exist or takes no mail, trying again does not help
+                FAILED      //the lookup itself failed, worth trying again later
+            };
+            
+            typedef std::function<void(Result, const MXRecords&, uint32_t)> Handler; //with the seconds the answer may be cached
+            
+            virtual ~Resolver(){}
+            
+            virtual void lookupMX(const std::string& domain, const Handler& handler) = 0;
+        };
+        
+        //asks the dns servers of the system, on its own threads as the lookups block
+        //a domain without MX records is its own mail server (RFC 5321), a null MX takes no mail (RFC 7505)
+        class DNSResolver : public Resolver {
+        public:
+            static ResolverRef create(size_t threads=2){
+                return ResolverRef(new DNSResolver(threads));
+            }
+            
+            ~DNSResolver();
+            
+            void lookupMX(const std::string& domain, const Handler& handler);
+        
+        protected:
+            DNSResolver(size_t threads);
+            
+            void threadedFunction();
+            
+            //the blocking lookup
+            static Result query(const std::string& domain, MXRecords& records, uint32_t& ttl);
+            
+            std::mutex                                          mMutex;
+            std::condition_variable                             mCondition;
+            std::deque<std::pair<std::string, Handler> >        mQueries;
+            bool                                                mStopping;
+            std::vector<std::shared_ptr<std::thread> >          mThreads;
+        };
+        
+        //answers from a table instead of the dns, for tests and local setups
+        //the file has a record per line: domain priority host [ttl], a domain of * matches every domain without its own
+        class HostsResolver : public Resolver {
+        public:
+            static std::shared_ptr<HostsResolver> create(){
+                return std::shared_ptr<HostsResolver>(new HostsResolver());
+            }
+            
+            static std::shared_ptr<HostsResolver> create(const ci::fs::path& path){
+                std::shared_ptr<HostsResolver> resolver = create();
+                resolver->load(path);
+                return resolver;
+            }
+            
+            //adds the records of the file, false when it can not be read
+            bool load(const ci::fs::path& path);
+            
+            void addRecord(const std::string& domain, uint16_t priority, const std::string& host, uint32_t ttl=300);
+            
+            void lookupMX(const std::string& domain, const Handler& handler);
+        
+        protected:
+            HostsResolver(){}
+            
+            struct Entry {
+                Entry() : mTTL(300){}
+                
+                MXRecords   mRecords;
+                uint32_t    mTTL;
+            };
+            
+            std::mutex                                  mMutex;
+            std::unordered_map<std::string, Entry>      mDomains;
+        };
+        
+        //remembers the answers of a resolver for as long as their ttl allows
+        //lookups of a domain that is being looked up already wait for the same answer
+        class MXCache : public std::enable_shared_from_this<MXCache> {
+        public:
+            typedef std::function<void(Resolver::Result, const MXRecords&)> Handler;
+            
+            static MXCacheRef create(const ResolverRef& resolver){
+                return MXCacheRef(new MXCache(resolver));
+            }
+            
+            //the mail servers in the order to try them, servers of the same priority are shuffled to spread the load
+            //the handler is called right away from the cache, or on the thread of the resolver
+            void resolve(const std::string& domain, const Handler& handler);
+            
+            //seconds a domain that does not exist is remembered, when the resolver does not say
+            void setNegativeTTL(uint32_t seconds){
+                std::lock_guard<std::mutex> lock(mMutex);
+                mNegativeTTL = seconds;
+            }
+            
+            void clear(){
+                std::lock_guard<std::mutex> lock(mMutex);
+                for(std::unordered_map<std::string, Entry>::iterator itr = mEntries.begin(); itr!=mEntries.end();){
+                    if(itr->second.mWaiting.empty()){
+                        itr = mEntries.erase(itr);
+                    }else{
+                        ++itr;
+                    }
+                }
+            }
+            
+            size_t getSize(){
+                std::lock_guard<std::mutex> lock(mMutex);
+                return mEntries.size();
+            }
+        
+        protected:
+            MXCache(const ResolverRef& resolver) : mResolver(resolver), mNegativeTTL(300){
+                mRandom.seed(std::random_device()());
+            }
+            
+            void resolved(const std::string& domain, Resolver::Result result, const MXRecords& records, uint32_t ttl);
+            
+            //shuffles and sorts a copy of the records, the mutex has to be locked
+            MXRecords order(const MXRecords& records);
+            
+            struct Entry {
+                Entry() : mResult(Resolver::FAILED){}
+                
+                Resolver::Result                        mResult;
+                MXRecords                               mRecords;
+                std::chrono::steady_clock::time_point   mExpires;
+                std::vector<Handler>                    mWaiting; //not empty while it is looked up
+            };
+            
+            ResolverRef                                 mResolver;
+            std::mutex                                  mMutex;
+            std::unordered_map<std::string, Entry>      mEntries;
+            uint32_t                                    mNegativeTTL;
+            std::mt19937                                mRandom;
+        };
+        
+    }
+}
@@ -0,0 +1,332 @@
+//
+//  Session.h
+//  MailBlock
+//
+//  Created by Sylvain Vriens on 19/03/2013.
+//
+//
+
+#pragma once
+
+#include "cinder/Cinder.h"
+#include "cinder/Utilities.h"
+
+#include "Mail.h"
+#include "RateLimit.h"
+#include "HeaderWriter.h"
+#include <chrono>
+#include <functional>
+#include <map>
+#include <atomic>
+#include <cctype>
+
+#include <boost/asio.hpp>
+
+namespace cinder {
+    namespace mail {
+        
+        class Session;
+        typedef std::shared_ptr<Session> SessionRef;
+        
+        struct Response {
+            Response(const std::string& response) {
+                parse(response.data(), response.size());
+            };
+            
+            Response(const char* line, size_t length) {
+                parse(line, length);
+            };
+            
+            //reads the code and text of a single line, reusing the string
+            void parse(const char* line, size_t length){
+                if(length>=3 && isdigit(line[0]) && isdigit(line[1]) && isdigit(line[2])){
+                    mCode = (line[0]-'0')*100 + (line[1]-'0')*10 + (line[2]-'0');
+                    if(length>4){
+                        mResponse.assign(line+4, length-4);
+                    }else{
+                        mResponse.clear();
+                    }
+                }else{
+                    mResponse.assign(line, length);
+                    mCode = 0;
+                }
+            }
+            
+            int getCode() const{
+                return mCode;
+            }
+            
+            const std::string& getResponse() const{
+                return mResponse;
+            }
+            
+            int mCode;
+            std::string mResponse;
+        };
+        
+        struct Responses : public std::vector<Response> {
+            
+            Responses() : std::vector<Response>(){}
+            
+            Responses(const std::string& str) : std::vector<Response>(){
+                push_back(Response(str));
+            }
+            
+            Responses(const Response& response) : std::vector<Response>(){
+                push_back(response);
+            }
+            
+            Responses(std::vector<std::string> responses) : std::vector<Response>(){
+                for(auto& response: responses){
+                    if(response.size()){//skip empty lines
+                        push_back(Response(response));
+                    }
+                }
+            }
+            
+            int getCode() const{
+                if(empty()){
+                    return 0;
+                }
+                return back().getCode();
+            }
+            
+            std::string getResponse() const{
+                if(empty()){
+                    return "";
+                }
+                return back().getResponse();
+            }
+            
+            //4xx replies and no reply at all, worth trying again later
+            bool isTransient() const{
+                int code = getCode();
+                return code==0 || code/100==4;
+            }
+            
+            //5xx replies, trying again gives the same answer
+            bool isPermanent() const{
+                return getCode()/100==5;
+            }
+            
+            operator int () const{
+                return getCode();
+            }
+        };
+        
+        class Throughput;
+        typedef std::shared_ptr<Throughput> ThroughputRef;
+        
+        //counts the bytes written by a group of sessions
+        class Throughput {
+        public:
+            static ThroughputRef create(){
+                return ThroughputRef(new Throughput());
+            }
+            
+            void add(size_t bytes){
+                mBytes += bytes;
+            }
+            
+            uint64_t getBytes() const{
+                return mBytes;
+            }
+            
+            //average since creation or the last reset
+            double getBytesPerSecond() const{
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count() - mStart;
+                if(seconds<=0) return 0;
+                return mBytes / seconds;
+            }
+            
+            void reset(){
+                mBytes = 0;
+                mStart = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+            }
+            
+        protected:
+            Throughput(){
+                reset();
+            }
+            
+            std::atomic<uint64_t>   mBytes;
+            std::atomic<double>     mStart;
+        };
+        
+        //a single connection to a smtp server
+        //every call is asynchronous and completes on the io_service, one call at a time per session
+        class Session : public std::enable_shared_from_this<Session> {
+        public:
+            typedef std::function<void(bool)> ConnectHandler;
+            typedef std::function<void(const Responses&)> ReplyHandler;
+            typedef std::function<void(const std::vector<Responses>&)> RepliesHandler;
+            typedef std::vector<boost::asio::const_buffer> Buffers;
+            typedef std::function<bool(Buffers&)> ChunkSource; //replaces the buffers with the next chunk, false when done, the data has to stay valid until the next call
+            
+            static SessionRef create(boost::asio::io_service& ios){
+                return SessionRef(new Session(ios));
+            }
+            
+            ~Session(){
+                close();
+            }
+            
+            //maximum seconds a single step (resolve, connect, command or reply) may take
+            void setTimeout(double seconds){
+                mTimeout = boost::posix_time::milliseconds(static_cast<int64_t>(seconds*1000));
+            }
+            
+            //resolves and connects, the handler is called with the result
+            void connect(const std::string& server, int32_t port, const ConnectHandler& handler);
+            
+            //reads exactly one complete (possibly multi-line) reply, anything after it stays buffered for the next one
+            void readReply(const ReplyHandler& handler);
+            
+            //sends the data to the server and reads the reply
+            void sendData(const std::string& data, const ReplyHandler& handler, bool appendNL=true);
+            
+            //writes chunks until the source is exhausted and reads the reply, only one chunk is in memory at a time
+            void sendStream(const ChunkSource& source, const ReplyHandler& handler);
+            
+            //sends a command with an address, like RCPT TO:<address>, and reads the reply
+            //written straight into the command buffer, so no string is made for it
+            void sendCommand(const char* command, const std::string& address, const ReplyHandler& handler, const char* parameters=NULL);
+            
+            //sends the MAIL FROM and a RCPT TO per recipient in a single write and reads a reply for each of them (RFC 2920)
+            //stops reading at the first broken reply, so fewer replies than commands means the connection failed
+            //the last command is written after the others when it is given, like DATA after the envelope
+            //parameters are added to the MAIL FROM, like BODY=8BITMIME
+            void sendEnvelope(const std::string& sender, const std::vector<std::string>& recipients, const RepliesHandler& handler, const char* last=NULL, const char* parameters=NULL);
+            
+            //times the command buffer had to grow, it stops once it fits the largest envelope
+            size_t getCommandAllocations() const{
+                return mCommands.getAllocations();
+            }
+            
+            //every written byte is added to the counter
+            void setThroughput(const ThroughputRef& throughput){
+                mThroughput = throughput;
+            }
+            
+            //the reply to every message is reported, with the time the server took to accept it
+            void setConcurrency(const ConcurrencyRef& concurrency){
+                mConcurrency = concurrency;
+            }
+            
+            //reports a reply to a command that tells how busy the server is, like a 421 to MAIL FROM
+            void report(const Responses& reply){
+                if(mConcurrency) mConcurrency->replied(reply.getCode(), -1);
+            }
+            
+            //stores the extensions advertised in the EHLO reply
+            void setCapabilities(const Responses& ehlo);
+            
+            bool hasCapability(const std::string& keyword) const{
+                return mCapabilities.count(keyword)>0;
+            }
+            
+            //the parameters of an extension, like the limit of SIZE
+            std::string getCapability(const std::string& keyword) const{
+                std::map<std::string, std::string>::const_iterator itr = mCapabilities.find(keyword);
+                if(itr==mCapabilities.end()) return "";
+                return itr->second;
+            }
+            
+            //closes the socket, pending calls complete with an empty reply
+            void close();
+            
+            bool isOpen() const{
+                return mSocket.is_open();
+            }
+            
+            size_t getMessageCount() const{
+                return mMessageCount;
+            }
+            
+            //marks the end of a transaction on this session
+            void used(){
+                ++mMessageCount;
+                mLastUsed = std::chrono::steady_clock::now();
+            }
+            
+            bool isIdleFor(std::chrono::steady_clock::duration duration) const{
+                return std::chrono::steady_clock::now() - mLastUsed > duration;
+            }
+            
+            std::chrono::steady_clock::time_point getLastUsed() const{
+                return mLastUsed;
+            }
+            
+            //the recipient domain the session delivers to, empty when it is a relay for every domain
+            void setDestination(const std::string& domain){
+                mDestination = domain;
+            }
+            
+            const std::string& getDestination() const{
+                return mDestination;
+            }
+        
+        protected:
+            Session(boost::asio::io_service& ios) : mStrand(ios), mResolver(ios), mSocket(ios), mTimer(ios),
+                                                    mTimeout(boost::posix_time::seconds(30)),
+                                                    mReadBuffer(MAIL_SMTP_READ_BUFFER_SIZE), mReadStart(0), mReadEnd(0), mReplyLines(0),
+                                                    mMessageCount(0), mLastUsed(std::chrono::steady_clock::now()), mTimeReply(false){
+            }
+            
+            //takes complete lines from the buffer and reads more until the reply is complete
+            void parseReply(const ReplyHandler& handler);
+            //writes the command buffer and reads the reply
+            void writeCommands(const ReplyHandler& handler);
+            void writeChunk(const ChunkSource& source, const std::shared_ptr<Buffers>& chunk, const ReplyHandler& handler);
+            
+            void written(size_t bytes){
+                if(mThroughput) mThroughput->add(bytes);
+            }
+            void readReplies(size_t count, const std::shared_ptr<std::vector<Responses> >& replies, const RepliesHandler& handler);
+            
+            //only the reply to a message counts, the window would grow with every recipient of a pipelined envelope otherwise
+            void replied(const Responses& reply){
+                if(!mTimeReply) return;
+                mTimeReply = false;
+                if(!mConcurrency) return;
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - mReplyStart).count();
+                mConcurrency->replied(reply.getCode(), seconds);
+            }
+            
+            //arms the deadline for the next step
+            void startTimer();
+            void onTimeout(const boost::system::error_code& error);
+            
+            boost::asio::io_service::strand         mStrand;
+            boost::asio::ip::tcp::resolver          mResolver;
+            boost::asio::ip::tcp::socket            mSocket;
+            boost::asio::deadline_timer             mTimer;
+            boost::posix_time::time_duration        mTimeout;
+            
+            //received but unparsed data lives between start and end
+            std::vector<char>                       mReadBuffer;
+            size_t                                  mReadStart;
+            size_t                                  mReadEnd;
+            
+            //lines are parsed into the existing responses to keep their strings
+            Responses                               mReply;
+            size_t                                  mReplyLines;
+            
+            std::map<std::string, std::string>      mCapabilities;
+            ThroughputRef                           mThroughput;
+            
+            //commands are gathered here before they are written, reused for every write
+            HeaderWriter                            mCommands;
+            
+            size_t                                  mMessageCount;
+            std::chrono::steady_clock::time_point   mLastUsed;
+            std::string                             mDestination;
+            
+            //the reply to a streamed message is timed, from the last byte written
+            ConcurrencyRef                          mConcurrency;
+            bool                                    mTimeReply;
+            std::chrono::steady_clock::time_point   mReplyStart;
+        };
+        
+    }
+}
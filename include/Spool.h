@@ -0,0 +1,142 @@
+//
+//  Spool.h
+//  MailBlock
+//
+//  Created by Sylvain Vriens on 25/04/2013.
+//
+//
+
+#pragma once
+
+#include "cinder/Cinder.h"
+#include "cinder/Thread.h"
+
+#include "Message.h"
+
+#include <map>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+
+namespace cinder {
+    namespace mail {
+        
+        class Spool;
+        typedef std::shared_ptr<Spool> SpoolRef;
+        
+        //serialized messages on disk, so pending mail survives a restart
+        //an append only log split in segment files, a segment is removed once all of its entries are acknowledged
+        class Spool {
+        public:
+            //opens the spool in the directory and recovers the entries that were not acknowledged
+            static SpoolRef create(const ci::fs::path& directory, size_t segmentSize=64*1024*1024){
+                return SpoolRef(new Spool(directory, segmentSize));
+            }
+            
+            ~Spool();
+            
+            //hands out the serialized message a chunk at a time, false when it is done
+            typedef std::function<bool(std::string& chunk)> Source;
+            
+            //adds a message, durable after the next sync which the sync policy does when sync is set
+            //returns 0 when it could not be written, or not synced when the policy synced, then it is not in the spool
+            uint64_t append(const Message::Headers& envelope, const std::string& data, bool sync=true);
+            
+            //same, writing the message as it is produced so it is never in memory as a whole
+            //the source is read without holding the lock, other entries wait until it is done but acknowledging does not
+            uint64_t append(const Message::Headers& envelope, const Source& source, bool sync=true);
+            
+            //same, with the message of another entry, for the same message to other recipients
+            //the message is copied on disk, 0 as well when the entry is not in the spool
+            uint64_t appendCopy(const Message::Headers& envelope, uint64_t entry, bool sync=true);
+            
+            //the message is delivered or failed for good, so it can be removed
+            void acknowledge(uint64_t id);
+            
+            //reads a message back, false when it is not in the spool
+            bool read(uint64_t id, Message::Headers& envelope, std::string& data);
+            
+            //the entries that are not acknowledged, oldest first
+            std::vector<uint64_t> getPending() const;
+            
+            size_t getSize() const{
+                std::lock_guard<std::mutex> lock(mMutex);
+                return mEntries.size();
+            }
+            
+            //syncs after this many writes, or when the oldest unsynced write is older than the delay
+            //a larger batch trades the loss window for throughput
+            void setSyncPolicy(size_t writes, double seconds);
+            
+            //flushes everything written so far to the disk, false when it might not have arrived there
+            bool sync();
+            
+            //moves the pending entries of older segments to the current one and removes those segments
+            void compact();
+        
+        protected:
+            Spool(const ci::fs::path& directory, size_t segmentSize);
+            
+            //where a pending entry is stored
+            struct Location {
+                uint32_t mSegment;
+                uint64_t mOffset; //of the payload
+                uint64_t mSize;
+            };
+            
+            void recover();
+            void recoverSegment(uint32_t segment);
+            
+            //starts a new segment file to append to, false when it can not be created
+            bool openSegment(uint32_t segment);
+            
+            //writes a record and sets the offset of its payload, the mutex has to be locked
+            //the payload can be given in two parts, so a message is not copied behind its envelope
+            //false when it failed, a partial record is cut off again
+            bool write(uint8_t type, uint64_t id, const char* payload, size_t size, const char* extra, size_t extraSize, uint64_t& offset);
+            bool write(uint8_t type, uint64_t id, const char* payload, size_t size, uint64_t& offset){
+                return write(type, id, payload, size, NULL, 0, offset);
+            }
+            
+            //flushes the record that was just written, or cuts it off when writing it failed
+            bool finishRecord(bool written, uint64_t size, uint64_t& offset);
+            
+            //adds a written entry to the pending ones, syncing when asked, the mutex has to be locked
+            uint64_t addEntry(uint64_t id, uint64_t offset, uint64_t size, bool sync);
+            
+            //the mutex has to be locked, while an entry is streamed the record is written after it
+            void acknowledgeLocked(uint64_t id);
+            
+            //syncs when the policy says so, the mutex has to be locked, false when the sync failed
+            bool syncIfNeeded();
+            bool syncLocked();
+            
+            //removes the oldest segments as long as they have no pending entries
+            void removeSegments();
+            
+            ci::fs::path getPath(uint32_t segment) const;
+            
+            mutable std::mutex                      mMutex;
+            std::mutex                              mAppendMutex; //one writer of entries at a time, locked before the mutex
+            ci::fs::path                            mDirectory;
+            size_t                                  mSegmentSize;
+            
+            std::map<uint64_t, Location>            mEntries; //pending, by id so the oldest come first
+            std::map<uint32_t, size_t>              mSegments; //pending entries per segment
+            uint64_t                                mNextId;
+            
+            //the segment that is appended to
+            uint32_t                                mSegment;
+            std::FILE*                              mFile; //NULL when it could not be opened, the next write tries a new one
+            uint64_t                                mOffset;
+            bool                                    mStreaming; //an entry is written a chunk at a time, nothing else may be appended
+            std::vector<uint64_t>                   mAcknowledged; //acknowledged while streaming, not written yet
+            
+            size_t                                  mSyncWrites;
+            std::chrono::steady_clock::duration     mSyncDelay;
+            size_t                                  mUnsynced;
+            std::chrono::steady_clock::time_point   mFirstUnsynced;
+        };
+        
+    }
+}
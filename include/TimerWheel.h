@@ -0,0 +1,121 @@
+//
+//  TimerWheel.h
+//  MailBlock
+//
+//  Created by Sylvain Vriens on 25/04/2013.
+//
+//
+
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+namespace cinder {
+    namespace mail {
+        
+        //items that expire after a number of ticks, in a hierarchical timing wheel
+        //inserting and expiring an item is constant time, however many are waiting
+        //the wheel only moves when it is advanced, so the owner decides how long a tick is
+        template<typename T>
+        class TimerWheel {
+        public:
+            TimerWheel() : mTick(0), mSize(0){}
+            
+            //adds an item that expires the given amount of ticks from the current one, at least one
+            void insert(const T& item, uint64_t ticks){
+                Entry entry;
+                entry.mExpires = mTick + std::min<uint64_t>(std::max<uint64_t>(ticks, 1), uint64_t(MAX_TICKS));
+                entry.mItem = item;
+                place(entry);
+                ++mSize;
+            }
+            
+            //moves to the tick, the handler is called for every item that expired on the way
+            template<typename Handler>
+            void advance(uint64_t tick, Handler handler){
+                while(mTick<tick){
+                    //nothing waiting, so nothing to cascade or expire either
+                    if(!mSize){
+                        mTick = tick;
+                        return;
+                    }
+                    ++mTick;
+                    
+                    //when a level wraps, the next slot of the level above is spread over the lower ones
+                    for(int level=LEVELS-1; level>0; --level){
+                        if(mTick & ((uint64_t(1) << (BITS*level)) - 1)) continue;
+                        
+                        std::vector<Entry> entries;
+                        entries.swap(mSlots[level][(mTick >> (BITS*level)) & MASK]);
+                        for(auto& entry: entries){
+                            place(entry);
+                        }
+                    }
+                    
+                    std::vector<Entry> expired;
+                    expired.swap(mSlots[0][mTick & MASK]);
+                    mSize -= expired.size();
+                    for(auto& entry: expired){
+                        handler(entry.mItem);
+                    }
+                }
+            }
+            
+            //removes all items, calling the handler for each
+            template<typename Handler>
+            void clear(Handler handler){
+                for(int level=0; level<LEVELS; ++level){
+                    for(size_t slot=0; slot<SLOTS; ++slot){
+                        std::vector<Entry> entries;
+                        entries.swap(mSlots[level][slot]);
+                        for(auto& entry: entries){
+                            handler(entry.mItem);
+                        }
+                    }
+                }
+                mSize = 0;
+            }
+            
+            uint64_t getTick() const{
+                return mTick;
+            }
+            
+            size_t size() const{
+                return mSize;
+            }
+            
+            bool empty() const{
+                return !mSize;
+            }
+        
+        protected:
+            static const int        BITS = 8;
+            static const int        LEVELS = 4;
+            static const size_t     SLOTS = size_t(1) << BITS;
+            static const uint64_t   MASK = SLOTS - 1;
+            static const uint64_t   MAX_TICKS = (uint64_t(1) << (BITS*LEVELS)) - 1;
+            
+            struct Entry {
+                uint64_t    mExpires;
+                T           mItem;
+            };
+            
+            //the level is picked by how far away the item expires, the slot by when
+            void place(const Entry& entry){
+                uint64_t delta = entry.mExpires - mTick;
+                int level = 0;
+                while(level<LEVELS-1 && delta>=(uint64_t(1) << (BITS*(level+1)))){
+                    ++level;
+                }
+                mSlots[level][(entry.mExpires >> (BITS*level)) & MASK].push_back(entry);
+            }
+            
+            uint64_t            mTick;
+            size_t              mSize;
+            std::vector<Entry>  mSlots[LEVELS][SLOTS];
+        };
+        
+    }
+}
@@ -0,0 +1,182 @@
+//
+//  Benchmark.cpp
+//  MailBlock
+//
+//  Created by Sylvain Vriens on 25/04/2013.
+//
+//
+
+#include "Benchmark.h"
+#include "Mailer.h"
+
+#include <algorithm>
+#include <unordered_map>
+#include <cstdio>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+using namespace cinder::mail;
+
+namespace {
+    
+    //text of the size in lines of 76 characters
+    std::string createBody(size_t size){
+        std::string body;
+        body.reserve(size + size/76*2);
+        for(size_t i=0; i<size; ++i){
+            body += static_cast<char>('a' + i % 26);
+            if(i % 76==75) body += "\r\n";
+        }
+        return body;
+    }
+    
+    double getPercentile(std::vector<double>& values, double percentile){
+        if(values.empty()) return 0;
+        size_t index = std::min(values.size() - 1, static_cast<size_t>(percentile * values.size()));
+        std::nth_element(values.begin(), values.begin() + index, values.end());
+        return values[index];
+    }
+    
+}
+
+BenchmarkResult runBenchmark(const BenchmarkCase& benchmark, double timeout){
+    SinkServerRef sink = SinkServer::create(benchmark.mSink);
+    
+    //built up front, so only the sending is measured
+    std::string body = createBody(benchmark.mMessageSize);
+    std::vector<MessageRef> messages;
+    messages.reserve(benchmark.mMessages);
+    for(size_t i=0; i<benchmark.mMessages; ++i){
+        MessageRef msg = Message::create();
+        msg->setSender("bench@sink.local");
+        for(size_t j=0; j<benchmark.mRecipients; ++j){
+            msg->addRecipient("rcpt" + ci::toString(j) + "@domain" + ci::toString(j % 4) + ".local");
+        }
+        msg->setSubject("benchmark " + ci::toString(i));
+        msg->setMessage(body);
+        messages.push_back(msg);
+    }
+    
+    std::mutex mutex;
+    std::unordered_map<Message*, std::chrono::steady_clock::time_point> started;
+    std::vector<double> latencies;
+    latencies.reserve(messages.size());
+    std::atomic<size_t> sent(0), failed(0);
+    
+    BenchmarkResult result;
+    {
+        MailerRef mailer = Mailer::create("127.0.0.1", sink->getPort());
+        mailer->setWorkerCount(benchmark.mWorkers);
+        mailer->setMaxSessions(benchmark.mSessions);
+        mailer->setMaxIdleSessions(benchmark.mSessions);
+        //temporary refusals are tried again within the run instead of minutes later
+        mailer->setRetryPolicy(3, 0.05, 0.5);
+        mailer->getSignalSent().connect([&](MessageRef msg, bool success){
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                latencies.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - started[msg.get()]).count());
+            }
+            ++(success ? sent : failed);
+        });
+        
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        mailer->resetThroughput();
+        for(auto& msg: messages){
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                started[msg.get()] = std::chrono::steady_clock::now();
+            }
+            mailer->sendMessage(msg);
+        }
+        
+        while(sent + failed<messages.size() && std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()<timeout){
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        
+        result.mSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        result.mBytesPerSecond = mailer->getBytesWritten() / std::max(result.mSeconds, 1e-9);
+    }
+    
+    result.mSent = sent;
+    result.mFailed = failed;
+    result.mMessagesPerSecond = (sent + failed) / std::max(result.mSeconds, 1e-9);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        result.mLatencyP50 = getPercentile(latencies, 0.5);
+        result.mLatencyP99 = getPercentile(latencies, 0.99);
+    }
+    result.mPeakRSS = getPeakRSS();
+    return result;
+}
+
+std::vector<BenchmarkCase> createBenchmarkSuite(size_t messages){
+    std::vector<BenchmarkCase> suite;
+    
+    size_t sizes[] = {1024, 64*1024, 1024*1024};
+    size_t recipients[] = {1, 10};
+    size_t workers[] = {1, 4};
+    for(auto size: sizes){
+        for(auto count: recipients){
+            for(auto worker: workers){
+                //fewer of the large ones, they take long enough
+                suite.push_back(BenchmarkCase(size, count, worker, size>=1024*1024 ? std::max<size_t>(messages/10, 1) : messages));
+            }
+        }
+    }
+    
+    //a server that takes a millisecond per reply and reads slowly
+    BenchmarkCase slow(64*1024, 1, 4, messages);
+    slow.mSink.mLatency = 0.001;
+    slow.mSink.mReadChunk = 4096;
+    slow.mSink.mReadDelay = 0.0005;
+    suite.push_back(slow);
+    
+    //without pipelining every command waits for its reply
+    BenchmarkCase serial = slow;
+    serial.mSink.mPipelining = false;
+    suite.push_back(serial);
+    
+    //temporary and permanent refusals of some recipients
+    BenchmarkCase refusing(1024, 10, 4, messages);
+    refusing.mSink.mRules.push_back(SinkServer::Rule("RCPT", 550, 0.05));
+    refusing.mSink.mRules.push_back(SinkServer::Rule("RCPT", 451, 0.05));
+    suite.push_back(refusing);
+    
+    return suite;
+}
+
+std::string formatBenchmarkHeader(){
+    return "    size  rcpt  work   msgs     msg/s   p50 ms   p99 ms      MB/s  rss MB  failed";
+}
+
+std::string formatBenchmarkResult(const BenchmarkCase& benchmark, const BenchmarkResult& result){
+    char row[256];
+    snprintf(row, sizeof(row), "%8lu  %4lu  %4lu  %5lu  %8.1f  %7.2f  %7.2f  %8.2f  %6.1f  %6lu",
+             static_cast<unsigned long>(benchmark.mMessageSize), static_cast<unsigned long>(benchmark.mRecipients),
+             static_cast<unsigned long>(benchmark.mWorkers), static_cast<unsigned long>(benchmark.mMessages),
+             result.mMessagesPerSecond, result.mLatencyP50 * 1000, result.mLatencyP99 * 1000,
+             result.mBytesPerSecond / (1024*1024), result.mPeakRSS / (1024.0*1024), static_cast<unsigned long>(result.mFailed));
+    return row;
+}
+
+size_t getPeakRSS(){
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if(!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+    return counters.PeakWorkingSetSize;
+#else
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage)!=0) return 0;
+#if defined(__APPLE__)
+    return static_cast<size_t>(usage.ru_maxrss); //bytes on os x
+#else
+    return static_cast<size_t>(usage.ru_maxrss) * 1024; //kilobytes on linux
+#endif
+#endif
+}
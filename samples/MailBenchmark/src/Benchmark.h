@@ -0,0 +1,50 @@
+//
+//  Benchmark.h
+//  MailBlock
+//
+//  Created by Sylvain Vriens on 25/04/2013.
+//
+//
+
+#pragma once
+
+#include "SinkServer.h"
+
+//a single run of the mailer against a fresh sink
+struct BenchmarkCase {
+    BenchmarkCase(size_t messageSize=1024, size_t recipients=1, size_t workers=1, size_t messages=1000) : mMessageSize(messageSize), mRecipients(recipients), mWorkers(workers), mMessages(messages), mSessions(4){}
+    
+    size_t                  mMessageSize; //bytes of text in the body
+    size_t                  mRecipients;
+    size_t                  mWorkers;
+    size_t                  mMessages;
+    size_t                  mSessions;
+    SinkServer::Settings    mSink;
+};
+
+struct BenchmarkResult {
+    BenchmarkResult() : mSeconds(0), mMessagesPerSecond(0), mLatencyP50(0), mLatencyP99(0), mBytesPerSecond(0), mPeakRSS(0), mSent(0), mFailed(0){}
+    
+    double      mSeconds;
+    double      mMessagesPerSecond;
+    double      mLatencyP50; //seconds from sendMessage to the sent signal
+    double      mLatencyP99;
+    double      mBytesPerSecond; //written by the mailer
+    size_t      mPeakRSS; //bytes, of the whole process so far
+    size_t      mSent;
+    size_t      mFailed;
+};
+
+//sends the messages and waits for all of them, or gives up after the timeout
+BenchmarkResult runBenchmark(const BenchmarkCase& benchmark, double timeout=300);
+
+//message sizes, recipient counts and worker counts against a sink without delays,
+//then a sink with latency and one that refuses some recipients
+std::vector<BenchmarkCase> createBenchmarkSuite(size_t messages=1000);
+
+//a table header and a row per result
+std::string formatBenchmarkHeader();
+std::string formatBenchmarkResult(const BenchmarkCase& benchmark, const BenchmarkResult& result);
+
+//the maximum resident set size of the process in bytes, 0 when unknown
+size_t getPeakRSS();
@@ -0,0 +1,80 @@
+//
+//  MailBenchmarkApp.cpp
+//  MailBlock
+//
+//  Created by Sylvain Vriens on 25/04/2013.
+//
+//
+
+#include "cinder/app/AppBasic.h"
+#include "cinder/gl/gl.h"
+
+#include "Benchmark.h"
+
+using namespace ci;
+using namespace ci::app;
+
+//runs the benchmark suite against a local sink and shows the results, they are written to the console as well
+class MailBenchmarkApp : public AppBasic {
+public:
+    void prepareSettings(Settings* settings);
+    void setup();
+    void draw();
+    void shutdown();
+
+protected:
+    void threadedFunction();
+    
+    void addLine(const std::string& line){
+        console() << line << std::endl;
+        std::lock_guard<std::mutex> lock(mMutex);
+        mLines.push_back(line);
+    }
+    
+    std::shared_ptr<std::thread>    mThread;
+    std::mutex                      mMutex;
+    std::vector<std::string>        mLines;
+    std::atomic<bool>               mStopping;
+};
+
+void MailBenchmarkApp::prepareSettings(Settings* settings){
+    settings->setWindowSize(800, 400);
+}
+
+void MailBenchmarkApp::setup(){
+    mStopping = false;
+    mThread = std::shared_ptr<std::thread>(new std::thread(&MailBenchmarkApp::threadedFunction, this));
+}
+
+void MailBenchmarkApp::threadedFunction(){
+    //the number of messages per case can be passed on the command line
+    size_t messages = 1000;
+    if(getArgs().size()>1){
+        messages = std::max(atoi(getArgs()[1].c_str()), 1);
+    }
+    
+    addLine(formatBenchmarkHeader());
+    std::vector<BenchmarkCase> suite = createBenchmarkSuite(messages);
+    for(auto& benchmark: suite){
+        if(mStopping) return;
+        addLine(formatBenchmarkResult(benchmark, runBenchmark(benchmark)));
+    }
+    addLine("done");
+}
+
+void MailBenchmarkApp::draw(){
+    gl::clear(Color(0, 0, 0));
+    
+    std::lock_guard<std::mutex> lock(mMutex);
+    for(size_t i=0; i<mLines.size(); ++i){
+        gl::drawString(mLines[i], Vec2f(10, 20 + i*16), Color(1, 1, 1), Font("Courier", 14));
+    }
+}
+
+void MailBenchmarkApp::shutdown(){
+    //the running case finishes first
+    mStopping = true;
+    mThread->join();
+}
+
+CINDER_APP_BASIC(MailBenchmarkApp, RendererGl)
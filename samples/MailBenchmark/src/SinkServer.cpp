@@ -0,0 +1,287 @@
+//
+//  SinkServer.cpp
+//  MailBlock
+//
+//  Created by Sylvain Vriens on 25/04/2013.
+//
+//
+
+#include "SinkServer.h"
+#include "cinder/Utilities.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <boost/algorithm/string/case_conv.hpp>
+
+using boost::asio::ip::tcp;
+
+//a single client, every step waits for the previous one so no strand is needed
+class SinkServer::Connection : public std::enable_shared_from_this<SinkServer::Connection> {
+public:
+    Connection(SinkServer& server) : mServer(server), mSocket(server.mIos), mTimer(server.mIos),
+                                     mBuffer(std::max<size_t>(server.mSettings.mReadChunk, 1) + 1024), mStart(0), mEnd(0),
+                                     mState(COMMAND), mRecipients(0), mChunkLeft(0), mLastChunk(false), mAuthSteps(0), mSize(0){
+    }
+    
+    tcp::socket& getSocket(){
+        return mSocket;
+    }
+    
+    void start(){
+        reply("220 sink ready");
+    }
+
+protected:
+    enum State {
+        COMMAND,
+        DATA,
+        CHUNK
+    };
+    
+    //handles everything that is buffered, then reads more
+    void process(){
+        while(true){
+            if(mState==CHUNK){
+                size_t size = std::min(mChunkLeft, mEnd - mStart);
+                mStart += size;
+                mChunkLeft -= size;
+                mSize += size;
+                if(mChunkLeft){
+                    break;
+                }
+                
+                mState = COMMAND;
+                if(mLastChunk){
+                    finishMessage();
+                }else{
+                    reply("250 chunk ok");
+                }
+                return;
+            }
+            
+            const char* begin = mBuffer.data() + mStart;
+            const char* end = mBuffer.data() + mEnd;
+            const char* newline = std::find(begin, end, '\n');
+            if(newline==end) break;
+            
+            std::string line(begin, newline);
+            if(!line.empty() && line[line.size()-1]=='\r') line.erase(line.size()-1);
+            mStart += newline - begin + 1;
+            
+            if(mState==DATA){
+                if(line=="."){
+                    mState = COMMAND;
+                    finishMessage();
+                    return;
+                }
+                mSize += line.size() + 2;
+                continue;
+            }
+            
+            command(line);
+            return;
+        }
+        
+        read();
+    }
+    
+    void command(const std::string& line){
+        if(mAuthSteps){
+            //the user name and password of AUTH LOGIN
+            --mAuthSteps;
+            reply(mAuthSteps ? "334 UGFzc3dvcmQ6" : "235 authenticated");
+            return;
+        }
+        
+        std::string verb = boost::algorithm::to_upper_copy(line.substr(0, line.find(' ')));
+        int code = mServer.check(verb, line);
+        if(code){
+            reply(ci::toString(code) + " refused by the sink");
+            return;
+        }
+        
+        if(verb=="EHLO" || verb=="HELO"){
+            std::string ehlo = "250-sink\r\n250-8BITMIME\r\n";
+            if(mServer.mSettings.mPipelining) ehlo += "250-PIPELINING\r\n";
+            if(mServer.mSettings.mChunking) ehlo += "250-CHUNKING\r\n";
+            ehlo += "250-AUTH PLAIN LOGIN\r\n250 SIZE 0";
+            reply(ehlo);
+        }else if(verb=="MAIL"){
+            mRecipients = 0;
+            mSize = 0;
+            reply("250 sender ok");
+        }else if(verb=="RCPT"){
+            ++mRecipients;
+            reply("250 recipient ok");
+        }else if(verb=="DATA"){
+            if(!mRecipients){
+                reply("554 no valid recipients");
+                return;
+            }
+            mState = DATA;
+            reply("354 go ahead");
+        }else if(verb=="BDAT" && mServer.mSettings.mChunking){
+            std::string arguments = line.size()>5 ? line.substr(5) : "";
+            mChunkLeft = strtoul(arguments.c_str(), NULL, 10);
+            mLastChunk = boost::algorithm::to_upper_copy(arguments).find("LAST")!=std::string::npos;
+            mState = CHUNK;
+            process();
+        }else if(verb=="AUTH"){
+            if(line.find("LOGIN")!=std::string::npos){
+                mAuthSteps = 2;
+                reply("334 VXNlcm5hbWU6");
+            }else{
+                reply("235 authenticated");
+            }
+        }else if(verb=="RSET"){
+            mRecipients = 0;
+            reply("250 reset");
+        }else if(verb=="NOOP"){
+            reply("250 ok");
+        }else if(verb=="QUIT"){
+            reply("221 bye", true);
+        }else{
+            reply("500 unknown command");
+        }
+    }
+    
+    void finishMessage(){
+        int code = mServer.check(".", "");
+        if(code){
+            reply(ci::toString(code) + " message refused by the sink");
+            return;
+        }
+        
+        ++mServer.mMessages;
+        mServer.mBytes += mSize;
+        mRecipients = 0;
+        reply("250 queued");
+    }
+    
+    //waits the latency, writes and goes on with what is buffered
+    void reply(const std::string& text, bool close=false){
+        std::shared_ptr<std::string> data(new std::string(text + "\r\n"));
+        std::shared_ptr<Connection> self = shared_from_this();
+        auto write = [self, data, close](){
+            boost::asio::async_write(self->mSocket, boost::asio::buffer(*data), [self, data, close](const boost::system::error_code& error, size_t){
+                if(error || close){
+                    boost::system::error_code ignored;
+                    self->mSocket.close(ignored);
+                    return;
+                }
+                self->process();
+            });
+        };
+        
+        if(mServer.mSettings.mLatency<=0){
+            write();
+            return;
+        }
+        mTimer.expires_from_now(boost::posix_time::microseconds(static_cast<int64_t>(mServer.mSettings.mLatency * 1000000)));
+        mTimer.async_wait([write](const boost::system::error_code&){
+            write();
+        });
+    }
+    
+    void read(){
+        //keep the unparsed data at the front
+        if(mStart==mEnd){
+            mStart = mEnd = 0;
+        }else if(mStart>0){
+            std::copy(mBuffer.begin() + mStart, mBuffer.begin() + mEnd, mBuffer.begin());
+            mEnd -= mStart;
+            mStart = 0;
+        }
+        if(mBuffer.size() - mEnd<mServer.mSettings.mReadChunk){
+            mBuffer.resize(mEnd + std::max<size_t>(mServer.mSettings.mReadChunk, 1));
+        }
+        
+        std::shared_ptr<Connection> self = shared_from_this();
+        size_t size = std::min(mBuffer.size() - mEnd, std::max<size_t>(mServer.mSettings.mReadChunk, 1));
+        auto receive = [self, size](){
+            self->mSocket.async_read_some(boost::asio::buffer(self->mBuffer.data() + self->mEnd, size), [self](const boost::system::error_code& error, size_t bytesRead){
+                if(error) return;
+                
+                self->mEnd += bytesRead;
+                self->process();
+            });
+        };
+        
+        if(mServer.mSettings.mReadDelay<=0){
+            receive();
+            return;
+        }
+        mTimer.expires_from_now(boost::posix_time::microseconds(static_cast<int64_t>(mServer.mSettings.mReadDelay * 1000000)));
+        mTimer.async_wait([receive](const boost::system::error_code&){
+            receive();
+        });
+    }
+    
+    SinkServer&                 mServer;
+    tcp::socket                 mSocket;
+    boost::asio::deadline_timer mTimer;
+    
+    std::vector<char>           mBuffer;
+    size_t                      mStart;
+    size_t                      mEnd;
+    
+    State                       mState;
+    size_t                      mRecipients;
+    size_t                      mChunkLeft;
+    bool                        mLastChunk;
+    int                         mAuthSteps;
+    uint64_t                    mSize;
+};
+
+SinkServer::SinkServer(const Settings& settings, uint16_t port) : mAcceptor(mIos), mSettings(settings), mPort(port), mMessages(0), mBytes(0), mConnections(0){
+    mRandom.seed(std::random_device()());
+    
+    tcp::endpoint endpoint(boost::asio::ip::address_v4::loopback(), port);
+    mAcceptor.open(endpoint.protocol());
+    mAcceptor.set_option(tcp::acceptor::reuse_address(true));
+    mAcceptor.bind(endpoint);
+    mAcceptor.listen();
+    mPort = mAcceptor.local_endpoint().port();
+    
+    accept();
+    
+    mWork = std::shared_ptr<boost::asio::io_service::work>(new boost::asio::io_service::work(mIos));
+    for(size_t i=0; i<std::max<size_t>(mSettings.mThreads, 1); ++i){
+        mThreads.push_back(std::shared_ptr<std::thread>(new std::thread([this](){ mIos.run(); })));
+    }
+}
+
+SinkServer::~SinkServer(){
+    mWork.reset();
+    mIos.stop();
+    for(auto& thread: mThreads){
+        thread->join();
+    }
+}
+
+void SinkServer::accept(){
+    ConnectionRef connection(new Connection(*this));
+    mAcceptor.async_accept(connection->getSocket(), [this, connection](const boost::system::error_code& error){
+        if(error) return;
+        
+        ++mConnections;
+        //replies are small, they should not wait for an ack
+        boost::system::error_code ignored;
+        connection->getSocket().set_option(tcp::no_delay(true), ignored);
+        connection->start();
+        accept();
+    });
+}
+
+int SinkServer::check(const std::string& command, const std::string& line){
+    for(auto& rule: mSettings.mRules){
+        if(rule.mCommand!=command) continue;
+        if(!rule.mMatch.empty() && line.find(rule.mMatch)==std::string::npos) continue;
+        
+        std::lock_guard<std::mutex> lock(mRandomMutex);
+        if(std::uniform_real_distribution<double>(0, 1)(mRandom)<rule.mProbability){
+            return rule.mCode;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,98 @@
+//
+//  SinkServer.h
+//  MailBlock
+//
+//  Created by Sylvain Vriens on 25/04/2013.
+//
+//
+
+#pragma once
+
+#include "cinder/Cinder.h"
+#include "cinder/Thread.h"
+
+#include <atomic>
+#include <random>
+#include <boost/asio.hpp>
+
+class SinkServer;
+typedef std::shared_ptr<SinkServer> SinkServerRef;
+
+//a local smtp server that accepts everything and keeps nothing, to measure the mailer against
+//replies can be delayed, refused on purpose and the reading slowed down to act like a busy server
+class SinkServer {
+public:
+    //refuses a command with the code, for a part of the commands that contain the match
+    //the command is the verb like RCPT, or a single dot for the end of the data
+    struct Rule {
+        Rule(const std::string& command, int code, double probability=1, const std::string& match="") : mCommand(command), mMatch(match), mCode(code), mProbability(probability){}
+        
+        std::string mCommand;
+        std::string mMatch;
+        int         mCode;
+        double      mProbability;
+    };
+    
+    struct Settings {
+        Settings() : mLatency(0), mReadChunk(65536), mReadDelay(0), mPipelining(true), mChunking(true), mThreads(1){}
+        
+        double              mLatency; //seconds before every reply
+        size_t              mReadChunk; //bytes read at once
+        double              mReadDelay; //seconds between reads, with a small chunk the client has to wait on us
+        bool                mPipelining;
+        bool                mChunking; //BDAT (RFC 3030)
+        size_t              mThreads;
+        std::vector<Rule>   mRules;
+    };
+    
+    //listens on the loopback, a port of 0 takes a free one
+    static SinkServerRef create(const Settings& settings=Settings(), uint16_t port=0){
+        return SinkServerRef(new SinkServer(settings, port));
+    }
+    
+    ~SinkServer();
+    
+    uint16_t getPort() const{
+        return mPort;
+    }
+    
+    //messages completely received
+    size_t getMessages() const{
+        return mMessages;
+    }
+    
+    //bytes of message data received
+    uint64_t getBytes() const{
+        return mBytes;
+    }
+    
+    size_t getConnections() const{
+        return mConnections;
+    }
+
+protected:
+    SinkServer(const Settings& settings, uint16_t port);
+    
+    class Connection;
+    typedef std::shared_ptr<Connection> ConnectionRef;
+    
+    void accept();
+    
+    //the code of the first rule that hits, 0 when none does
+    int check(const std::string& command, const std::string& line);
+    
+    boost::asio::io_service                     mIos;
+    std::shared_ptr<boost::asio::io_service::work> mWork;
+    boost::asio::ip::tcp::acceptor              mAcceptor;
+    std::vector<std::shared_ptr<std::thread> >  mThreads;
+    
+    Settings                                    mSettings;
+    uint16_t                                    mPort;
+    
+    std::mutex                                  mRandomMutex;
+    std::mt19937                                mRandom;
+    
+    std::atomic<size_t>                         mMessages;
+    std::atomic<uint64_t>                       mBytes;
+    std::atomic<size_t>                         mConnections;
+};
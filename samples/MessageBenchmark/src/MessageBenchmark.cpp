@@ -0,0 +1,401 @@
+//
+//  MessageBenchmark.cpp
+//  MailBlock
+//
+//  Created by Sylvain Vriens on 25/04/2013.
+//
+//
+
+#include "MessageBenchmark.h"
+#include "MessageTemplate.h"
+#include "Spool.h"
+
+#include <fstream>
+#include <random>
+#include <algorithm>
+#include <regex>
+
+using namespace cinder::mail;
+
+namespace {
+    
+    const char* WORDS[] = {
+        "the", "mailer", "sends", "every", "message", "through", "a", "pool", "of", "sessions", "and",
+        "newsletter", "subscribers", "receive", "weekly", "updates", "about", "products", "events", "with",
+        "links", "images", "offers", "inside", "our", "team", "would", "like", "to", "thank", "you"
+    };
+    
+    std::string createSentence(std::mt19937& random, size_t words){
+        std::string sentence;
+        for(size_t i=0; i<words; ++i){
+            if(i) sentence += ' ';
+            sentence += WORDS[random() % (sizeof(WORDS)/sizeof(WORDS[0]))];
+        }
+        return sentence + ".";
+    }
+    
+    //the regular expressions stripHTML replaced the single pass, as the baseline it is compared to
+    std::string stripHTMLRegex(const std::string& html){
+        std::string text = std::regex_replace(html, std::regex("<p>|<p/>|<p .*?>"), "\n\n");
+        text = std::regex_replace(text, std::regex("<br>|<br/>"), "\n");
+        return std::regex_replace(text, std::regex("<.*?>"), "");
+    }
+    
+    bool isPlainASCII(const std::string& data){
+        for(auto c: data){
+            if(static_cast<unsigned char>(c)>=0x80) return false;
+        }
+        return true;
+    }
+    
+    //the size of the text segments, attachments are encoded while they are written
+    size_t getSize(const Message::Segments& segments){
+        size_t size = 0;
+        for(auto& segment: segments){
+            if(!segment.mAttachment) size += segment.getData().size();
+        }
+        return size;
+    }
+    
+    //random bytes, shared so the large ones are not copied into every benchmark
+    std::shared_ptr<const std::string> createBinary(size_t size){
+        std::mt19937 random(4);
+        std::shared_ptr<std::string> data(new std::string(size, 0));
+        for(auto& c: *data){
+            c = static_cast<char>(random());
+        }
+        return data;
+    }
+    
+}
+
+std::string MessageBenchmark::createPlainText(size_t size){
+    std::mt19937 random(1);
+    std::string text;
+    while(text.size()<size){
+        switch(random() % 8){
+            case 0:
+                //a paragraph on a single line, it has to be wrapped
+                text += createSentence(random, 40 + random() % 40) + "\r\n\r\n";
+                break;
+            case 1:
+                text += "." + createSentence(random, 4) + "\n";
+                break;
+            default:
+                text += createSentence(random, 4 + random() % 10) + "\r\n";
+                break;
+        }
+    }
+    return text;
+}
+
+std::string MessageBenchmark::createInternationalText(size_t size){
+    const char* words[] = {
+        "le", "d\xC3\xA9j\xC3\xA0", "tr\xC3\xA8s", "\xC3\xA9v\xC3\xA9nement", "fen\xC3\xAAtre", "gar\xC3\xA7on", "und", "f\xC3\xBCr",
+        "Stra\xC3\x9F" "e", "sch\xC3\xB6n", "Gr\xC3\xBC\xC3\x9F" "e", "newsletter", "offre", "Angebot", "semaine", "Woche", "nos", "produits"
+    };
+    
+    std::mt19937 random(3);
+    std::string text;
+    while(text.size()<size){
+        size_t count = 4 + random() % 12;
+        for(size_t i=0; i<count; ++i){
+            if(i) text += ' ';
+            text += words[random() % (sizeof(words)/sizeof(words[0]))];
+        }
+        text += ".\r\n";
+    }
+    return text;
+}
+
+std::string MessageBenchmark::createNewsletter(size_t size, size_t images){
+    std::mt19937 random(2);
+    std::string html = "<!DOCTYPE html>\n<html><head><title>Weekly news</title>\n"
+                       "<style type=\"text/css\">body{font-family:Arial;} td.item{padding:8px;} a{color:#336699;}</style>\n"
+                       "</head><body>\n<table width=\"600\" cellpadding=\"0\" cellspacing=\"0\" align=\"center\">\n";
+    
+    size_t item = 0;
+    while(html.size()<size){
+        html += "<tr><td class=\"item\">";
+        if(images){
+            html += "<img src=\"cid:image" + ci::toString(item % images) + ".png\" width=\"120\" alt=\"\"/>";
+        }
+        html += "</td><td class=\"item\"><h2>" + createSentence(random, 5) + "</h2>\n";
+        html += "<p>" + createSentence(random, 30 + random() % 30) + " &amp; " + createSentence(random, 10) + "&nbsp;&mdash;</p>\n";
+        html += "<p><a href=\"https://example.com/item/" + ci::toString(item) + "?utm_source=newsletter\">Read more &raquo;</a></p></td></tr>\n";
+        ++item;
+    }
+    
+    html += "</table>\n<p style=\"font-size:10px\">&copy; 2013 &ndash; <a href=\"https://example.com/unsubscribe\">unsubscribe</a></p>\n</body></html>\n";
+    return html;
+}
+
+ci::fs::path MessageBenchmark::createImage(const ci::fs::path& directory, size_t index, size_t size){
+    ci::fs::path path = directory / ("image" + ci::toString(index) + ".png");
+    
+    std::mt19937 random(static_cast<uint32_t>(index));
+    std::string data(size, 0);
+    for(auto& c: data){
+        c = static_cast<char>(random());
+    }
+    
+    std::ofstream file(path.string().c_str(), std::ios::binary);
+    file.write(data.data(), data.size());
+    return path;
+}
+
+std::vector<Microbenchmark> MessageBenchmark::createSuite(const ci::fs::path& directory){
+    ci::fs::create_directories(directory);
+    
+    std::vector<Microbenchmark> suite;
+    
+    std::string text = createPlainText(32*1024);
+    std::string newsletter = createNewsletter(48*1024);
+    
+    //the text helpers on their own
+    suite.push_back(Microbenchmark("formatText/plain 32KB", [text](){
+        std::string output;
+        formatText(text.data(), text.size(), output);
+        return output.size();
+    }));
+    
+    //picking the transfer encoding of text that is not plain ascii, then the encodings themselves
+    std::string international = createInternationalText(32*1024);
+    suite.push_back(Microbenchmark("scanText/international 32KB", [international](){
+        return scanText(international.data(), international.size()).mLongestRun ? international.size() : 0;
+    }));
+    suite.push_back(Microbenchmark("encodeQuotedPrintable/international 32KB", [international](){
+        std::string output;
+        encodeQuotedPrintable(international.data(), international.size(), output);
+        return output.size();
+    }));
+    
+    //the same text as a message, scanned, encoded or formatted and labelled
+    MessageRef accented = Message::create();
+    accented->setSender("sender@example.com");
+    accented->addRecipient("recipient@example.com");
+    accented->setMessage(international);
+    suite.push_back(Microbenchmark("getSegments/international 32KB 7bit", [accented](){
+        return getSize(accented->getSegments());
+    }));
+    suite.push_back(Microbenchmark("getSegments/international 32KB 8bit", [accented](){
+        return getSize(accented->getSegments(true));
+    }));
+    
+    //newsletters of a few megabytes, and a single line that long which has to be wrapped all the way
+    //plain ascii without long words, so both are sent as 7bit text which is formatted
+    std::shared_ptr<const std::string> largeNewsletter(new std::string(createNewsletter(2*1024*1024)));
+    suite.push_back(Microbenchmark("formatText/newsletter 2MB", [largeNewsletter](){
+        std::string output;
+        formatText(largeNewsletter->data(), largeNewsletter->size(), output);
+        return output.size();
+    }));
+    
+    std::shared_ptr<std::string> singleLine(new std::string(createPlainText(2*1024*1024)));
+    std::replace(singleLine->begin(), singleLine->end(), '\r', ' ');
+    std::replace(singleLine->begin(), singleLine->end(), '\n', ' ');
+    suite.push_back(Microbenchmark("formatText/single line 2MB", [singleLine](){
+        std::string output;
+        formatText(singleLine->data(), singleLine->size(), output);
+        return output.size();
+    }));
+    
+    suite.push_back(Microbenchmark("stripHTML/newsletter 48KB", [newsletter](){
+        std::string output;
+        stripHTML(newsletter.data(), newsletter.size(), output);
+        return output.size();
+    }));
+    suite.push_back(Microbenchmark("stripHTMLRegex/newsletter 48KB", [newsletter](){
+        return stripHTMLRegex(newsletter).size();
+    }));
+    
+    //the size of the newsletters that overflowed the stack of the regular expressions
+    suite.push_back(Microbenchmark("stripHTML/newsletter 2MB", [largeNewsletter](){
+        std::string output;
+        stripHTML(largeNewsletter->data(), largeNewsletter->size(), output);
+        return output.size();
+    }));
+    suite.push_back(Microbenchmark("stripHTMLRegex/newsletter 2MB", [largeNewsletter](){
+        return stripHTMLRegex(*largeNewsletter).size();
+    }));
+    
+    //the vectorized encoder against the one of cinder that attachments were encoded with before
+    const std::pair<size_t, const char*> binarySizes[] = {
+        std::make_pair(1024, "1KB"), std::make_pair(1024*1024, "1MB"), std::make_pair(100*1024*1024, "100MB")
+    };
+    for(auto& size: binarySizes){
+        std::shared_ptr<const std::string> binary = createBinary(size.first);
+        suite.push_back(Microbenchmark(std::string("encodeBase64/binary ") + size.second, [binary](){
+            std::string output;
+            encodeBase64(binary->data(), binary->size(), output);
+            return output.size();
+        }));
+        suite.push_back(Microbenchmark(std::string("ci::toBase64/binary ") + size.second, [binary](){
+            return ci::toBase64(*binary, MAIL_SMTP_BASE64_LINE_WIDTH).size();
+        }));
+    }
+    
+    AttachmentRef image = Message::Attachment::create(createImage(directory, 0, 16*1024), true);
+    suite.push_back(Microbenchmark("Attachment::getData/image 16KB", [image](){
+        return image->getData().size();
+    }));
+    
+    //complete messages
+    MessageRef plainMessage = Message::create();
+    plainMessage->setSender("sender@example.com", "Sender");
+    plainMessage->addRecipient("recipient@example.com", "Recipient");
+    plainMessage->setSubject("Plain text");
+    plainMessage->setMessage(text);
+    suite.push_back(Microbenchmark("Message::getData/plain 32KB", [plainMessage](){
+        return plainMessage->getData().size();
+    }));
+    
+    MessageRef newsletterMessage = Message::create();
+    newsletterMessage->setSender("news@example.com", "Newsletter");
+    newsletterMessage->addRecipient("subscriber@example.com");
+    newsletterMessage->setSubject("Weekly news");
+    newsletterMessage->setHTML(newsletter);
+    suite.push_back(Microbenchmark("Message::getData/newsletter 48KB", [newsletterMessage](){
+        return newsletterMessage->getData().size();
+    }));
+    suite.push_back(Microbenchmark("getSegments/newsletter 48KB", [newsletterMessage](){
+        return getSize(newsletterMessage->getSegments());
+    }));
+    
+    MessageRef recipientsMessage = Message::create();
+    recipientsMessage->setSender("news@example.com", "Newsletter");
+    for(size_t i=0; i<500; ++i){
+        recipientsMessage->addRecipient("subscriber" + ci::toString(i) + "@example.com", "Subscriber " + ci::toString(i));
+    }
+    for(size_t i=0; i<100; ++i){
+        recipientsMessage->addRecipient("copy" + ci::toString(i) + "@example.com", Message::CC);
+    }
+    recipientsMessage->setSubject("Many recipients");
+    recipientsMessage->setMessage(createPlainText(1024));
+    suite.push_back(Microbenchmark("Message::getData/600 recipients", [recipientsMessage](){
+        return recipientsMessage->getData().size();
+    }));
+    suite.push_back(Microbenchmark("Message::getHeaders/600 recipients", [recipientsMessage](){
+        size_t size = 0;
+        for(auto& header: recipientsMessage->getHeaders()){
+            size += header.size();
+        }
+        return size;
+    }));
+    
+    //reusing a writer, these should not allocate once it has grown
+    std::shared_ptr<HeaderWriter> writer(new HeaderWriter());
+    suite.push_back(Microbenchmark("Message::writeEnvelope/600 recipients", [recipientsMessage, writer](){
+        writer->clear();
+        recipientsMessage->writeEnvelope(*writer);
+        return writer->size();
+    }));
+    //the envelope of a delivery as the session writes it into its command buffer
+    std::shared_ptr<const std::vector<std::string> > recipients(new std::vector<std::string>(recipientsMessage->getRecipients()));
+    std::string sender = recipientsMessage->getSender();
+    suite.push_back(Microbenchmark("HeaderWriter::writeEnvelope/600 recipients", [sender, recipients, writer](){
+        writer->clear();
+        writer->writeEnvelope(sender, *recipients, " BODY=8BITMIME");
+        return writer->size();
+    }));
+    suite.push_back(Microbenchmark("Message::writeHeaders/600 recipients", [recipientsMessage, writer](){
+        writer->clear();
+        recipientsMessage->writeHeaders(*writer);
+        return writer->size();
+    }));
+    
+    //the headers of a single personalised message, with a name and subject that have to be encoded
+    MessageRef personalMessage = Message::create();
+    personalMessage->setSender("news@example.com", "Zo\xC3\xAB's Newsletter");
+    personalMessage->addRecipient("jose@example.com", "Jos\xC3\xA9 Mu\xC3\xB1oz");
+    personalMessage->setSubject("Jos\xC3\xA9, your weekly selection of offers \xE2\x80\x93 only until Sunday, don't miss them");
+    suite.push_back(Microbenchmark("Message::writeHeaders/encoded personal", [personalMessage, writer](){
+        writer->clear();
+        personalMessage->writeHeaders(*writer);
+        return writer->size();
+    }));
+    
+    MessageRef imagesMessage = Message::create();
+    imagesMessage->setSender("news@example.com", "Newsletter");
+    imagesMessage->addRecipient("subscriber@example.com");
+    imagesMessage->setSubject("Many images");
+    imagesMessage->setHTML(createNewsletter(48*1024, 20));
+    for(size_t i=0; i<20; ++i){
+        imagesMessage->addInlineAttachment(createImage(directory, i, 16*1024));
+    }
+    suite.push_back(Microbenchmark("Message::getData/20 inline images", [imagesMessage](){
+        return imagesMessage->getData().size();
+    }));
+    
+    //enqueueing into the spool against how often it syncs, a single entry per iteration so ops/s is entries/s
+    //every entry is acknowledged right away like a delivered message, so the segments are removed again
+    //the acknowledgement is a write that the policy counts as well
+    const std::pair<size_t, const char*> spoolSizes[] = {
+        std::make_pair(4*1024, "4KB"), std::make_pair(256*1024, "256KB")
+    };
+    struct SyncPolicy {
+        size_t      mWrites;
+        double      mSeconds;
+        const char* mName;
+    };
+    const SyncPolicy policies[] = {
+        {1, 0, "sync every write"}, {16, 0, "sync every 16"}, {256, 0, "sync every 256"}, {size_t(-1), 0.01, "sync every 10ms"}
+    };
+    Message::Headers envelope;
+    envelope.push_back("MAIL FROM:<news@example.com>");
+    envelope.push_back("RCPT TO:<subscriber@example.com>");
+    for(auto& size: spoolSizes){
+        std::shared_ptr<const std::string> data = createBinary(size.first);
+        for(auto& policy: policies){
+            std::string name = std::string("Spool::append/") + policy.mName + " " + size.second;
+            ci::fs::path path = directory / "spool" / name.substr(name.find('/') + 1);
+            boost::system::error_code error;
+            ci::fs::remove_all(path, error);
+            
+            SpoolRef spool = Spool::create(path, 16*1024*1024);
+            spool->setSyncPolicy(policy.mWrites, policy.mSeconds);
+            suite.push_back(Microbenchmark(name, [spool, envelope, data](){
+                spool->acknowledge(spool->append(envelope, *data));
+                return data->size();
+            }));
+        }
+    }
+    
+    return suite;
+}
+
+std::vector<std::string> MessageBenchmark::verify(){
+    std::vector<std::string> failures;
+    auto check = [&failures](bool condition, const std::string& name){
+        if(!condition) failures.push_back(name);
+    };
+    
+    //a value that is not ascii in a template that is, the parts are labelled by the text with the values in place
+    MessageRef message = Message::create();
+    message->setSender("news@example.com", "Newsletter");
+    message->setSubject("Offers for {{name}}");
+    message->setHTML("<p>Dear {{name}},</p><p>this week only.</p>");
+    MessageTemplateRef messageTemplate = MessageTemplate::create(message);
+    
+    MessageTemplate::Fields fields;
+    fields["name"] = "Jos\xC3\xA9";
+    MessageRef accented = messageTemplate->render("jose@example.com", "", fields);
+    std::string encoded = accented->getData(false);
+    check(isPlainASCII(encoded), "template/non-ascii field without 8BITMIME is plain ascii");
+    check(encoded.find("Content-transfer-encoding: 7bit")==std::string::npos, "template/non-ascii field without 8BITMIME is not labelled 7bit");
+    check(encoded.find("Dear Jos=C3=A9")!=std::string::npos, "template/non-ascii field without 8BITMIME is quoted-printable");
+    
+    check(accented->isEightBit(), "template/non-ascii field needs 8BITMIME to be sent as it is");
+    std::string eightBit = accented->getData(true);
+    check(eightBit.find("Content-transfer-encoding: 7bit")==std::string::npos, "template/non-ascii field with 8BITMIME is not labelled 7bit");
+    check(eightBit.find("Dear Jos\xC3\xA9")!=std::string::npos, "template/non-ascii field with 8BITMIME is 8bit");
+    
+    //plain values keep the shared body
+    fields["name"] = "Joe";
+    MessageRef plain = messageTemplate->render("joe@example.com", "", fields);
+    Message::Segments segments = plain->getSegments();
+    check(std::any_of(segments.begin(), segments.end(), [](const Message::Segment& segment){ return segment.mShared; }) && !plain->isEightBit(), "template/ascii field shares the body");
+    check(plain->getData(false).find("Dear Joe,")!=std::string::npos, "template/ascii field is inserted");
+    
+    return failures;
+}
@@ -0,0 +1,31 @@
+//
+//  MessageBenchmark.h
+//  MailBlock
+//
+//  Created by Sylvain Vriens on 25/04/2013.
+//
+//
+
+#pragma once
+
+#include "Microbenchmark.h"
+#include "Message.h"
+
+//the serialization of messages on representative corpora, the parts are measured on their own as well
+class MessageBenchmark {
+public:
+    //the attachments are written to the directory, it is created when needed
+    static std::vector<Microbenchmark> createSuite(const ci::fs::path& directory);
+    
+    //checks the output of messages where a shared or cached body could be wrong, returns what failed
+    static std::vector<std::string> verify();
+    
+    //prose with long lines, short lines and lines starting with a dot
+    static std::string createPlainText(size_t size);
+    //the same prose in french and german, so about one byte in twenty is part of a utf-8 character
+    static std::string createInternationalText(size_t size);
+    //a newsletter layout with tables, styles, entities and cid references to the images
+    static std::string createNewsletter(size_t size, size_t images=0);
+    //random bytes with an image extension
+    static ci::fs::path createImage(const ci::fs::path& directory, size_t index, size_t size);
+};
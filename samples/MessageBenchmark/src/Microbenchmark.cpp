@@ -0,0 +1,95 @@
+//
+//  Microbenchmark.cpp
+//  MailBlock
+//
+//  Created by Sylvain Vriens on 25/04/2013.
+//
+//
+
+#include "Microbenchmark.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+namespace {
+    
+    std::atomic<size_t>     allocations(0);
+    std::atomic<uint64_t>   allocatedBytes(0);
+    
+    //keeps the compiler from dropping the work
+    volatile size_t         produced = 0;
+    
+}
+
+//every other form of new and delete ends up here
+void* operator new(size_t size){
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+    void* data = malloc(size ? size : 1);
+    if(!data) throw std::bad_alloc();
+    return data;
+}
+
+void* operator new[](size_t size){
+    return operator new(size);
+}
+
+void operator delete(void* data) noexcept{
+    free(data);
+}
+
+void operator delete[](void* data) noexcept{
+    free(data);
+}
+
+size_t getAllocationCount(){
+    return allocations.load(std::memory_order_relaxed);
+}
+
+uint64_t getAllocatedBytes(){
+    return allocatedBytes.load(std::memory_order_relaxed);
+}
+
+MicrobenchmarkResult runMicrobenchmark(const Microbenchmark& benchmark, double minTime){
+    MicrobenchmarkResult result;
+    
+    //once to warm the caches and to know the size
+    result.mBytes = benchmark.mFunction();
+    
+    for(size_t iterations=1; ; iterations*=2){
+        size_t count = getAllocationCount();
+        uint64_t bytes = getAllocatedBytes();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        
+        for(size_t i=0; i<iterations; ++i){
+            produced = produced + benchmark.mFunction();
+        }
+        
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if(seconds<minTime && iterations<(size_t(1)<<30)) continue;
+        
+        result.mIterations = iterations;
+        result.mNanoseconds = seconds * 1e9 / iterations;
+        result.mNanosecondsPerByte = result.mBytes ? result.mNanoseconds / result.mBytes : 0;
+        result.mAllocations = static_cast<double>(getAllocationCount() - count) / iterations;
+        result.mAllocatedBytes = static_cast<double>(getAllocatedBytes() - bytes) / iterations;
+        return result;
+    }
+}
+
+std::string formatMicrobenchmarkHeader(){
+    return "benchmark                                   iterations         ns      ops/s     bytes  ns/byte     MB/s  allocs  alloc KB";
+}
+
+std::string formatMicrobenchmarkResult(const Microbenchmark& benchmark, const MicrobenchmarkResult& result){
+    char row[256];
+    snprintf(row, sizeof(row), "%-40s  %12lu  %9.0f  %9.0f  %8lu  %7.3f  %7.1f  %6.1f  %8.1f",
+             benchmark.mName.c_str(), static_cast<unsigned long>(result.mIterations), result.mNanoseconds,
+             result.mNanoseconds>0 ? 1e9 / result.mNanoseconds : 0, static_cast<unsigned long>(result.mBytes), result.mNanosecondsPerByte,
+             result.mNanosecondsPerByte>0 ? 1e9 / result.mNanosecondsPerByte / (1024*1024) : 0,
+             result.mAllocations, result.mAllocatedBytes / 1024);
+    return row;
+}
@@ -0,0 +1,46 @@
+//
+//  Microbenchmark.h
+//  MailBlock
+//
+//  Created by Sylvain Vriens on 25/04/2013.
+//
+//
+
+#pragma once
+
+#include "cinder/Cinder.h"
+
+#include <functional>
+
+//a single hot path, timed in a loop like google benchmark does
+struct Microbenchmark {
+    //runs the code once and returns the bytes it produced
+    typedef std::function<size_t()> Function;
+    
+    Microbenchmark(const std::string& name, const Function& function) : mName(name), mFunction(function){}
+    
+    std::string mName;
+    Function    mFunction;
+};
+
+struct MicrobenchmarkResult {
+    MicrobenchmarkResult() : mIterations(0), mBytes(0), mNanoseconds(0), mNanosecondsPerByte(0), mAllocations(0), mAllocatedBytes(0){}
+    
+    size_t      mIterations;
+    size_t      mBytes; //produced by a single iteration
+    double      mNanoseconds; //per iteration
+    double      mNanosecondsPerByte;
+    double      mAllocations; //per iteration
+    double      mAllocatedBytes; //per iteration
+};
+
+//doubles the iterations until a run takes at least the minimum time, the last run is the result
+MicrobenchmarkResult runMicrobenchmark(const Microbenchmark& benchmark, double minTime=0.5);
+
+//a table header and a row per result
+std::string formatMicrobenchmarkHeader();
+std::string formatMicrobenchmarkResult(const Microbenchmark& benchmark, const MicrobenchmarkResult& result);
+
+//counted by the global operator new of this sample, for all threads
+size_t getAllocationCount();
+uint64_t getAllocatedBytes();
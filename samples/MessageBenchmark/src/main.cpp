@@ -0,0 +1,34 @@
+//
+//  main.cpp
+//  MailBlock
+//
+//  Created by Sylvain Vriens on 25/04/2013.
+//
+//
+
+#include "MessageBenchmark.h"
+
+#include <iostream>
+
+//a console program, so nothing else allocates while it measures
+//the first argument only runs the benchmarks whose name contains it, the second is the minimum time per benchmark
+int main(int argc, char* argv[]){
+    std::string filter = argc>1 ? argv[1] : "";
+    double minTime = argc>2 ? atof(argv[2]) : 0.5;
+    
+    //measuring wrong output is pointless
+    std::vector<std::string> failures = MessageBenchmark::verify();
+    for(auto& failure: failures){
+        std::cout << "FAILED " << failure << std::endl;
+    }
+    if(!failures.empty()) return 1;
+    
+    std::vector<Microbenchmark> suite = MessageBenchmark::createSuite(ci::fs::temp_directory_path() / "MessageBenchmark");
+    
+    std::cout << formatMicrobenchmarkHeader() << std::endl;
+    for(auto& benchmark: suite){
+        if(benchmark.mName.find(filter)==std::string::npos) continue;
+        std::cout << formatMicrobenchmarkResult(benchmark, runMicrobenchmark(benchmark, minTime)) << std::endl;
+    }
+    return 0;
+}
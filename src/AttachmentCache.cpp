@@ -0,0 +1,92 @@
+//
+//  AttachmentCache.cpp
+//  MailBlock
+//
+//  Created by Sylvain Vriens on 25/04/2013.
+//
+//
+
+#include "AttachmentCache.h"
+
+#include <cstring>
+
+using namespace cinder::mail;
+
+uint64_t AttachmentCache::hash(const void* data, size_t size, uint64_t seed){
+    //multiply and rotate per 64 bit word, in the spirit of murmur
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    
+    uint64_t h = seed ^ 0x9e3779b97f4a7c15ULL;
+    size_t i = 0;
+    for(; i+8<=size; i+=8){
+        uint64_t k;
+        memcpy(&k, bytes + i, 8);
+        k *= m;
+        k ^= k >> 47;
+        k *= m;
+        h ^= k;
+        h = (h << 27) | (h >> 37);
+        h = h * 5 + 0x52dce729;
+    }
+    
+    //the tail and the length, so content of different sizes does not collide on zeros
+    uint64_t tail = 0;
+    memcpy(&tail, bytes + i, size - i);
+    h ^= (tail ^ size) * m;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+AttachmentCache::BodyRef AttachmentCache::find(const Source& source){
+    std::lock_guard<std::mutex> lock(mMutex);
+    
+    std::unordered_map<uint64_t, Entries::iterator>::iterator itr = mIndex.find(source.mHash);
+    if(itr==mIndex.end() || itr->second->first!=source){
+        ++mMisses;
+        return BodyRef();
+    }
+    
+    //move to the front as most recently used
+    mEntries.splice(mEntries.begin(), mEntries, itr->second);
+    ++mHits;
+    return itr->second->second;
+}
+
+void AttachmentCache::insert(const Source& source, const BodyRef& body){
+    if(!body || !accepts(body->size())) return;
+    
+    std::lock_guard<std::mutex> lock(mMutex);
+    
+    //another thread might have been first, or other content has the same hash
+    if(mIndex.count(source.mHash)) return;
+    
+    mEntries.push_front(Entry(source, body));
+    mIndex[source.mHash] = mEntries.begin();
+    mBytes += body->size();
+    
+    trim();
+}
+
+void AttachmentCache::setMaxBytes(size_t maxBytes){
+    std::lock_guard<std::mutex> lock(mMutex);
+    mMaxBytes = maxBytes;
+    trim();
+}
+
+void AttachmentCache::clear(){
+    std::lock_guard<std::mutex> lock(mMutex);
+    mEntries.clear();
+    mIndex.clear();
+    mBytes = 0;
+}
+
+void AttachmentCache::trim(){
+    while(mBytes>mMaxBytes && !mEntries.empty()){
+        mBytes -= mEntries.back().second->size();
+        mIndex.erase(mEntries.back().first.mHash);
+        mEntries.pop_back();
+    }
+}
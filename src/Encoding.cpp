@@ -0,0 +1,504 @@
+//
+//  Encoding.cpp
+//  MailBlock
+//
+//  Created by Sylvain Vriens on 25/04/2013.
+//
+//
+
+#include "Encoding.h"
+
+#include <cstdint>
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define MAIL_ENCODING_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define MAIL_TARGET(x)
+#else
+#define MAIL_TARGET(x) __attribute__((target(x)))
+#endif
+#endif
+
+using namespace cinder::mail;
+
+namespace {
+    
+    const char BASE64_TABLE[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    
+    //encodes groups of 3 bytes, padding the last group
+    inline char* encodeScalar(const uint8_t* input, size_t size, char* output){
+        size_t i = 0;
+        for(; i+3<=size; i+=3){
+            uint32_t value = (input[i]<<16) | (input[i+1]<<8) | input[i+2];
+            output[0] = BASE64_TABLE[(value>>18)&63];
+            output[1] = BASE64_TABLE[(value>>12)&63];
+            output[2] = BASE64_TABLE[(value>>6)&63];
+            output[3] = BASE64_TABLE[value&63];
+            output += 4;
+        }
+        
+        if(i<size){
+            uint32_t value = input[i]<<16;
+            if(i+1<size) value |= input[i+1]<<8;
+            output[0] = BASE64_TABLE[(value>>18)&63];
+            output[1] = BASE64_TABLE[(value>>12)&63];
+            output[2] = i+1<size ? BASE64_TABLE[(value>>6)&63] : '=';
+            output[3] = '=';
+            output += 4;
+        }
+        return output;
+    }
+    
+    //encodes a single line, returns the end of the output
+    typedef char* (*LineEncoder)(const uint8_t* input, size_t size, char* output);
+
+#if defined(MAIL_ENCODING_X86)
+    
+    //the pshufb based encoding by Wojciech Mula, 12 bytes in 16 characters out per 128 bits
+    
+    MAIL_TARGET("ssse3")
+    inline __m128i encodeBlock(__m128i in){
+        in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+        
+        //spread the 4 groups of 6 bits over 4 bytes
+        const __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+        const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+        const __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+        const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+        const __m128i indices = _mm_or_si128(t1, t3);
+        
+        //map 0..63 on the alphabet by adding an offset picked per range
+        __m128i result = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+        const __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+        result = _mm_or_si128(result, _mm_and_si128(less, _mm_set1_epi8(13)));
+        const __m128i shift = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                            '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+        result = _mm_shuffle_epi8(shift, result);
+        return _mm_add_epi8(result, indices);
+    }
+    
+    MAIL_TARGET("ssse3")
+    char* encodeSSSE3(const uint8_t* input, size_t size, char* output){
+        size_t i = 0;
+        //every load reads 16 bytes but only uses 12
+        for(; i+16<=size; i+=12){
+            __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(output), encodeBlock(in));
+            output += 16;
+        }
+        return encodeScalar(input + i, size - i, output);
+    }
+    
+    MAIL_TARGET("avx2")
+    char* encodeAVX2(const uint8_t* input, size_t size, char* output){
+        const __m256i shuffle = _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+                                                10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+        const __m256i shift = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                               '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+                                               'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                               '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+        
+        size_t i = 0;
+        //two lanes of 12 bytes, the second load reads up to 28 bytes ahead
+        for(; i+28<=size; i+=24){
+            __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i));
+            __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i + 12));
+            __m256i in = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+            
+            in = _mm256_shuffle_epi8(in, shuffle);
+            const __m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+            const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+            const __m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+            const __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+            const __m256i indices = _mm256_or_si256(t1, t3);
+            
+            __m256i result = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+            const __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+            result = _mm256_or_si256(result, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+            result = _mm256_shuffle_epi8(shift, result);
+            result = _mm256_add_epi8(result, indices);
+            
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(output), result);
+            output += 32;
+        }
+        return encodeSSSE3(input + i, size - i, output);
+    }
+    
+    bool hasCPU(int level){
+#if defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 0);
+        int count = info[0];
+        if(count<1) return false;
+        __cpuid(info, 1);
+        bool ssse3 = (info[2] & (1<<9))!=0;
+        if(level==0) return ssse3;
+        //avx2 also needs the os to save the ymm registers
+        bool osxsave = (info[2] & (1<<27))!=0 && (info[2] & (1<<28))!=0;
+        if(!osxsave || count<7 || (_xgetbv(0) & 6)!=6) return false;
+        __cpuidex(info, 7, 0);
+        return (info[1] & (1<<5))!=0;
+#else
+        __builtin_cpu_init();
+        return level==0 ? __builtin_cpu_supports("ssse3") : __builtin_cpu_supports("avx2");
+#endif
+    }
+
+#endif
+    
+    char* encodeLineScalar(const uint8_t* input, size_t size, char* output){
+        return encodeScalar(input, size, output);
+    }
+    
+    //picks the fastest encoder once
+    LineEncoder getLineEncoder(){
+#if defined(MAIL_ENCODING_X86)
+        static const LineEncoder encoder = hasCPU(1) ? encodeAVX2 : (hasCPU(0) ? encodeSSSE3 : encodeLineScalar);
+#else
+        static const LineEncoder encoder = encodeLineScalar;
+#endif
+        return encoder;
+    }
+    
+}
+
+size_t cinder::mail::base64EncodedSize(size_t size, size_t lineWidth){
+    lineWidth = lineWidth/4*4;
+    size_t chars = (size + 2) / 3 * 4;
+    if(!lineWidth || !chars) return chars;
+    size_t lines = (chars + lineWidth - 1) / lineWidth;
+    return chars + (lines - 1) * 2;
+}
+
+size_t cinder::mail::encodeBase64(const void* input, size_t size, char* output, size_t lineWidth){
+    const uint8_t* data = static_cast<const uint8_t*>(input);
+    LineEncoder encoder = getLineEncoder();
+    
+    //whole groups of 3 bytes per line
+    size_t lineInput = lineWidth/4*3;
+    if(!lineInput){
+        lineInput = size;
+    }
+    
+    char* out = output;
+    for(size_t i=0; i<size; i+=lineInput){
+        if(i){
+            *out++ = '\r';
+            *out++ = '\n';
+        }
+        out = encoder(data + i, std::min(lineInput, size - i), out);
+    }
+    return out - output;
+}
+
+void cinder::mail::encodeBase64(const void* input, size_t size, std::string& output, size_t lineWidth){
+    size_t offset = output.size();
+    output.resize(offset + base64EncodedSize(size, lineWidth));
+    encodeBase64(input, size, &output[offset], lineWidth);
+}
+
+//****************************//
+// quoted-printable           //
+//****************************//
+
+namespace {
+    
+    //characters on a quoted-printable line before the soft break
+    const size_t QP_LINE_WIDTH = 75;
+    
+    const char HEX_TABLE[] = "0123456789ABCDEF";
+    
+    inline bool isUnsafe(uint8_t c){
+        return (c<0x20 && c!='\t' && c!='\r' && c!='\n') || c>=0x7F || c=='=';
+    }
+    
+    inline bool isBreak(uint8_t c){
+        return c==' ' || c=='\r' || c=='\n';
+    }
+    
+    //the scan of bytes that are not a whole block, carrying the run over from the blocks before
+    void scanScalar(const uint8_t* input, size_t size, TextScan& scan, size_t& run){
+        for(size_t i=0; i<size; ++i){
+            uint8_t c = input[i];
+            if(c>=0x80) ++scan.mEightBit;
+            if(isUnsafe(c)) ++scan.mUnsafe;
+            if(!c) scan.mBinary = true;
+            if(isBreak(c)){
+                scan.mLongestRun = std::max(scan.mLongestRun, run);
+                run = 0;
+            }else{
+                ++run;
+            }
+        }
+    }
+    
+    //bytes at the start that quoted-printable writes as they are, at most size
+    size_t plainRunScalar(const uint8_t* input, size_t size){
+        size_t i = 0;
+        while(i<size && !isUnsafe(input[i]) && input[i]!='\r' && input[i]!='\n') ++i;
+        return i;
+    }
+    
+    typedef void (*TextScanner)(const uint8_t* input, size_t size, TextScan& scan, size_t& run);
+    typedef size_t (*RunScanner)(const uint8_t* input, size_t size);
+
+#if defined(MAIL_ENCODING_X86)
+    
+    inline size_t countBits(uint32_t value){
+#if defined(_MSC_VER)
+        value = value - ((value>>1) & 0x55555555);
+        value = (value & 0x33333333) + ((value>>2) & 0x33333333);
+        return (((value + (value>>4)) & 0x0F0F0F0F) * 0x01010101)>>24;
+#else
+        return __builtin_popcount(value);
+#endif
+    }
+    
+    inline size_t lowestBit(uint32_t value){
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanForward(&index, value);
+        return index;
+#else
+        return __builtin_ctz(value);
+#endif
+    }
+    
+    inline size_t highestBit(uint32_t value){
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanReverse(&index, value);
+        return index;
+#else
+        return 31 - __builtin_clz(value);
+#endif
+    }
+    
+    //the counts of a block of width bytes, with a mask per class
+    inline void scanMasks(uint32_t eight, uint32_t unsafe, uint32_t zero, uint32_t breaks, size_t width, TextScan& scan, size_t& run){
+        scan.mEightBit += countBits(eight);
+        scan.mUnsafe += countBits(unsafe);
+        if(zero) scan.mBinary = true;
+        
+        //only the runs that cross blocks are measured, the ones inside a block are too short to matter
+        if(!breaks){
+            run += width;
+            return;
+        }
+        scan.mLongestRun = std::max(scan.mLongestRun, run + lowestBit(breaks));
+        run = width - 1 - highestBit(breaks);
+    }
+    
+    MAIL_TARGET("sse2")
+    void scanSSE2(const uint8_t* input, size_t size, TextScan& scan, size_t& run){
+        size_t i = 0;
+        for(; i+16<=size; i+=16){
+            __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i));
+            
+            //a signed compare, so everything above 127 is below the space as well
+            __m128i control = _mm_cmplt_epi8(in, _mm_set1_epi8(0x20));
+            __m128i lines = _mm_or_si128(_mm_cmpeq_epi8(in, _mm_set1_epi8('\r')), _mm_cmpeq_epi8(in, _mm_set1_epi8('\n')));
+            __m128i allowed = _mm_or_si128(lines, _mm_cmpeq_epi8(in, _mm_set1_epi8('\t')));
+            __m128i unsafe = _mm_or_si128(_mm_andnot_si128(allowed, control),
+                                          _mm_or_si128(_mm_cmpeq_epi8(in, _mm_set1_epi8(0x7F)), _mm_cmpeq_epi8(in, _mm_set1_epi8('='))));
+            __m128i breaks = _mm_or_si128(lines, _mm_cmpeq_epi8(in, _mm_set1_epi8(' ')));
+            
+            scanMasks(_mm_movemask_epi8(in), _mm_movemask_epi8(unsafe), _mm_movemask_epi8(_mm_cmpeq_epi8(in, _mm_setzero_si128())),
+                      _mm_movemask_epi8(breaks), 16, scan, run);
+        }
+        scanScalar(input + i, size - i, scan, run);
+    }
+    
+    MAIL_TARGET("avx2")
+    void scanAVX2(const uint8_t* input, size_t size, TextScan& scan, size_t& run){
+        size_t i = 0;
+        for(; i+32<=size; i+=32){
+            __m256i in = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(input + i));
+            
+            __m256i control = _mm256_cmpgt_epi8(_mm256_set1_epi8(0x20), in);
+            __m256i lines = _mm256_or_si256(_mm256_cmpeq_epi8(in, _mm256_set1_epi8('\r')), _mm256_cmpeq_epi8(in, _mm256_set1_epi8('\n')));
+            __m256i allowed = _mm256_or_si256(lines, _mm256_cmpeq_epi8(in, _mm256_set1_epi8('\t')));
+            __m256i unsafe = _mm256_or_si256(_mm256_andnot_si256(allowed, control),
+                                             _mm256_or_si256(_mm256_cmpeq_epi8(in, _mm256_set1_epi8(0x7F)), _mm256_cmpeq_epi8(in, _mm256_set1_epi8('='))));
+            __m256i breaks = _mm256_or_si256(lines, _mm256_cmpeq_epi8(in, _mm256_set1_epi8(' ')));
+            
+            scanMasks(_mm256_movemask_epi8(in), _mm256_movemask_epi8(unsafe), _mm256_movemask_epi8(_mm256_cmpeq_epi8(in, _mm256_setzero_si256())),
+                      _mm256_movemask_epi8(breaks), 32, scan, run);
+        }
+        scanScalar(input + i, size - i, scan, run);
+    }
+    
+    MAIL_TARGET("sse2")
+    size_t plainRunSSE2(const uint8_t* input, size_t size){
+        size_t i = 0;
+        for(; i+16<=size; i+=16){
+            __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i));
+            
+            //control characters except the tab, everything above 126 and the equal sign
+            __m128i control = _mm_andnot_si128(_mm_cmpeq_epi8(in, _mm_set1_epi8('\t')), _mm_cmplt_epi8(in, _mm_set1_epi8(0x20)));
+            __m128i escaped = _mm_or_si128(control, _mm_or_si128(_mm_cmpeq_epi8(in, _mm_set1_epi8(0x7F)), _mm_cmpeq_epi8(in, _mm_set1_epi8('='))));
+            
+            uint32_t mask = _mm_movemask_epi8(escaped);
+            if(mask) return i + lowestBit(mask);
+        }
+        return i + plainRunScalar(input + i, size - i);
+    }
+    
+    MAIL_TARGET("avx2")
+    size_t plainRunAVX2(const uint8_t* input, size_t size){
+        size_t i = 0;
+        for(; i+32<=size; i+=32){
+            __m256i in = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(input + i));
+            
+            __m256i control = _mm256_andnot_si256(_mm256_cmpeq_epi8(in, _mm256_set1_epi8('\t')), _mm256_cmpgt_epi8(_mm256_set1_epi8(0x20), in));
+            __m256i escaped = _mm256_or_si256(control, _mm256_or_si256(_mm256_cmpeq_epi8(in, _mm256_set1_epi8(0x7F)), _mm256_cmpeq_epi8(in, _mm256_set1_epi8('='))));
+            
+            uint32_t mask = _mm256_movemask_epi8(escaped);
+            if(mask) return i + lowestBit(mask);
+        }
+        
+        //the rest of a line is often shorter than 32, a 128 bit block is done here as calling the sse2 version would mix encodings
+        if(i+16<=size){
+            __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i));
+            __m128i control = _mm_andnot_si128(_mm_cmpeq_epi8(in, _mm_set1_epi8('\t')), _mm_cmplt_epi8(in, _mm_set1_epi8(0x20)));
+            __m128i escaped = _mm_or_si128(control, _mm_or_si128(_mm_cmpeq_epi8(in, _mm_set1_epi8(0x7F)), _mm_cmpeq_epi8(in, _mm_set1_epi8('='))));
+            
+            uint32_t mask = _mm_movemask_epi8(escaped);
+            if(mask) return i + lowestBit(mask);
+            i += 16;
+        }
+        return i + plainRunScalar(input + i, size - i);
+    }
+
+#endif
+    
+    //picks the fastest scanners once, the 128 bit ones go with the ssse3 check like the base64 encoder
+    TextScanner getTextScanner(){
+#if defined(MAIL_ENCODING_X86)
+        static const TextScanner scanner = hasCPU(1) ? scanAVX2 : (hasCPU(0) ? scanSSE2 : scanScalar);
+#else
+        static const TextScanner scanner = scanScalar;
+#endif
+        return scanner;
+    }
+    
+    RunScanner getRunScanner(){
+#if defined(MAIL_ENCODING_X86)
+        static const RunScanner scanner = hasCPU(1) ? plainRunAVX2 : (hasCPU(0) ? plainRunSSE2 : plainRunScalar);
+#else
+        static const RunScanner scanner = plainRunScalar;
+#endif
+        return scanner;
+    }
+    
+    inline char* writeEscaped(uint8_t c, char* out){
+        out[0] = '=';
+        out[1] = HEX_TABLE[c>>4];
+        out[2] = HEX_TABLE[c&15];
+        return out + 3;
+    }
+    
+}
+
+TextScan cinder::mail::scanText(const void* input, size_t size){
+    TextScan scan;
+    size_t run = 0;
+    getTextScanner()(static_cast<const uint8_t*>(input), size, scan, run);
+    scan.mLongestRun = std::max(scan.mLongestRun, run);
+    return scan;
+}
+
+const char* cinder::mail::getTransferEncodingName(TransferEncoding encoding){
+    switch(encoding){
+        case ENCODING_7BIT: return "7bit";
+        case ENCODING_8BIT: return "8bit";
+        case ENCODING_QUOTED_PRINTABLE: return "quoted-printable";
+        case ENCODING_BASE64: return "base64";
+    }
+    return "7bit";
+}
+
+TransferEncoding cinder::mail::selectTransferEncoding(size_t size, const TextScan& scan, bool eightBit){
+    //smtp lines are at most 998 characters (RFC 5321), a dot that is stuffed makes it one more
+    if(!scan.mBinary && scan.mLongestRun<998){
+        if(!scan.mEightBit) return ENCODING_7BIT;
+        if(eightBit) return ENCODING_8BIT;
+    }
+    
+    return estimateQuotedPrintableSize(size, scan)<=base64EncodedSize(size) ? ENCODING_QUOTED_PRINTABLE : ENCODING_BASE64;
+}
+
+size_t cinder::mail::estimateQuotedPrintableSize(size_t size, const TextScan& scan){
+    size_t encoded = size + scan.mUnsafe*2;
+    return encoded + encoded/QP_LINE_WIDTH*3;
+}
+
+void cinder::mail::encodeQuotedPrintable(const void* input, size_t size, std::string& output){
+    const uint8_t* p = static_cast<const uint8_t*>(input);
+    const uint8_t* end = p + size;
+    RunScanner plainRun = getRunScanner();
+    
+    output.reserve(output.size() + size + size/8 + 16);
+    
+    //a line is built on the stack and appended once it ends, with room for the soft break
+    char line[QP_LINE_WIDTH + 4];
+    char* out = line;
+    while(p<end){
+        uint8_t c = *p;
+        size_t column = out - line;
+        
+        if(c=='\r' || c=='\n'){
+            *out++ = '\r';
+            *out++ = '\n';
+            output.append(line, out - line);
+            out = line;
+            p += (c=='\r' && p+1<end && p[1]=='\n') ? 2 : 1;
+            continue;
+        }
+        
+        //plain characters are copied up to the end of the line at once
+        bool plain = !isUnsafe(c);
+        if(plain && column<QP_LINE_WIDTH && !(column==0 && c=='.')){
+            size_t run = plainRun(p, std::min<size_t>(end - p, QP_LINE_WIDTH - column));
+            
+            //whitespace before a line break would be stripped in transit, so it is escaped
+            if(run && (p+run==end || p[run]=='\r' || p[run]=='\n') && (p[run-1]==' ' || p[run-1]=='\t')){
+                --run;
+            }
+            if(run){
+                memcpy(out, p, run);
+                out += run;
+                p += run;
+                continue;
+            }
+        }
+        
+        //a single character that is escaped, or plain but on the next line
+        bool last = p+1==end || p[1]=='\r' || p[1]=='\n';
+        plain = plain && !((c==' ' || c=='\t') && last);
+        if(column + (plain ? 1 : 3)>QP_LINE_WIDTH){
+            *out++ = '=';
+            *out++ = '\r';
+            *out++ = '\n';
+            output.append(line, out - line);
+            out = line;
+        }
+        
+        if(plain && !(out==line && c=='.')){
+            *out++ = c;
+            ++p;
+            continue;
+        }
+        
+        //the bytes of a utf-8 character come together, the ones that fit on the line are escaped right away
+        out = writeEscaped(c, out);
+        while(++p<end && isUnsafe(*p) && static_cast<size_t>(out - line) + 3<=QP_LINE_WIDTH){
+            out = writeEscaped(*p, out);
+        }
+    }
+    output.append(line, out - line);
+}
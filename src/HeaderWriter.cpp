@@ -0,0 +1,259 @@
+//
+//  HeaderWriter.cpp
+//  MailBlock
+//
+//  Created by Sylvain Vriens on 25/04/2013.
+//
+//
+
+#include "HeaderWriter.h"
+
+#include <cstdint>
+
+using namespace cinder::mail;
+
+namespace {
+    
+    //the longest encoded word, with the charset and the markers around it (RFC 2047)
+    const size_t ENCODED_WORD_MAX = 75;
+    const size_t ENCODED_PREFIX_SIZE = 10;
+    const size_t ENCODED_OVERHEAD = ENCODED_PREFIX_SIZE + 2;
+    //a shorter word is not worth it, the line is folded instead
+    const size_t ENCODED_MIN_ROOM = ENCODED_OVERHEAD + 12;
+    
+    const char HEX_TABLE[] = "0123456789ABCDEF";
+    const char BASE64_TABLE[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    
+    inline bool isAlnum(unsigned char c){
+        return (c>='a' && c<='z') || (c>='A' && c<='Z') || (c>='0' && c<='9');
+    }
+    
+    inline bool isSpace(unsigned char c){
+        return c==' ' || c=='\t' || c=='\r' || c=='\n';
+    }
+    
+    //written as they are in a Q encoded word, the set that is allowed in a phrase as well
+    inline bool isQSafe(unsigned char c){
+        return isAlnum(c) || c=='!' || c=='*' || c=='+' || c=='-' || c=='/';
+    }
+    
+    //atext of RFC 5322, a phrase of only these and spaces needs no quotes
+    inline bool isAtom(unsigned char c){
+        if(isAlnum(c)) return true;
+        switch(c){
+            case '!': case '#': case '$': case '%': case '&': case '\'': case '*': case '+': case '-':
+            case '/': case '=': case '?': case '^': case '_': case '`': case '{': case '|': case '}': case '~':
+                return true;
+        }
+        return false;
+    }
+    
+    //bytes of the utf-8 character that starts with the byte, a broken one counts as a single byte
+    inline size_t getCharacterSize(unsigned char c){
+        if(c<0xC0) return 1;
+        if(c<0xE0) return 2;
+        if(c<0xF0) return 3;
+        if(c<0xF8) return 4;
+        return 1;
+    }
+    
+    //line breaks and tabs are spaces once they are encoded, so they can not break the header
+    inline unsigned char getEncodedByte(unsigned char c){
+        return isSpace(c) ? ' ' : c;
+    }
+    
+    //anything outside printable ascii except whitespace, or text that would be read as an encoded word
+    bool needsEncoding(const char* data, size_t size){
+        for(size_t i=0; i<size; ++i){
+            unsigned char c = data[i];
+            if((c<0x20 && !isSpace(c)) || c>=0x7F) return true;
+            if(c=='=' && i+1<size && data[i+1]=='?') return true;
+        }
+        return false;
+    }
+    
+    bool hasLineBreak(const char* data, size_t size){
+        for(size_t i=0; i<size; ++i){
+            if(data[i]=='\r' || data[i]=='\n') return true;
+        }
+        return false;
+    }
+    
+    //calls the handler for every run of non-whitespace
+    template<typename Handler>
+    void splitWords(const char* data, size_t size, Handler handler){
+        const char* end = data + size;
+        const char* p = data;
+        while(p<end){
+            while(p<end && isSpace(*p)) ++p;
+            const char* word = p;
+            while(p<end && !isSpace(*p)) ++p;
+            if(p>word) handler(word, p - word);
+        }
+    }
+    
+}
+
+void HeaderWriter::separate(size_t size){
+    if(!mSpace) return;
+    
+    if(mFoldable && mData.size() - mLineStart + 1 + size>MAIL_SMTP_HEADER_LINE_WIDTH){
+        *this << MAIL_SMTP_NEWLINE;
+        mLineStart = mData.size();
+    }
+    *this << ' ';
+}
+
+HeaderWriter& HeaderWriter::writeWord(const char* data, size_t size){
+    separate(size);
+    append(data, size);
+    mSpace = true;
+    mFoldable = true;
+    return *this;
+}
+
+HeaderWriter& HeaderWriter::writeText(const std::string& text){
+    //nothing to separate, the header ends right after the colon
+    if(text.empty()) return *this;
+    
+    if(needsEncoding(text.data(), text.size())){
+        writeEncoded(text.data(), text.size(), true);
+        return *this;
+    }
+    
+    //kept as it is when it fits, otherwise it is folded between the words
+    size_t column = mData.size() - mLineStart + (mSpace ? 1 : 0);
+    if(column + text.size()<=MAIL_SMTP_HEADER_LINE_WIDTH && !hasLineBreak(text.data(), text.size())){
+        return writeWord(text);
+    }
+    
+    splitWords(text.data(), text.size(), [this](const char* word, size_t size){
+        writeWord(word, size);
+    });
+    return *this;
+}
+
+HeaderWriter& HeaderWriter::writePhrase(const std::string& phrase){
+    if(needsEncoding(phrase.data(), phrase.size())){
+        writeEncoded(phrase.data(), phrase.size(), false);
+        return *this;
+    }
+    
+    size_t quoted = 2;
+    bool atoms = true;
+    for(auto c: phrase){
+        if(c!=' ' && !isAtom(c)) atoms = false;
+        quoted += (c=='"' || c=='\\') ? 2 : 1;
+    }
+    
+    if(atoms){
+        splitWords(phrase.data(), phrase.size(), [this](const char* word, size_t size){
+            writeWord(word, size);
+        });
+        return *this;
+    }
+    
+    //a quoted string is a single word, whitespace inside it becomes a plain space
+    separate(quoted);
+    *this << '"';
+    for(auto c: phrase){
+        if(c=='"' || c=='\\') *this << '\\';
+        *this << static_cast<char>(getEncodedByte(c));
+    }
+    *this << '"';
+    mSpace = true;
+    mFoldable = true;
+    return *this;
+}
+
+HeaderWriter& HeaderWriter::writeAddress(const std::string& name, const std::string& address, bool separator){
+    if(!name.empty()){
+        writePhrase(name);
+    }
+    
+    separate(address.size() + (separator ? 3 : 2));
+    *this << '<' << address << '>';
+    if(separator) *this << ',';
+    mSpace = true;
+    mFoldable = true;
+    return *this;
+}
+
+void HeaderWriter::writeEncoded(const char* data, size_t size, bool fill){
+    const unsigned char* input = reinterpret_cast<const unsigned char*>(data);
+    const unsigned char* end = input + size;
+    
+    //the shorter encoding for the whole text, so every word uses the same one
+    size_t qSize = 0;
+    for(const unsigned char* p=input; p<end; ++p){
+        qSize += (isQSafe(*p) || isSpace(*p)) ? 1 : 3;
+    }
+    bool q = qSize<=(size + 2)/3*4;
+    
+    const unsigned char* p = input;
+    while(p<end){
+        //a word fills the rest of the line when there is room for a few characters, otherwise it goes on the next one
+        //a phrase is only split when it has to, some readers keep the space between the words of a name
+        size_t column = mData.size() - mLineStart + (mSpace ? 1 : 0);
+        size_t limit = ENCODED_WORD_MAX;
+        if((fill || !mFoldable) && column + ENCODED_MIN_ROOM<=MAIL_SMTP_HEADER_LINE_WIDTH){
+            limit = std::min(limit, MAIL_SMTP_HEADER_LINE_WIDTH - column);
+        }
+        
+        //as many whole characters as fit in a single word
+        const unsigned char* wordEnd = p;
+        size_t payload = 0;
+        while(wordEnd<end){
+            size_t length = std::min<size_t>(getCharacterSize(*wordEnd), end - wordEnd);
+            size_t encoded = 0;
+            if(q){
+                for(size_t i=0; i<length; ++i){
+                    encoded += (isQSafe(wordEnd[i]) || isSpace(wordEnd[i])) ? 1 : 3;
+                }
+                encoded += payload;
+            }else{
+                encoded = (wordEnd - p + length + 2)/3*4;
+            }
+            if(encoded + ENCODED_OVERHEAD>limit) break;
+            
+            payload = encoded;
+            wordEnd += length;
+        }
+        
+        //built on the stack and appended at once
+        char word[ENCODED_WORD_MAX];
+        char* out = word;
+        memcpy(out, q ? "=?UTF-8?Q?" : "=?UTF-8?B?", ENCODED_PREFIX_SIZE);
+        out += ENCODED_PREFIX_SIZE;
+        
+        if(q){
+            for(const unsigned char* c=p; c<wordEnd; ++c){
+                if(isSpace(*c)){
+                    *out++ = '_';
+                }else if(isQSafe(*c)){
+                    *out++ = *c;
+                }else{
+                    *out++ = '=';
+                    *out++ = HEX_TABLE[*c>>4];
+                    *out++ = HEX_TABLE[*c&15];
+                }
+            }
+        }else{
+            for(const unsigned char* c=p; c<wordEnd; c+=3){
+                size_t left = wordEnd - c;
+                uint32_t value = getEncodedByte(c[0])<<16;
+                if(left>1) value |= getEncodedByte(c[1])<<8;
+                if(left>2) value |= getEncodedByte(c[2]);
+                *out++ = BASE64_TABLE[(value>>18)&63];
+                *out++ = BASE64_TABLE[(value>>12)&63];
+                *out++ = left>1 ? BASE64_TABLE[(value>>6)&63] : '=';
+                *out++ = left>2 ? BASE64_TABLE[value&63] : '=';
+            }
+        }
+        *out++ = '?';
+        *out++ = '=';
+        
+        writeWord(word, out - word);
+        p = wordEnd;
+    }
+}
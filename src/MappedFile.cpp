@@ -0,0 +1,139 @@
+//
+//  MappedFile.cpp
+//  MailBlock
+//
+//  Created by Sylvain Vriens on 25/04/2013.
+//
+//
+
+#include "MappedFile.h"
+
+#include <map>
+#include <mutex>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace cinder::mail;
+
+namespace {
+    
+    //the files that are mapped at the moment
+    std::mutex& getFilesMutex(){
+        static std::mutex mutex;
+        return mutex;
+    }
+    
+    std::map<ci::fs::path, std::weak_ptr<MappedFile> >& getFiles(){
+        static std::map<ci::fs::path, std::weak_ptr<MappedFile> > files;
+        return files;
+    }
+    
+}
+
+MappedFileRef MappedFile::open(const ci::fs::path& path){
+    std::lock_guard<std::mutex> lock(getFilesMutex());
+    std::map<ci::fs::path, std::weak_ptr<MappedFile> >& files = getFiles();
+    
+    MappedFileRef file = files[path].lock();
+    if(file) return file;
+    
+    file = MappedFileRef(new MappedFile());
+    if(!file->map(path)){
+        files.erase(path);
+        return MappedFileRef();
+    }
+    
+    //forget the ones that were unmapped in the mean time
+    for(std::map<ci::fs::path, std::weak_ptr<MappedFile> >::iterator itr = files.begin(); itr!=files.end();){
+        if(itr->second.expired()){
+            files.erase(itr++);
+        }else{
+            ++itr;
+        }
+    }
+    
+    files[path] = file;
+    return file;
+}
+
+#if defined(_WIN32)
+
+bool MappedFile::map(const ci::fs::path& path){
+    HANDLE handle = CreateFileW(path.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if(handle==INVALID_HANDLE_VALUE) return false;
+    
+    LARGE_INTEGER size;
+    if(!GetFileSizeEx(handle, &size)){
+        CloseHandle(handle);
+        return false;
+    }
+    mSize = static_cast<size_t>(size.QuadPart);
+    
+    //an empty file can not be mapped, but is valid
+    if(mSize==0){
+        CloseHandle(handle);
+        return true;
+    }
+    
+    HANDLE mapping = CreateFileMapping(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(handle);
+    if(!mapping) return false;
+    
+    //the view keeps the mapping alive
+    mData = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    CloseHandle(mapping);
+    
+    return mData!=NULL;
+}
+
+MappedFile::~MappedFile(){
+    if(mData){
+        UnmapViewOfFile(mData);
+    }
+}
+
+#else
+
+bool MappedFile::map(const ci::fs::path& path){
+    int fd = ::open(path.string().c_str(), O_RDONLY);
+    if(fd<0) return false;
+    
+    struct stat info;
+    if(fstat(fd, &info)!=0){
+        ::close(fd);
+        return false;
+    }
+    mSize = static_cast<size_t>(info.st_size);
+    
+    //an empty file can not be mapped, but is valid
+    if(mSize==0){
+        ::close(fd);
+        return true;
+    }
+    
+    void* data = mmap(NULL, mSize, PROT_READ, MAP_SHARED, fd, 0);
+    //the mapping stays valid without the descriptor
+    ::close(fd);
+    if(data==MAP_FAILED) return false;
+    
+    //the encoder reads front to back, so read ahead and drop pages behind
+    madvise(data, mSize, MADV_SEQUENTIAL);
+    
+    mData = static_cast<const char*>(data);
+    return true;
+}
+
+MappedFile::~MappedFile(){
+    if(mData){
+        munmap(const_cast<char*>(mData), mSize);
+    }
+}
+
+#endif
@@ -7,6 +7,11 @@
 //
 
 #include "Message.h"
+#include "Encoding.h"
+#include "AttachmentCache.h"
+
+#include <cstring>
+#include <unordered_map>
 
 using namespace cinder::mail;
 
@@ -14,80 +19,188 @@ using namespace cinder::mail;
 // getData implementations //
 //****************************//
 Message::Headers Message::getHeaders(){
+    if(!mEnvelope.empty()) return mEnvelope;
+    
     Message::Headers headers;
+    headers.reserve(1 + mTo.size() + mCC.size() + mBCC.size());
     
     //check complete here first
     
-    headers.push_back("MAIL FROM:" + mFrom.getFullAddress(false));
+    headers.push_back(HeaderWriter::createCommand("MAIL FROM:", mFrom.getAddress()));
     for(auto & address: mTo){
-        headers.push_back("RCPT TO:" + address.getFullAddress(false));
+        headers.push_back(HeaderWriter::createCommand("RCPT TO:", address.getAddress()));
     }
     for(auto & address: mCC){
-        headers.push_back("RCPT TO:" + address.getFullAddress(false));
+        headers.push_back(HeaderWriter::createCommand("RCPT TO:", address.getAddress()));
     }
     for(auto & address: mBCC){
-        headers.push_back("RCPT TO:" + address.getFullAddress(false));
+        headers.push_back(HeaderWriter::createCommand("RCPT TO:", address.getAddress()));
     }
     
     return headers;
 }
 
-std::string Message::getData() const {
-    std::stringstream data;
+void Message::writeEnvelope(HeaderWriter& output) const {
+    if(!mEnvelope.empty()){
+        for(auto& command: mEnvelope){
+            output << command << MAIL_SMTP_NEWLINE;
+        }
+        return;
+    }
+    
+    output.writeCommand("MAIL FROM:", mFrom.getAddress());
+    for(auto & address: mTo){
+        output.writeCommand("RCPT TO:", address.getAddress());
+    }
+    for(auto & address: mCC){
+        output.writeCommand("RCPT TO:", address.getAddress());
+    }
+    for(auto & address: mBCC){
+        output.writeCommand("RCPT TO:", address.getAddress());
+    }
+}
+
+std::string Message::getSender() const {
+    if(!mEnvelope.empty()){
+        const std::string& command = mEnvelope.front();
+        if(command.compare(0, 11, "MAIL FROM:<")==0 && command.size()>11){
+            return command.substr(11, command.size() - 12);
+        }
+        return "";
+    }
+    return mFrom.getAddress();
+}
+
+std::vector<std::string> Message::getRecipients() const {
+    std::vector<std::string> recipients;
+    
+    if(!mEnvelope.empty()){
+        for(auto& command: mEnvelope){
+            if(command.compare(0, 9, "RCPT TO:<")==0 && command.size()>9){
+                recipients.push_back(command.substr(9, command.size() - 10));
+            }
+        }
+        return recipients;
+    }
+    
+    recipients.reserve(mTo.size() + mCC.size() + mBCC.size());
+    
+    for(auto & address: mTo){
+        recipients.push_back(address.getAddress());
+    }
+    for(auto & address: mCC){
+        recipients.push_back(address.getAddress());
+    }
+    for(auto & address: mBCC){
+        recipients.push_back(address.getAddress());
+    }
+    
+    return recipients;
+}
+
+std::string Message::getData(bool eightBit) const {
+    return getSegments(eightBit).str();
+}
+
+Message::Segments Message::getSegments(bool eightBit) const {
+    Segments data;
     
     
     //check complete here first
     
-    //sender
-    data << "From: " << mFrom.getFullAddress() << MAIL_SMTP_NEWLINE;
-    data << "Reply-to: ";
-    if(mReplyTo.isValid()){
-        data << mReplyTo.getAddress() << MAIL_SMTP_NEWLINE;
+    if(!mEnvelope.empty()){
+        return mBody;
+    }
+    
+    //a rendered body is formatted already, the headers have to match it
+    //when it is 8bit and the server does not take that, the fallback or the content is encoded instead
+    if(mBodyEightBit && !eightBit && mRenderFallback){
+        std::call_once(mFallbackRendered, [this](){
+            mFallback = mRenderFallback();
+        });
+        return mFallback->getSegments(false);
+    }
+    if(mBody.empty() || (mBodyEightBit && !eightBit)){
+        writeHeaders(data, true, eightBit);
+        writeBody(data, eightBit);
     }else{
-        data << mFrom.getAddress() << MAIL_SMTP_NEWLINE;
+        writeHeaders(data, true, true);
+        data << mBody;
     }
     
-    //the TO
-    std::vector<Address>::const_iterator itr;
-    for(itr = mTo.begin(); itr<mTo.end(); ++itr){
-        if(itr==mTo.begin()){
-            data << "To: ";
-        }
-        data << (*itr).getFullAddress();
-        
-        if((itr+1)<mTo.end()){
-            data << "," << MAIL_SMTP_NEWLINE << " "; //we add a space because we need to (duh!)
-        }else{
-            data << MAIL_SMTP_NEWLINE;
-        }
+    return data;
+}
+
+bool Message::isEightBit() const {
+    if(!mEnvelope.empty()) return false;
+    if(!mBody.empty()) return mBodyEightBit;
+    return mContent->isEightBit();
+}
+
+
+void Message::writeHeaders(Segments& data, bool date, bool eightBit) const {
+    //sized for everything up front, so the headers are a single allocation that the segment takes over
+    //names and the subject can grow to three times their size when they are encoded
+    size_t size = 256 + mSubject.size()*3 + mFrom.getName().size()*3 + mFrom.getAddress().size() + mReplyTo.getAddress().size();
+    for(auto& address: mTo){
+        size += address.getName().size()*3 + address.getAddress().size() + 16;
+    }
+    for(auto& address: mCC){
+        size += address.getName().size()*3 + address.getAddress().size() + 16;
     }
     
-    //the CC
-    for(itr = mCC.begin(); itr<mCC.end(); ++itr){//reusing the itr form the to
-        if(itr==mCC.begin()){
-            data << "cc: ";
+    HeaderWriter output(size);
+    writeHeaders(output, date, eightBit);
+    data.push_back(Segment(std::string()));
+    output.swap(data.back().mData);
+}
+
+void Message::writeHeaders(HeaderWriter& output, bool date, bool eightBit) const {
+    //sender
+    output.beginHeader("From");
+    mFrom.write(output);
+    output.endHeader();
+    
+    output.beginHeader("Reply-to").writeWord(mReplyTo.isValid() ? mReplyTo.getAddress() : mFrom.getAddress()).endHeader();
+    
+    //the TO and CC, folded between the addresses when the line gets too long
+    if(!mTo.empty()){
+        output.beginHeader("To");
+        for(size_t i=0; i<mTo.size(); ++i){
+            mTo[i].write(output, true, i + 1<mTo.size());
         }
-        data << (*itr).getFullAddress();
-        
-        if((itr+1)<mCC.end()){
-            data << "," << MAIL_SMTP_NEWLINE << " "; //we add a space because we need to (duh!)
-        }else{
-            data << MAIL_SMTP_NEWLINE;
+        output.endHeader();
+    }
+    
+    if(!mCC.empty()){
+        output.beginHeader("cc");
+        for(size_t i=0; i<mCC.size(); ++i){
+            mCC[i].write(output, true, i + 1<mCC.size());
         }
+        output.endHeader();
     }
     
-    //add a multipart header in case we have a multipart message
+    //add a multipart header in case we have a multipart message, otherwise the type and encoding of the text
+    output << "MIME-Version: 1.0" << MAIL_SMTP_NEWLINE;
     if(isMultiPart()){
-        data << "MIME-Version: 1.0" << MAIL_SMTP_NEWLINE << "Content-Type: multipart/mixed;" << MAIL_SMTP_NEWLINE << "\tboundary=\"" << MAIL_MSG_BOUNDARY << "\"" << MAIL_SMTP_NEWLINE;
+        output << "Content-Type: multipart/mixed;" << MAIL_SMTP_NEWLINE << "\tboundary=\"" << MAIL_MSG_BOUNDARY << "\"" << MAIL_SMTP_NEWLINE;
+    }else{
+        mContent->writeHeaders(output, eightBit);
     }
     
     //add the current local data
-    data << "Date: " << formatDate() << MAIL_SMTP_NEWLINE;
-    
-    //add the subject line
-    data << "Subject: " << mSubject << MAIL_SMTP_NEWLINE << MAIL_SMTP_NEWLINE;
-    
+    if(date){
+        output << "Date: ";
+        writeDate(output);
+        output << MAIL_SMTP_NEWLINE;
+    }
     
+    //add the subject line, encoded when it is not plain ascii
+    output.beginHeader("Subject").writeText(mSubject).endHeader();
+    output << MAIL_SMTP_NEWLINE;
+}
+
+void Message::writeBody(Segments& data, bool eightBit) const {
     if(isMultiPart()){
         data << "This is a MIME encapsulated message" << MAIL_SMTP_NEWLINE;
         data << "--" << MAIL_MSG_BOUNDARY << MAIL_SMTP_NEWLINE;
@@ -98,31 +211,93 @@ std::string Message::getData() const {
         for(auto& header: headers){
             data << header << MAIL_SMTP_NEWLINE;
         }
-        data << mContent->getData() << MAIL_SMTP_NEWLINE;
+        data << mContent->getSegments(eightBit) << MAIL_SMTP_NEWLINE;
         
         //the attachemnets
         for(auto& attachment: mAttachments){
             data << MAIL_SMTP_NEWLINE << "--" << MAIL_MSG_BOUNDARY << MAIL_SMTP_NEWLINE;
             
-            Headers headers = attachment->getHeaders();
+            const Headers& headers = attachment->getHeaders();
             for(auto& header: headers){
                 data << header << MAIL_SMTP_NEWLINE;
             }
             
-            data << MAIL_SMTP_NEWLINE << attachment->getData() << MAIL_SMTP_NEWLINE;
+            data << MAIL_SMTP_NEWLINE << attachment << MAIL_SMTP_NEWLINE;
         }
         
         data << MAIL_SMTP_NEWLINE << "--" << MAIL_MSG_BOUNDARY << "--" << MAIL_SMTP_NEWLINE;
         
     }else{
         //it has not alternative parts or attachents, so just the data
-        data << mContent->getData();
+        data << mContent->getSegments(eightBit);
     }
     
     //terminate the message
     data << MAIL_SMTP_NEWLINE << "." << MAIL_SMTP_NEWLINE;
+}
+
+void Message::writeContent(Segments& data) const {
+    writeHeaders(data, false);
+    if(mBody.empty()){
+        writeBody(data);
+    }else{
+        data << mBody;
+    }
+}
+
+uint64_t Message::getContentHash() const {
+    Segments data;
+    writeContent(data);
+    
+    uint64_t hash = 0;
+    for(auto& segment: data){
+        if(segment.mAttachment){
+            uint64_t content = segment.mAttachment->getContentHash();
+            hash = AttachmentCache::hash(&content, sizeof(content), hash);
+        }else{
+            hash = AttachmentCache::hash(segment.getData().data(), segment.getData().size(), hash);
+        }
+    }
+    return hash;
+}
+
+bool Message::hasSameContent(const Message& other) const {
+    if(this==&other) return true;
     
-    return data.str();
+    Segments data, otherData;
+    writeContent(data);
+    other.writeContent(otherData);
+    if(data.size()!=otherData.size()) return false;
+    
+    for(size_t i=0; i<data.size(); ++i){
+        const Segment& segment = data[i];
+        const Segment& otherSegment = otherData[i];
+        
+        if(segment.mAttachment || otherSegment.mAttachment){
+            if(!segment.mAttachment || !otherSegment.mAttachment) return false;
+            if(segment.mAttachment==otherSegment.mAttachment) continue;
+            if(segment.mAttachment->getDataSource()->getFilePath()!=otherSegment.mAttachment->getDataSource()->getFilePath()) return false;
+            if(segment.mAttachment->getSource()!=otherSegment.mAttachment->getSource()) return false;
+            continue;
+        }
+        
+        //the text of a template is shared, so it only has to be compared when it is not the same
+        if(segment.mShared && segment.mShared==otherSegment.mShared) continue;
+        if(segment.getData()!=otherSegment.getData()) return false;
+    }
+    return true;
+}
+
+std::string Message::Segments::str() const {
+    std::string data;
+    for(auto& segment: *this){
+        if(segment.mAttachment){
+            data += segment.mAttachment->getData();
+        }else{
+            data += segment.getData();
+        }
+    }
+    return data;
 }
 
 Message::Headers Message::Content::getHeaders() const {
@@ -136,84 +311,136 @@ Message::Headers Message::Content::getHeaders() const {
     return headers;
 }
 
-std::string Message::Content::getData() const{
+std::string Message::Content::getData(bool eightBit) const{
+    return getSegments(eightBit).str();
+}
+
+void Message::Content::writeHeaders(HeaderWriter& output, bool eightBit) const{
+    if(isMultiPart() || !mText) return;
+    
+    output << "Content-type: text/plain; charset=utf-8" << MAIL_SMTP_NEWLINE;
+    output << "Content-transfer-encoding: " << getTransferEncodingName(mText->getTransferEncoding(eightBit)) << MAIL_SMTP_NEWLINE;
+}
+
+Message::Segments Message::Content::getSegments(bool eightBit) const{
+    Segments data;
     
     if(!isMultiPart()){
-        return mText->getData();
+        return data << mText->getData(eightBit);
     }
     
-    std::stringstream data;
     
     data << MAIL_SMTP_NEWLINE << "--" << MAIL_CONTENT_BOUNDARY << MAIL_SMTP_NEWLINE;
     
-    Headers headers = mText->getHeaders();
+    Headers headers = mText->getHeaders(eightBit);
     for(auto& header: headers){
         data << header << MAIL_SMTP_NEWLINE;
     }
-    data << MAIL_SMTP_NEWLINE <<mText->getData() << MAIL_SMTP_NEWLINE;
+    data << MAIL_SMTP_NEWLINE <<mText->getData(eightBit) << MAIL_SMTP_NEWLINE;
     
     data << MAIL_SMTP_NEWLINE<< "--" << MAIL_CONTENT_BOUNDARY << MAIL_SMTP_NEWLINE;
     
-    headers = mHTML->getHeaders();
+    headers = mHTML->getHeaders(eightBit);
     for(auto& header: headers){
         data << header << MAIL_SMTP_NEWLINE;
     }
-    data << MAIL_SMTP_NEWLINE <<mHTML->getData() << MAIL_SMTP_NEWLINE;
+    data << MAIL_SMTP_NEWLINE <<mHTML->getSegments(eightBit) << MAIL_SMTP_NEWLINE;
     
     data << MAIL_SMTP_NEWLINE << "--" << MAIL_CONTENT_BOUNDARY << "--" << MAIL_SMTP_NEWLINE;
     
-    return data.str();
+    return data;
+}
+
+Message::ContentRef Message::Content::render(const std::function<std::string(const std::string&)>& text) const {
+    ContentRef content = create();
+    if(mText){
+        content->mText = Text::create(text(mText->getContent()));
+    }
+    if(mHTML){
+        content->mHTML = HTML::create(text(mHTML->getContent()));
+        for(auto& attachment: mHTML->getAttachments()){
+            content->mHTML->addAttachment(attachment);
+        }
+    }
+    return content;
 }
 
 
-Message::Headers Message::Text::getHeaders() const {
+Message::Headers Message::Text::getHeaders(bool eightBit) const {
     Message::Headers headers;
     
-    headers.push_back("Content-type: text/plain; charset=ISO-8859-1");
-    headers.push_back("Content-transfer-encoding: 7BIT");
+    headers.push_back("Content-type: text/plain; charset=utf-8");
+    headers.push_back(std::string("Content-transfer-encoding: ") + getTransferEncodingName(getTransferEncoding(eightBit)));
     
     return headers;
 }
 
-std::string Message::Text::getData() const{
-    return formatRFC(mContent);
+std::string Message::Text::getData(bool eightBit) const{
+    std::string output;
+    encode(mContent.data(), mContent.size(), getTransferEncoding(eightBit), output);
+    return output;
+}
+
+void Message::Text::encode(const char* data, size_t size, TransferEncoding encoding, std::string& output){
+    switch(encoding){
+        case ENCODING_QUOTED_PRINTABLE:
+            encodeQuotedPrintable(data, size, output);
+            break;
+        case ENCODING_BASE64:
+            encodeBase64(data, size, output);
+            break;
+        default:
+            formatText(data, size, output);
+            break;
+    }
 }
 
 std::string Message::Text::formatRFC(const std::string &data) const{
+    std::string output;
+    formatText(data.data(), data.size(), output);
+    return output;
+}
+
+//appends a single output line, dot-stuffed so it never ends the data
+static inline void appendLine(const char* begin, const char* end, std::string& output){
+    if(begin<end && *begin=='.'){
+        output += '.'; //will show up as a single point
+    }
+    output.append(begin, end);
+}
+
+void cinder::mail::formatText(const char* data, size_t size, std::string& output){
+    const char* end = data + size;
     
-    //replace any wrong line-endings
-    std::string replace = std::regex_replace(data, std::regex("\n\r|\r[^\n]|[^\r]\n"), MAIL_SMTP_NEWLINE);
-    
-    std::vector<std::string> lines = ci::split(data, MAIL_SMTP_NEWLINE);
+    //room for the line breaks of wrapping and line-endings that become 2 characters
+    output.reserve(output.size() + size + size/32 + 16);
     
-    std::stringstream ss;
-    for(std::vector<std::string>::iterator itr=lines.begin(); itr<lines.end(); ++itr){
-        //if not the first push the line charactre first
-        if(itr!=lines.begin()) ss << MAIL_SMTP_NEWLINE;
-        
-        std::string line = *itr;
+    const char* line = data;
+    while(true){
+        //find the end of the line, any of \r\n, \r or \n
+        const char* lineEnd = line;
+        while(lineEnd<end && *lineEnd!='\r' && *lineEnd!='\n') ++lineEnd;
         
-        //if only a point, add it with a space
-        if(line=="."){
-            ss<<".."; //will show up as a single point
-            continue;
-        }
-        
-        size_t found;
-        while(line.size()>100 && (found=line.rfind(" ",100))!=std::string::npos){
-            ss << line.substr(0,found) << MAIL_SMTP_NEWLINE;
-            line = line.substr(found+1);
+        //wrap at the last space within the line width, a long word is left as it is
+        while(lineEnd - line > MAIL_SMTP_TEXT_LINE_WIDTH){
+            const char* space = line + MAIL_SMTP_TEXT_LINE_WIDTH;
+            while(space>=line && *space!=' ') --space;
+            if(space<line) break;
+            
+            appendLine(line, space, output);
+            output += MAIL_SMTP_NEWLINE;
+            line = space + 1;
         }
-        ss << line;
+        appendLine(line, lineEnd, output);
         
+        if(lineEnd==end) break;
         
+        output += MAIL_SMTP_NEWLINE;
+        line = lineEnd + ((lineEnd[0]=='\r' && lineEnd+1<end && lineEnd[1]=='\n') ? 2 : 1);
     }
-    
-    
-    return ss.str();
 }
 
-Message::Headers Message::HTML::getHeaders() const {
+Message::Headers Message::HTML::getHeaders(bool eightBit) const {
     Message::Headers headers;
     
     if(isMultiPart()){
@@ -223,17 +450,25 @@ Message::Headers Message::HTML::getHeaders() const {
         headers.push_back("--" + ci::toString(MAIL_HTML_BOUNDARY));
     }
     
-    headers.push_back("Content-type: text/html; charset=ISO-8859-1");
-    headers.push_back("Content-transfer-encoding: 7BIT");
+    headers.push_back("Content-type: text/html; charset=utf-8");
+    headers.push_back(std::string("Content-transfer-encoding: ") + getTransferEncodingName(getTransferEncoding(eightBit)));
     
     return headers;
 }
 
-std::string Message::HTML::getData() const {
-    std::stringstream data;
+std::string Message::HTML::getData(bool eightBit) const {
+    return getSegments(eightBit).str();
+}
+
+Message::Segments Message::HTML::getSegments(bool eightBit) const {
+    Segments data;
     
-    //find and replace cid and make it max 100 chars per line
-    data << formatRFC(findReplaceCID(mContent));
+    //find and replace cid, then make it max 100 chars per line or encode it
+    //the encoding is picked from the content as it was set, the cid references are plain ascii
+    std::string html = findReplaceCID(mContent);
+    std::string encoded;
+    encode(html.data(), html.size(), getTransferEncoding(eightBit), encoded);
+    data << encoded;
     
     
     if(isMultiPart()){
@@ -242,51 +477,347 @@ std::string Message::HTML::getData() const {
         for(auto& attachment: mAttachments){
             data << MAIL_SMTP_NEWLINE << "--" << MAIL_HTML_BOUNDARY << MAIL_SMTP_NEWLINE;
             
-            Headers headers = attachment->getHeaders();
+            const Headers& headers = attachment->getHeaders();
             for(auto& header: headers){
                 data << header << MAIL_SMTP_NEWLINE;
             }
             
-            data << MAIL_SMTP_NEWLINE << attachment->getData() << MAIL_SMTP_NEWLINE;
+            data << MAIL_SMTP_NEWLINE << attachment << MAIL_SMTP_NEWLINE;
         }
         
         data << MAIL_SMTP_NEWLINE << "--" << MAIL_HTML_BOUNDARY << "--" << MAIL_SMTP_NEWLINE;
     }
     
-    return data.str();
+    return data;
 }
 
 std::string Message::HTML::findReplaceCID(const std::string& data) const{
     
     if(mAttachments.empty()) return data;
     
-    std::string ret = data;
-    
+    //the cid of every file name, the first attachment wins when names are the same
+    std::unordered_map<std::string, std::string> cids;
     for(auto& attachment: mAttachments){
-        std::regex regex("cid:" + attachment->getFileName());
-        std::string replace("cid:" + attachment->getCID());
-        ret = std::regex_replace(data, regex, replace);
+        cids.insert(std::make_pair(attachment->getFileName(), attachment->getCID()));
     }
     
+    std::string ret;
+    ret.reserve(data.size() + mAttachments.size()*16);
+    
+    //a single scan over the cid: references, the name runs up to the end of the attribute or url()
+    std::string name;
+    size_t copied = 0;
+    size_t found = 0;
+    while((found = data.find("cid:", found))!=std::string::npos){
+        size_t begin = found + 4;
+        size_t end = std::min(data.find_first_of(" \t\r\n\"'<>)", begin), data.size());
+        
+        name.assign(data, begin, end - begin);
+        std::unordered_map<std::string, std::string>::const_iterator itr = cids.find(name);
+        if(itr!=cids.end()){
+            ret.append(data, copied, begin - copied);
+            ret += itr->second;
+            copied = end;
+        }
+        found = end;
+    }
+    ret.append(data, copied, std::string::npos);
     
     return ret;
 }
 
 std::string Message::HTML::getText(){
-    std::string text = mContent;
+    std::string text;
+    stripHTML(mContent.data(), mContent.size(), text);
+    return text;
+}
+
+namespace {
+    
+    //what a tag does to the text
+    enum TagAction { TAG_INLINE, TAG_BREAK, TAG_BLOCK, TAG_PARAGRAPH, TAG_CELL, TAG_PRE, TAG_SKIP };
+    
+    struct Tag {
+        const char* name;
+        TagAction   action;
+    };
+    
+    const Tag HTML_TAGS[] = {
+        {"br", TAG_BREAK},
+        {"p", TAG_PARAGRAPH}, {"h1", TAG_PARAGRAPH}, {"h2", TAG_PARAGRAPH}, {"h3", TAG_PARAGRAPH},
+        {"h4", TAG_PARAGRAPH}, {"h5", TAG_PARAGRAPH}, {"h6", TAG_PARAGRAPH}, {"blockquote", TAG_PARAGRAPH},
+        {"table", TAG_PARAGRAPH}, {"ul", TAG_PARAGRAPH}, {"ol", TAG_PARAGRAPH}, {"dl", TAG_PARAGRAPH}, {"hr", TAG_PARAGRAPH},
+        {"div", TAG_BLOCK}, {"li", TAG_BLOCK}, {"tr", TAG_BLOCK}, {"dt", TAG_BLOCK}, {"dd", TAG_BLOCK},
+        {"section", TAG_BLOCK}, {"article", TAG_BLOCK}, {"header", TAG_BLOCK}, {"footer", TAG_BLOCK},
+        {"nav", TAG_BLOCK}, {"main", TAG_BLOCK}, {"aside", TAG_BLOCK}, {"address", TAG_BLOCK},
+        {"form", TAG_BLOCK}, {"center", TAG_BLOCK}, {"caption", TAG_BLOCK}, {"figure", TAG_BLOCK},
+        {"td", TAG_CELL}, {"th", TAG_CELL},
+        {"pre", TAG_PRE},
+        {"head", TAG_SKIP}, {"title", TAG_SKIP}, {"style", TAG_SKIP}, {"script", TAG_SKIP}
+    };
+    
+    struct Entity {
+        const char* name;
+        const char* text;
+    };
+    
+    //the common ones, others are left as they are
+    const Entity HTML_ENTITIES[] = {
+        {"amp", "&"}, {"lt", "<"}, {"gt", ">"}, {"quot", "\""}, {"apos", "'"}, {"nbsp", " "},
+        {"copy", "\xC2\xA9"}, {"reg", "\xC2\xAE"}, {"trade", "\xE2\x84\xA2"}, {"euro", "\xE2\x82\xAC"},
+        {"mdash", "\xE2\x80\x94"}, {"ndash", "\xE2\x80\x93"}, {"hellip", "\xE2\x80\xA6"}, {"bull", "\xE2\x80\xA2"},
+        {"lsquo", "\xE2\x80\x98"}, {"rsquo", "\xE2\x80\x99"}, {"ldquo", "\xE2\x80\x9C"}, {"rdquo", "\xE2\x80\x9D"}
+    };
+    
+    inline bool isAlpha(char c){
+        return (c>='a' && c<='z') || (c>='A' && c<='Z');
+    }
     
-    //change p and br into new lines
-    text = std::regex_replace(text, std::regex("<p>|<p/>|<p .*?>"), "\n\n");
-    text = std::regex_replace(text, std::regex("<br>|<br/>"), "\n");
+    inline bool isAlnum(char c){
+        return isAlpha(c) || (c>='0' && c<='9');
+    }
     
-    //strip html
-    text = std::regex_replace(text, std::regex("<.*?>"), "");
+    inline bool isSpace(char c){
+        return c==' ' || c=='\t' || c=='\n' || c=='\r' || c=='\f';
+    }
+    
+    inline char toLower(char c){
+        return (c>='A' && c<='Z') ? c + ('a' - 'A') : c;
+    }
+    
+    TagAction findTag(const char* name){
+        for(const Tag& tag: HTML_TAGS){
+            if(strcmp(tag.name, name)==0) return tag.action;
+        }
+        return TAG_INLINE;
+    }
+    
+    //the start of the closing tag, or the end when it is never closed
+    const char* findClosingTag(const char* begin, const char* end, const char* name){
+        size_t length = strlen(name);
+        for(const char* p=begin; p+length+2<=end; ++p){
+            if(p[0]!='<' || p[1]!='/') continue;
+            size_t i = 0;
+            while(i<length && toLower(p[2+i])==name[i]) ++i;
+            if(i==length && (p+2+length==end || !isAlnum(p[2+length]))) return p;
+        }
+        return end;
+    }
+    
+    //appends a valid code point as utf-8
+    void appendCodePoint(uint32_t code, std::string& output){
+        if(code<0x80){
+            output += static_cast<char>(code);
+        }else if(code<0x800){
+            output += static_cast<char>(0xC0 | (code>>6));
+            output += static_cast<char>(0x80 | (code&0x3F));
+        }else if(code<0x10000){
+            output += static_cast<char>(0xE0 | (code>>12));
+            output += static_cast<char>(0x80 | ((code>>6)&0x3F));
+            output += static_cast<char>(0x80 | (code&0x3F));
+        }else{
+            output += static_cast<char>(0xF0 | (code>>18));
+            output += static_cast<char>(0x80 | ((code>>12)&0x3F));
+            output += static_cast<char>(0x80 | ((code>>6)&0x3F));
+            output += static_cast<char>(0x80 | (code&0x3F));
+        }
+    }
+    
+    //decodes the entity at begin, returns begin when it is not one
+    const char* decodeEntity(const char* begin, const char* end, std::string& output){
+        const char* p = begin + 1;
+        const char* semicolon = p;
+        while(semicolon<end && semicolon-p<10 && *semicolon!=';') ++semicolon;
+        if(semicolon==end || *semicolon!=';' || semicolon==p) return begin;
+        
+        if(*p=='#'){
+            ++p;
+            bool hex = p<semicolon && (*p=='x' || *p=='X');
+            if(hex) ++p;
+            if(p==semicolon) return begin;
+            
+            uint32_t code = 0;
+            for(; p<semicolon; ++p){
+                char c = toLower(*p);
+                uint32_t digit;
+                if(c>='0' && c<='9') digit = c - '0';
+                else if(hex && c>='a' && c<='f') digit = c - 'a' + 10;
+                else return begin;
+                code = code*(hex ? 16 : 10) + digit;
+            }
+            //nul, surrogates and values past unicode become the replacement character, like HTML5 does
+            if(code==0 || (code>=0xD800 && code<=0xDFFF) || code>0x10FFFF){
+                code = 0xFFFD;
+            }
+            //a non breaking space is just a space in text
+            appendCodePoint(code==0xA0 ? ' ' : code, output);
+            return semicolon + 1;
+        }
+        
+        size_t length = semicolon - p;
+        for(const Entity& entity: HTML_ENTITIES){
+            if(strlen(entity.name)==length && memcmp(entity.name, p, length)==0){
+                output += entity.text;
+                return semicolon + 1;
+            }
+        }
+        return begin;
+    }
     
-    return text;
 }
 
+void cinder::mail::stripHTML(const char* data, size_t size, std::string& output){
+    const char* end = data + size;
+    output.reserve(output.size() + size/2);
+    const size_t start = output.size();
+    
+    //the line breaks at the end of the output, the start counts as a paragraph so it gets none
+    int newlines = 2;
+    //whitespace seen since the last text, written as a single space before the next text
+    bool space = false;
+    int pre = 0;
+    
+    auto lineBreak = [&](int count){
+        while(newlines<count){
+            output += '\n';
+            ++newlines;
+        }
+        space = false;
+    };
+    
+    auto text = [&](){
+        if(space && !newlines){
+            output += ' ';
+        }
+        space = false;
+        newlines = 0;
+    };
+    
+    const char* p = data;
+    while(p<end){
+        char c = *p;
+        
+        if(c=='<'){
+            const char* tag = p + 1;
+            
+            //comments, doctype and processing instructions
+            if(tag<end && (*tag=='!' || *tag=='?')){
+                if(end-tag>=3 && tag[1]=='-' && tag[2]=='-'){
+                    const char* close = tag + 3;
+                    while(close+3<=end && !(close[0]=='-' && close[1]=='-' && close[2]=='>')) ++close;
+                    p = close+3<=end ? close + 3 : end;
+                }else{
+                    const char* close = static_cast<const char*>(memchr(tag, '>', end - tag));
+                    p = close ? close + 1 : end;
+                }
+                continue;
+            }
+            
+            bool closing = tag<end && *tag=='/';
+            if(closing) ++tag;
+            
+            //a lone '<' is text
+            if(tag==end || !isAlpha(*tag)){
+                text();
+                output += c;
+                ++p;
+                continue;
+            }
+            
+            char name[16];
+            size_t length = 0;
+            while(tag<end && isAlnum(*tag)){
+                if(length<sizeof(name)-1) name[length] = toLower(*tag);
+                ++length;
+                ++tag;
+            }
+            name[std::min(length, sizeof(name)-1)] = 0;
+            
+            //skip the attributes, a '>' in a quoted value does not end the tag
+            char quote = 0;
+            while(tag<end && (quote || *tag!='>')){
+                if(quote){
+                    if(*tag==quote) quote = 0;
+                }else if(*tag=='"' || *tag=='\''){
+                    quote = *tag;
+                }
+                ++tag;
+            }
+            p = tag<end ? tag + 1 : end;
+            
+            switch(length<sizeof(name) ? findTag(name) : TAG_INLINE){
+                case TAG_BREAK:
+                    //every br is a line, also when there are several
+                    output += '\n';
+                    ++newlines;
+                    space = false;
+                    break;
+                case TAG_BLOCK:
+                    lineBreak(1);
+                    break;
+                case TAG_PARAGRAPH:
+                    lineBreak(2);
+                    break;
+                case TAG_CELL:
+                    if(!closing) space = true;
+                    break;
+                case TAG_PRE:
+                    lineBreak(2);
+                    pre = closing ? std::max(pre - 1, 0) : pre + 1;
+                    break;
+                case TAG_SKIP:
+                    if(!closing) p = findClosingTag(p, end, name);
+                    break;
+                case TAG_INLINE:
+                    break;
+            }
+            continue;
+        }
+        
+        if(c=='&'){
+            text();
+            const char* next = decodeEntity(p, end, output);
+            if(next==p){
+                output += c;
+                ++p;
+            }else{
+                p = next;
+            }
+            continue;
+        }
+        
+        if(isSpace(c)){
+            if(pre){
+                if(c=='\n'){
+                    output += '\n';
+                    ++newlines;
+                }else if(c!='\r'){
+                    text();
+                    output += c;
+                }
+            }else{
+                space = true;
+            }
+            ++p;
+            continue;
+        }
+        
+        //copy the text up to the next tag, entity or whitespace at once
+        const char* run = p + 1;
+        while(run<end && *run!='<' && *run!='&' && !isSpace(*run)) ++run;
+        text();
+        output.append(p, run);
+        p = run;
+    }
+    
+    //no trailing line breaks
+    while(output.size()>start && output.back()=='\n'){
+        output.pop_back();
+    }
+}
 
-Message::Headers Message::Attachment::getHeaders() const {
+
+Message::Headers Message::Attachment::createHeaders() const {
     Message::Headers headers;
     
     ci::fs::path path = mDataSource->getFilePath();
@@ -326,15 +857,62 @@ Message::Headers Message::Attachment::getHeaders() const {
 }
 
 std::string Message::Attachment::getData() const{
-    return ci::toBase64(mDataSource->getBuffer(), MAIL_SMTP_BASE64_LINE_WIDTH);
+    std::string data;
+    
+    //encode from the mapped file when possible, so it is not copied first
+    MappedFileRef file = map();
+    if(file){
+        encodeBase64(file->getData(), file->getSize(), data);
+        return data;
+    }
+    
+    ci::Buffer buffer = mDataSource->getBuffer();
+    encodeBase64(buffer.getData(), buffer.getDataSize(), data);
+    return data;
 }
 
-std::string Message::formatDate() const{
-    std::stringstream s;
+//the content is hashed in blocks of this size, whether it is mapped or read
+static const size_t HASH_BLOCK_SIZE = 64*1024;
+
+void Message::Attachment::hashContent() const{
+    mHash = 0;
+    mCheck = AttachmentCache::CHECK_SEED;
+    mSize = 0;
+    
+    MappedFileRef file = map();
+    if(file){
+        for(size_t offset=0; offset<file->getSize(); offset+=HASH_BLOCK_SIZE){
+            size_t size = std::min(HASH_BLOCK_SIZE, file->getSize() - offset);
+            mHash = AttachmentCache::hash(file->getData() + offset, size, mHash);
+            mCheck = AttachmentCache::hash(file->getData() + offset, size, mCheck);
+        }
+        mSize = file->getSize();
+        return;
+    }
+    
+    ci::IStreamRef stream = mDataSource->createStream();
+    std::vector<char> buffer(HASH_BLOCK_SIZE);
     
+    while(!stream->isEof()){
+        //fill the buffer completely so the hash does not depend on how the stream splits reads
+        size_t size = 0;
+        while(size<buffer.size() && !stream->isEof()){
+            size_t read = stream->readDataAvailable(&buffer[size], buffer.size() - size);
+            if(read==0) break;
+            size += read;
+        }
+        if(size==0) break;
+        
+        mHash = AttachmentCache::hash(buffer.data(), size, mHash);
+        mCheck = AttachmentCache::hash(buffer.data(), size, mCheck);
+        mSize += size;
+    }
+}
+
+void Message::writeDate(HeaderWriter& output) const{
     time_t now;
     time(&now);
-    
+
 #if defined(CINDER_MSW)
     struct tm * timeStruct;
     
@@ -344,29 +922,25 @@ std::string Message::formatDate() const{
     hourOffset += timeStruct->tm_hour;
     
     char timestring[128] = "";
-    std::string timeformat = "%d %b %y %H:%M:%S";
-    if(strftime(timestring, 127, timeformat.c_str(), localtime(&now))) { // got the date
-        s << timestring;
+    if(strftime(timestring, 127, "%d %b %y %H:%M:%S", localtime(&now))) { // got the date
+        output << timestring;
         //add a space
-        s << " ";
+        output << " ";
         
         hourOffset *= 100;
         
-        char timezone[6] = "";
+        char timezone[8] = "";
         sprintf(timezone, "%+05i", hourOffset);
-        s << timezone;
+        output << timezone;
         
     }
-    
+
 #else
     //add the current local data
     
     char timestring[128] = "";
-    std::string timeformat = "%d %b %y %H:%M:%S %z";
-    if(strftime(timestring, 127, timeformat.c_str(), localtime(&now))) { // got the date
-        s << timestring;
+    if(strftime(timestring, 127, "%d %b %y %H:%M:%S %z", localtime(&now))) { // got the date
+        output << timestring;
     }
 #endif
-    
-    return s.str();
 }
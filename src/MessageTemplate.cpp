@@ -0,0 +1,222 @@
+//
+//  MessageTemplate.cpp
+//  MailBlock
+//
+//  Created by Sylvain Vriens on 25/04/2013.
+//
+//
+
+#include "MessageTemplate.h"
+
+#include <set>
+#include <algorithm>
+
+using namespace cinder::mail;
+
+namespace {
+    
+    inline bool isFieldChar(char c){
+        return (c>='a' && c<='z') || (c>='A' && c<='Z') || (c>='0' && c<='9') || c=='_' || c=='-' || c=='.';
+    }
+    
+    //smtp lines are at most 998 characters (RFC 5321)
+    const size_t MAX_LINE_LENGTH = 998;
+    
+    //appends a field value with CRLF line endings, stuffing a dot at the start of a line so it can not end the data
+    //the line is the length of the current one, false when the value is not plain ascii or a line gets too long
+    bool appendField(const std::string& value, size_t& line, std::string& output){
+        for(size_t i=0; i<value.size(); ++i){
+            char c = value[i];
+            if(c==0 || static_cast<unsigned char>(c)>=0x80) return false;
+            if(c=='\r' && i+1<value.size() && value[i+1]=='\n') continue;
+            
+            if(c=='\r' || c=='\n'){
+                if(line>MAX_LINE_LENGTH) return false;
+                output += MAIL_SMTP_NEWLINE;
+                line = 0;
+                continue;
+            }
+            
+            if(c=='.' && !line){
+                output += '.';
+                ++line;
+            }
+            output += c;
+            ++line;
+        }
+        return true;
+    }
+    
+}
+
+template<typename TextHandler, typename FieldHandler>
+void MessageTemplate::parse(const std::string& data, TextHandler text, FieldHandler field){
+    size_t copied = 0;
+    size_t found = 0;
+    while((found = data.find("{{", found))!=std::string::npos){
+        size_t begin = found + 2;
+        size_t end = begin;
+        while(end<data.size() && isFieldChar(data[end])) ++end;
+        
+        //not a field, the braces are text
+        if(end==begin || data.compare(end, 2, "}}")!=0){
+            found = begin;
+            continue;
+        }
+        
+        if(found>copied) text(copied, found - copied);
+        field(begin, end - begin);
+        copied = found = end + 2;
+    }
+    if(copied<data.size()) text(copied, data.size() - copied);
+}
+
+std::string MessageTemplate::substitute(const std::string& data, const Fields& fields){
+    std::string output;
+    output.reserve(data.size());
+    parse(data, [&](size_t offset, size_t size){
+        output.append(data, offset, size);
+    }, [&](size_t offset, size_t size){
+        Fields::const_iterator itr = fields.find(data.substr(offset, size));
+        if(itr!=fields.end()) output += itr->second;
+    });
+    return output;
+}
+
+MessageTemplate::MessageTemplate(const MessageRef& message) : mMessage(message), mFormatted(message->mContent->isFormatted()){
+    //the body as it is sent, with the fields still in place
+    //written as 8bit, in encoded text a field could be split over lines and the values would need encoding too
+    //when a part is encoded anyway the body is only compiled for the names of the fields
+    Message::Segments body;
+    message->writeBody(body, true);
+    
+    for(auto& segment: body){
+        if(segment.mAttachment){
+            Part part;
+            part.mAttachment = segment.mAttachment;
+            mParts.push_back(part);
+            continue;
+        }
+        
+        const std::string& data = segment.getData();
+        parse(data, [&](size_t offset, size_t size){
+            Part part;
+            part.mText = std::make_shared<const std::string>(data, offset, size);
+            
+            //the text is formatted, so its lines end in CRLF
+            const char* begin = data.data() + offset;
+            const char* end = begin + size;
+            const char* first = std::find(begin, end, '\n');
+            part.mBreak = first!=end;
+            if(part.mBreak){
+                const char* last = end;
+                while(last[-1]!='\n') --last;
+                part.mFirstLine = first - begin - (first>begin && first[-1]=='\r' ? 1 : 0);
+                part.mLastLine = end - last;
+            }else{
+                part.mFirstLine = size;
+            }
+            part.mDot = *begin=='.' && offset>0 && data[offset-1]!='\n';
+            mParts.push_back(part);
+        }, [&](size_t offset, size_t size){
+            Part part;
+            part.mField.assign(data, offset, size);
+            mParts.push_back(part);
+        });
+    }
+}
+
+MessageRef MessageTemplate::createMessage(const MessageRef& source, const std::string& address, const std::string& name, const Fields& fields){
+    MessageRef message = Message::create();
+    message->mContent = source->mContent;
+    message->mAttachments = source->mAttachments;
+    message->mFrom = source->mFrom;
+    message->mReplyTo = source->mReplyTo;
+    message->mCC = source->mCC;
+    message->mBCC = source->mBCC;
+    message->addRecipient(address, name);
+    
+    message->mSubject = substitute(source->mSubject, fields);
+    return message;
+}
+
+Message::ContentRef MessageTemplate::renderContent(const MessageRef& source, const Fields& fields){
+    return source->mContent->render([&fields](const std::string& text){
+        return substitute(text, fields);
+    });
+}
+
+MessageRef MessageTemplate::render(const std::string& address, const std::string& name, const Fields& fields) const{
+    MessageRef message = createMessage(mMessage, address, name, fields);
+    
+    //the shared parts are referenced, only the fields are new text
+    //that holds as long as the values are plain ascii and the lines stay short enough, the labels of the parts are right then
+    Message::Segments& body = message->mBody;
+    body.reserve(mParts.size());
+    bool formatted = mFormatted;
+    size_t line = 0; //length of the current line
+    for(auto& part: mParts){
+        if(!formatted) break;
+        
+        if(part.mAttachment){
+            //the encoded lines are followed by a line break
+            body << part.mAttachment;
+            line = 0;
+        }else if(part.mText){
+            if(part.mDot && !line){
+                formatted = false;
+            }
+            line += part.mFirstLine;
+            if(part.mBreak){
+                formatted = formatted && line<=MAX_LINE_LENGTH;
+                line = part.mLastLine;
+            }
+            body << part.mText;
+        }else{
+            Fields::const_iterator itr = fields.find(part.mField);
+            if(itr==fields.end()) continue;
+            
+            if(body.empty() || body.back().mAttachment || body.back().mShared){
+                body.push_back(Message::Segment(std::string()));
+            }
+            formatted = appendField(itr->second, line, body.back().mData);
+        }
+        formatted = formatted && line<=MAX_LINE_LENGTH;
+    }
+    
+    //formatted from its own content when the body can not be used, so every part gets the encoding its text needs
+    if(!formatted){
+        body.clear();
+        message->mContent = renderContent(mMessage, fields);
+        return message;
+    }
+    
+    //an 8bit body needs the same for a server without 8BITMIME, only rendered when a session asks for it
+    message->mBodyEightBit = mMessage->isEightBit();
+    if(message->mBodyEightBit){
+        MessageRef source = mMessage;
+        message->mRenderFallback = [source, address, name, fields](){
+            MessageRef fallback = createMessage(source, address, name, fields);
+            fallback->mContent = renderContent(source, fields);
+            return fallback;
+        };
+    }
+    
+    return message;
+}
+
+std::vector<std::string> MessageTemplate::getFields() const{
+    std::set<std::string> names;
+    
+    const std::string& subject = mMessage->mSubject;
+    parse(subject, [](size_t, size_t){}, [&](size_t offset, size_t size){
+        names.insert(subject.substr(offset, size));
+    });
+    for(auto& part: mParts){
+        if(!part.mText && !part.mAttachment){
+            names.insert(part.mField);
+        }
+    }
+    
+    return std::vector<std::string>(names.begin(), names.end());
+}
@@ -0,0 +1,148 @@
+//
+//  MessageWriter.cpp
+//  MailBlock
+//
+//  Created by Sylvain Vriens on 25/04/2013.
+//
+//
+
+#include "MessageWriter.h"
+#include "Encoding.h"
+
+using namespace cinder::mail;
+
+//bytes of input encoded on a single base64 line
+static const size_t BASE64_LINE_INPUT = MAIL_SMTP_BASE64_LINE_WIDTH/4*3;
+
+MessageWriter::MessageWriter(const Message::Segments& segments, const AttachmentCacheRef& cache, size_t chunkSize) : mSegments(segments), mCache(cache), mChunkSize(std::max<size_t>(chunkSize, 1024)), mSegment(0), mOffset(0), mFirstLine(true), mBytesWritten(0){
+    //encoding appends at most the available space or a single line, so this never reallocates
+    mEncoded.reserve(mChunkSize + MAIL_SMTP_BASE64_LINE_WIDTH + 2);
+}
+
+bool MessageWriter::next(Buffers& buffers){
+    buffers.clear();
+    mEncoded.clear();
+    mHeld.clear();
+    
+    size_t size = 0;
+    while(size<mChunkSize && mSegment<mSegments.size()){
+        const Message::Segment& segment = mSegments[mSegment];
+        size_t available = mChunkSize - size;
+        bool more;
+        
+        //an attachment that is just starting might be encoded already
+        if(segment.mAttachment && !mBody && !mStream && !mFile){
+            mBody = lookup(segment.mAttachment);
+        }
+        
+        const std::string* text = segment.mAttachment ? mBody.get() : &segment.getData();
+        if(text){
+            size_t length = std::min(available, text->size() - mOffset);
+            if(length){
+                buffers.push_back(boost::asio::buffer(text->data() + mOffset, length));
+            }
+            mOffset += length;
+            size += length;
+            more = mOffset<text->size();
+        }else{
+            size_t offset = mEncoded.size();
+            more = encode(mEncoded, available);
+            if(mEncoded.size()>offset){
+                buffers.push_back(boost::asio::buffer(mEncoded.data() + offset, mEncoded.size() - offset));
+            }
+            size += mEncoded.size() - offset;
+        }
+        if(more) break;
+        
+        //on to the next segment, keeping the body alive as long as the buffers point to it
+        if(mBody){
+            mHeld.push_back(mBody);
+            mBody.reset();
+        }
+        ++mSegment;
+        mOffset = 0;
+    }
+    
+    mBytesWritten += size;
+    return !buffers.empty();
+}
+
+bool MessageWriter::next(std::string& chunk){
+    Buffers buffers;
+    bool more = next(buffers);
+    
+    chunk.clear();
+    for(auto& buffer: buffers){
+        chunk.append(boost::asio::buffer_cast<const char*>(buffer), boost::asio::buffer_size(buffer));
+    }
+    return more;
+}
+
+AttachmentCache::BodyRef MessageWriter::lookup(const AttachmentRef& attachment){
+    if(!mCache) return AttachmentCache::BodyRef();
+    
+    AttachmentCache::Source source = attachment->getSource();
+    AttachmentCache::BodyRef body = mCache->find(source);
+    if(body) return body;
+    
+    //small enough to keep, so encode it as a whole once
+    if(!mCache->accepts(base64EncodedSize(source.mSize))){
+        return AttachmentCache::BodyRef();
+    }
+    
+    std::shared_ptr<std::string> encoded(new std::string(attachment->getData()));
+    mCache->insert(source, encoded);
+    return encoded;
+}
+
+bool MessageWriter::encode(std::string& chunk, size_t available){
+    const Message::Segment& segment = mSegments[mSegment];
+    
+    if(!mStream && !mFile){
+        //files are encoded straight from the mapped pages, anything else is read into a buffer first
+        mFile = segment.mAttachment->map();
+        if(!mFile){
+            mStream = segment.mAttachment->getDataSource()->createStream();
+        }
+        mOffset = 0;
+        mFirstLine = true;
+    }
+    
+    //whole lines only, at least one so a small chunk still makes progress
+    size_t lines = std::max<size_t>(available / (MAIL_SMTP_BASE64_LINE_WIDTH + 2), 1);
+    size_t wanted = lines * BASE64_LINE_INPUT;
+    
+    const char* input;
+    size_t size = 0;
+    if(mFile){
+        input = mFile->getData() + mOffset;
+        size = std::min(wanted, mFile->getSize() - mOffset);
+        mOffset += size;
+    }else{
+        //fill the input completely, so only the last piece of the file has padding
+        mInput.resize(wanted);
+        while(size<mInput.size() && !mStream->isEof()){
+            size_t read = mStream->readDataAvailable(&mInput[size], mInput.size() - size);
+            if(read==0) break;
+            size += read;
+        }
+        input = mInput.data();
+    }
+    
+    //encode straight into the chunk, the lines continue the ones of the previous chunk
+    if(size){
+        if(!mFirstLine){
+            chunk += MAIL_SMTP_NEWLINE;
+        }
+        mFirstLine = false;
+        encodeBase64(input, size, chunk);
+    }
+    
+    if(size<wanted){
+        //end of the file
+        mStream.reset();
+        mFile.reset();
+        return false;
+    }
+    return true;
+}
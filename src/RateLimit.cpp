@@ -0,0 +1,159 @@
+//
+//  RateLimit.cpp
+//  MailBlock
+//
+//  Created by Sylvain Vriens on 25/04/2013.
+//
+//
+
+#include "RateLimit.h"
+
+#include <algorithm>
+#include <boost/algorithm/string/case_conv.hpp>
+
+using namespace cinder::mail;
+
+namespace {
+    
+    //buckets kept before the full ones are forgotten
+    const size_t MAX_BUCKETS = 1024;
+    
+    //replies this much slower than usual mean the server is queueing
+    const double LATENCY_TOLERANCE = 2.0;
+    
+}
+
+void RateLimits::setServerRate(double perSecond, double burst){
+    std::lock_guard<std::mutex> lock(mMutex);
+    mServer = TokenBucket(perSecond, burst);
+}
+
+void RateLimits::setSenderRate(double perSecond, double burst){
+    std::lock_guard<std::mutex> lock(mMutex);
+    mSenderRate = Rate(perSecond, burst);
+    mSenders.clear();
+}
+
+void RateLimits::setDomainRate(double perSecond, double burst, const std::string& domain){
+    std::lock_guard<std::mutex> lock(mMutex);
+    if(domain.empty()){
+        mDomainRate = Rate(perSecond, burst);
+        mDomains.clear();
+    }else{
+        std::string key = boost::algorithm::to_lower_copy(domain);
+        mDomainRates[key] = Rate(perSecond, burst);
+        mDomains.erase(key);
+    }
+}
+
+double RateLimits::getDelay(const std::string& sender, const std::vector<std::string>& recipients){
+    std::lock_guard<std::mutex> lock(mMutex);
+    double time = now();
+    double delay = mServer.getDelay(time);
+    if(!sender.empty() && mSenderRate.mPerSecond>0){
+        delay = std::max(delay, getSender(sender).getDelay(time));
+    }
+    if(isDomainLimited()){
+        std::vector<std::string> domains;
+        getDomains(recipients, domains);
+        for(auto& domain: domains){
+            delay = std::max(delay, getDomain(domain).getDelay(time));
+        }
+    }
+    return delay;
+}
+
+void RateLimits::take(const std::string& sender, const std::vector<std::string>& recipients){
+    std::lock_guard<std::mutex> lock(mMutex);
+    double time = now();
+    mServer.take(time);
+    if(!sender.empty() && mSenderRate.mPerSecond>0){
+        getSender(sender).take(time);
+        prune(mSenders, time);
+    }
+    if(isDomainLimited()){
+        std::vector<std::string> domains;
+        getDomains(recipients, domains);
+        for(auto& domain: domains){
+            getDomain(domain).take(time);
+        }
+        prune(mDomains, time);
+    }
+}
+
+TokenBucket& RateLimits::getSender(const std::string& sender){
+    Buckets::iterator itr = mSenders.find(sender);
+    if(itr==mSenders.end()){
+        itr = mSenders.insert(std::make_pair(sender, TokenBucket(mSenderRate.mPerSecond, mSenderRate.mBurst))).first;
+    }
+    return itr->second;
+}
+
+TokenBucket& RateLimits::getDomain(const std::string& domain){
+    Buckets::iterator itr = mDomains.find(domain);
+    if(itr==mDomains.end()){
+        std::unordered_map<std::string, Rate>::const_iterator rate = mDomainRates.find(domain);
+        const Rate& limit = rate==mDomainRates.end() ? mDomainRate : rate->second;
+        itr = mDomains.insert(std::make_pair(domain, TokenBucket(limit.mPerSecond, limit.mBurst))).first;
+    }
+    return itr->second;
+}
+
+void RateLimits::getDomains(const std::vector<std::string>& recipients, std::vector<std::string>& domains) const{
+    for(auto& recipient: recipients){
+        size_t at = recipient.rfind('@');
+        if(at==std::string::npos) continue;
+        
+        //recipients of a batch are sorted by domain, so most duplicates are next to each other
+        std::string domain = boost::algorithm::to_lower_copy(recipient.substr(at + 1));
+        if(std::find(domains.begin(), domains.end(), domain)==domains.end()){
+            domains.push_back(domain);
+        }
+    }
+}
+
+void RateLimits::prune(Buckets& buckets, double now){
+    if(buckets.size()<=MAX_BUCKETS) return;
+    
+    for(Buckets::iterator itr = buckets.begin(); itr!=buckets.end();){
+        if(itr->second.isFull(now)){
+            itr = buckets.erase(itr);
+        }else{
+            ++itr;
+        }
+    }
+}
+
+void Concurrency::replied(int code, double seconds){
+    std::lock_guard<std::mutex> lock(mMutex);
+    double now = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    
+    if(code==421 || code==451){
+        //the server asks us to back off
+        decrease(0.5, now);
+        return;
+    }
+    
+    if(seconds<0) return;
+    
+    //a short and a long average, messages of different sizes take different times but move both alike
+    mLatency = mLatency>0 ? mLatency * 0.8 + seconds * 0.2 : seconds;
+    mBaseLatency = mBaseLatency>0 ? mBaseLatency * 0.99 + seconds * 0.01 : seconds;
+    
+    if(mLatency > std::max(mBaseLatency, 0.001) * LATENCY_TOLERANCE){
+        //queueing at the server, more connections only make it worse
+        decrease(0.9, now);
+        return;
+    }
+    
+    if(code/100==2){
+        mWindow = std::min(mMaximum, mWindow + 1 / mWindow);
+    }
+}
+
+void Concurrency::decrease(double factor, double now){
+    if(now - mLastDecrease < std::max(mLatency * 2, 0.1)) return;
+    
+    mWindow = std::max(1.0, mWindow * factor);
+    mLastDecrease = now;
+}
@@ -0,0 +1,273 @@
+//
+//  Resolver.cpp
+//  MailBlock
+//
+//  Created by Sylvain Vriens on 25/04/2013.
+//
+//
+
+#include "Resolver.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <boost/algorithm/string/case_conv.hpp>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <windns.h>
+#pragma comment(lib, "dnsapi.lib")
+#else
+#include <netinet/in.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+#include <netdb.h>
+#include <cstring>
+#endif
+
+using namespace cinder::mail;
+
+namespace {
+    
+    //answers for a domain without MX records are kept this long
+    const uint32_t IMPLICIT_MX_TTL = 300;
+    
+    //the single record of a domain that takes no mail (RFC 7505)
+    bool isNullMX(const MXRecords& records){
+        return records.size()==1 && (records.front().mHost.empty() || records.front().mHost==".");
+    }
+    
+}
+
+DNSResolver::DNSResolver(size_t threads) : mStopping(false){
+    for(size_t i=0; i<std::max<size_t>(threads, 1); ++i){
+        mThreads.push_back(std::shared_ptr<std::thread>(new std::thread(&DNSResolver::threadedFunction, this)));
+    }
+}
+
+DNSResolver::~DNSResolver(){
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopping = true;
+    }
+    mCondition.notify_all();
+    for(auto& thread: mThreads){
+        thread->join();
+    }
+    
+    //nobody is waiting for the queued ones anymore, but they are told
+    for(auto& query: mQueries){
+        query.second(FAILED, MXRecords(), 0);
+    }
+}
+
+void DNSResolver::lookupMX(const std::string& domain, const Handler& handler){
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mQueries.push_back(std::make_pair(domain, handler));
+    }
+    mCondition.notify_one();
+}
+
+void DNSResolver::threadedFunction(){
+    while(true){
+        std::pair<std::string, Handler> lookup;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mCondition.wait(lock, [this](){ return mStopping || !mQueries.empty(); });
+            if(mStopping) return;
+            
+            lookup = mQueries.front();
+            mQueries.pop_front();
+        }
+        
+        MXRecords records;
+        uint32_t ttl = 0;
+        Result result = query(lookup.first, records, ttl);
+        lookup.second(result, records, ttl);
+    }
+}
+
+#if defined(_WIN32)
+
+Resolver::Result DNSResolver::query(const std::string& domain, MXRecords& records, uint32_t& ttl){
+    PDNS_RECORD answer = NULL;
+    DNS_STATUS status = DnsQuery_A(domain.c_str(), DNS_TYPE_MX, DNS_QUERY_STANDARD, NULL, &answer, NULL);
+    if(status==DNS_ERROR_RCODE_NAME_ERROR) return NOT_FOUND;
+    if(status!=0 && status!=DNS_INFO_NO_RECORDS) return FAILED;
+    
+    ttl = UINT32_MAX;
+    for(PDNS_RECORD record = answer; record; record = record->pNext){
+        if(record->wType!=DNS_TYPE_MX || record->Flags.S.Section!=DnsSectionAnswer) continue;
+        records.push_back(MXRecord(record->Data.MX.wPreference, record->Data.MX.pNameExchange));
+        ttl = std::min<uint32_t>(ttl, record->dwTtl);
+    }
+    if(answer){
+        DnsRecordListFree(answer, DnsFreeRecordList);
+    }
+    
+    if(records.empty()){
+        records.push_back(MXRecord(0, domain));
+        ttl = IMPLICIT_MX_TTL;
+    }
+    return isNullMX(records) ? NOT_FOUND : FOUND;
+}
+
+#else
+
+Resolver::Result DNSResolver::query(const std::string& domain, MXRecords& records, uint32_t& ttl){
+    //the reentrant interface, the lookups run on several threads
+    struct __res_state state;
+    memset(&state, 0, sizeof(state));
+    if(res_ninit(&state)!=0) return FAILED;
+    
+    unsigned char answer[NS_MAXMSG < 65536 ? NS_MAXMSG : 65536];
+    int length = res_nquery(&state, domain.c_str(), ns_c_in, ns_t_mx, answer, sizeof(answer));
+    int error = state.res_h_errno;
+    res_nclose(&state);
+    
+    if(length<0){
+        if(error==HOST_NOT_FOUND) return NOT_FOUND;
+        if(error!=NO_DATA) return FAILED;
+        length = 0;
+    }
+    
+    ns_msg message;
+    if(length>0 && ns_initparse(answer, length, &message)==0){
+        ttl = UINT32_MAX;
+        for(int i=0; i<ns_msg_count(message, ns_s_an); ++i){
+            ns_rr record;
+            if(ns_parserr(&message, ns_s_an, i, &record)!=0 || ns_rr_type(record)!=ns_t_mx || ns_rr_rdlen(record)<3) continue;
+            
+            //the priority, followed by the host as a compressed name
+            const unsigned char* data = ns_rr_rdata(record);
+            char host[NS_MAXDNAME];
+            if(ns_name_uncompress(ns_msg_base(message), ns_msg_end(message), data + 2, host, sizeof(host))<0) continue;
+            
+            records.push_back(MXRecord(ns_get16(data), host));
+            ttl = std::min<uint32_t>(ttl, ns_rr_ttl(record));
+        }
+    }
+    
+    if(records.empty()){
+        records.push_back(MXRecord(0, domain));
+        ttl = IMPLICIT_MX_TTL;
+    }
+    return isNullMX(records) ? NOT_FOUND : FOUND;
+}
+
+#endif
+
+bool HostsResolver::load(const ci::fs::path& path){
+    std::ifstream file(path.string().c_str());
+    if(!file) return false;
+    
+    std::string line;
+    while(std::getline(file, line)){
+        size_t comment = line.find('#');
+        if(comment!=std::string::npos) line.erase(comment);
+        
+        std::istringstream fields(line);
+        std::string domain, host;
+        uint32_t priority, ttl = 300;
+        if(!(fields >> domain >> priority >> host)) continue;
+        fields >> ttl;
+        
+        addRecord(domain, static_cast<uint16_t>(priority), host, ttl);
+    }
+    return true;
+}
+
+void HostsResolver::addRecord(const std::string& domain, uint16_t priority, const std::string& host, uint32_t ttl){
+    std::lock_guard<std::mutex> lock(mMutex);
+    Entry& entry = mDomains[boost::algorithm::to_lower_copy(domain)];
+    entry.mRecords.push_back(MXRecord(priority, host));
+    entry.mTTL = entry.mRecords.size()==1 ? ttl : std::min(entry.mTTL, ttl);
+}
+
+void HostsResolver::lookupMX(const std::string& domain, const Handler& handler){
+    Entry entry;
+    bool found = false;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        std::unordered_map<std::string, Entry>::const_iterator itr = mDomains.find(boost::algorithm::to_lower_copy(domain));
+        if(itr==mDomains.end()){
+            itr = mDomains.find("*");
+        }
+        if(itr!=mDomains.end()){
+            entry = itr->second;
+            found = true;
+        }
+    }
+    
+    if(!found || isNullMX(entry.mRecords)){
+        handler(NOT_FOUND, MXRecords(), 0);
+        return;
+    }
+    handler(FOUND, entry.mRecords, entry.mTTL);
+}
+
+void MXCache::resolve(const std::string& domain, const Handler& handler){
+    std::string key = boost::algorithm::to_lower_copy(domain);
+    bool cached = false;
+    Resolver::Result result = Resolver::FAILED;
+    MXRecords records;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        Entry& entry = mEntries[key];
+        if(!entry.mWaiting.empty()){
+            entry.mWaiting.push_back(handler);
+            return;
+        }
+        
+        if(entry.mExpires>std::chrono::steady_clock::now()){
+            cached = true;
+            result = entry.mResult;
+            records = order(entry.mRecords);
+        }else{
+            entry.mWaiting.push_back(handler);
+        }
+    }
+    
+    if(cached){
+        handler(result, records);
+        return;
+    }
+    
+    //the resolver might answer right away, so the mutex is not held
+    MXCacheRef self = shared_from_this();
+    mResolver->lookupMX(key, [self, key](Resolver::Result result, const MXRecords& records, uint32_t ttl){
+        self->resolved(key, result, records, ttl);
+    });
+}
+
+void MXCache::resolved(const std::string& domain, Resolver::Result result, const MXRecords& records, uint32_t ttl){
+    std::vector<Handler> waiting;
+    MXRecords ordered;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        Entry& entry = mEntries[domain];
+        entry.mResult = result;
+        entry.mRecords = records;
+        
+        //a failed lookup is not remembered, the next delivery asks again
+        if(result==Resolver::NOT_FOUND && ttl==0){
+            ttl = mNegativeTTL;
+        }
+        entry.mExpires = std::chrono::steady_clock::now() + std::chrono::seconds(result==Resolver::FAILED ? 0 : ttl);
+        
+        waiting.swap(entry.mWaiting);
+        ordered = order(records);
+    }
+    
+    for(auto& handler: waiting){
+        handler(result, ordered);
+    }
+}
+
+MXRecords MXCache::order(const MXRecords& records){
+    MXRecords ordered(records);
+    std::shuffle(ordered.begin(), ordered.end(), mRandom);
+    std::stable_sort(ordered.begin(), ordered.end(), [](const MXRecord& a, const MXRecord& b){ return a.mPriority<b.mPriority; });
+    return ordered;
+}
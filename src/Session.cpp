@@ -0,0 +1,250 @@
+//
+//  Session.cpp
+//  MailBlock
+//
+//  Created by Sylvain Vriens on 19/03/2013.
+//
+//
+
+#include "Session.h"
+
+#include <algorithm>
+#include <boost/algorithm/string/case_conv.hpp>
+
+using namespace cinder::mail;
+using boost::asio::ip::tcp;
+
+void Session::connect(const std::string& server, int32_t port, const ConnectHandler& handler){
+    SessionRef self = shared_from_this();
+    
+    tcp::resolver::query query(server, ci::toString(port));
+    
+    startTimer();
+    mResolver.async_resolve(query, mStrand.wrap([self, handler](const boost::system::error_code& error, tcp::resolver::iterator endpoints){
+        if(error){
+            self->mTimer.cancel();
+            handler(false);
+            return;
+        }
+        
+        self->startTimer();
+        boost::asio::async_connect(self->mSocket, endpoints, self->mStrand.wrap([self, handler](const boost::system::error_code& error, tcp::resolver::iterator){
+            self->mTimer.cancel();
+            handler(!error);
+        }));
+    }));
+}
+
+void Session::readReply(const ReplyHandler& handler){
+    mReplyLines = 0;
+    parseReply(handler);
+}
+
+void Session::parseReply(const ReplyHandler& handler){
+    SessionRef self = shared_from_this();
+    
+    while(true){
+        const char* begin = mReadBuffer.data() + mReadStart;
+        const char* end = mReadBuffer.data() + mReadEnd;
+        const char* newline = std::find(begin, end, '\n');
+        if(newline==end) break;
+        
+        size_t length = newline - begin;
+        if(length && begin[length-1]=='\r') --length;
+        mReadStart += newline - begin + 1;
+        
+        if(!length) continue; //skip empty lines
+        
+        if(mReplyLines<mReply.size()){
+            mReply[mReplyLines].parse(begin, length);
+        }else{
+            mReply.push_back(Response(begin, length));
+        }
+        ++mReplyLines;
+        
+        //a dash after the code means more lines will follow
+        if(length>3 && begin[3]=='-') continue;
+        
+        //lines left over from a longer previous reply
+        if(mReply.size()>mReplyLines){
+            mReply.erase(mReply.begin() + mReplyLines, mReply.end());
+        }
+        replied(mReply);
+        handler(mReply);
+        return;
+    }
+    
+    //make room for more data, moving the partial line to the front
+    if(mReadStart==mReadEnd){
+        mReadStart = mReadEnd = 0;
+    }else if(mReadStart>0){
+        std::copy(mReadBuffer.begin() + mReadStart, mReadBuffer.begin() + mReadEnd, mReadBuffer.begin());
+        mReadEnd -= mReadStart;
+        mReadStart = 0;
+    }
+    if(mReadEnd==mReadBuffer.size()){
+        //a single line larger than the buffer
+        if(mReadBuffer.size()>=MAIL_SMTP_READ_BUFFER_MAX){
+            replied(Responses());
+            handler(Responses());
+            return;
+        }
+        mReadBuffer.resize(mReadBuffer.size()*2);
+    }
+    
+    startTimer();
+    mSocket.async_read_some(boost::asio::buffer(mReadBuffer.data() + mReadEnd, mReadBuffer.size() - mReadEnd), mStrand.wrap([self, handler](const boost::system::error_code& error, size_t bytesRead){
+        self->mTimer.cancel();
+        if(error){
+            self->replied(Responses());
+            handler(Responses());
+            return;
+        }
+        
+        self->mReadEnd += bytesRead;
+        self->parseReply(handler);
+    }));
+}
+
+void Session::sendData(const std::string& data, const ReplyHandler& handler, bool appendNL){
+    //one call at a time, so the command buffer is free until the reply is read
+    mCommands.clear();
+    mCommands << data;
+    if(appendNL){
+        mCommands << MAIL_SMTP_NEWLINE;
+    }
+    writeCommands(handler);
+}
+
+void Session::sendCommand(const char* command, const std::string& address, const ReplyHandler& handler, const char* parameters){
+    mCommands.clear();
+    mCommands.writeCommand(command, address, parameters);
+    writeCommands(handler);
+}
+
+void Session::writeCommands(const ReplyHandler& handler){
+    SessionRef self = shared_from_this();
+    
+    startTimer();
+    boost::asio::async_write(mSocket, boost::asio::buffer(mCommands.data(), mCommands.size()), mStrand.wrap([self, handler](const boost::system::error_code& error, size_t bytesWritten){
+        self->mTimer.cancel();
+        self->written(bytesWritten);
+        if(error){
+            handler(Responses());
+            return;
+        }
+        
+        self->readReply(handler);
+    }));
+}
+
+void Session::sendStream(const ChunkSource& source, const ReplyHandler& handler){
+    std::shared_ptr<Buffers> chunk(new Buffers());
+    writeChunk(source, chunk, handler);
+}
+
+void Session::writeChunk(const ChunkSource& source, const std::shared_ptr<Buffers>& chunk, const ReplyHandler& handler){
+    SessionRef self = shared_from_this();
+    
+    if(!source(*chunk)){
+        mTimeReply = true;
+        mReplyStart = std::chrono::steady_clock::now();
+        readReply(handler);
+        return;
+    }
+    
+    startTimer();
+    boost::asio::async_write(mSocket, *chunk, mStrand.wrap([self, source, chunk, handler](const boost::system::error_code& error, size_t bytesWritten){
+        self->mTimer.cancel();
+        self->written(bytesWritten);
+        if(error){
+            handler(Responses());
+            return;
+        }
+        
+        self->writeChunk(source, chunk, handler);
+    }));
+}
+
+void Session::sendEnvelope(const std::string& sender, const std::vector<std::string>& recipients, const RepliesHandler& handler, const char* last, const char* parameters){
+    SessionRef self = shared_from_this();
+    
+    //gather every command and line ending in a single write
+    mCommands.clear();
+    mCommands.writeEnvelope(sender, recipients, parameters);
+    if(last){
+        mCommands << last << MAIL_SMTP_NEWLINE;
+    }
+    
+    size_t count = 1 + recipients.size() + (last ? 1 : 0);
+    std::shared_ptr<std::vector<Responses> > replies(new std::vector<Responses>());
+    replies->reserve(count);
+    
+    startTimer();
+    boost::asio::async_write(mSocket, boost::asio::buffer(mCommands.data(), mCommands.size()), mStrand.wrap([self, handler, count, replies](const boost::system::error_code& error, size_t bytesWritten){
+        self->mTimer.cancel();
+        self->written(bytesWritten);
+        if(error){
+            handler(*replies);
+            return;
+        }
+        
+        self->readReplies(count, replies, handler);
+    }));
+}
+
+void Session::readReplies(size_t count, const std::shared_ptr<std::vector<Responses> >& replies, const RepliesHandler& handler){
+    SessionRef self = shared_from_this();
+    
+    readReply([self, count, replies, handler](const Responses& reply){
+        if(reply.empty()){
+            handler(*replies);
+            return;
+        }
+        
+        replies->push_back(reply);
+        if(replies->size()<count){
+            self->readReplies(count, replies, handler);
+            return;
+        }
+        
+        handler(*replies);
+    });
+}
+
+void Session::setCapabilities(const Responses& ehlo){
+    mCapabilities.clear();
+    
+    //the first line greets, every next line is a keyword with optional parameters
+    for(size_t i=1; i<ehlo.size(); ++i){
+        const std::string& line = ehlo[i].getResponse();
+        size_t space = line.find(' ');
+        std::string keyword = boost::algorithm::to_upper_copy(line.substr(0, space));
+        mCapabilities[keyword] = space==std::string::npos ? "" : line.substr(space+1);
+    }
+}
+
+void Session::close(){
+    boost::system::error_code ignored;
+    mTimer.cancel(ignored);
+    mResolver.cancel();
+    if(mSocket.is_open()){
+        mSocket.shutdown(tcp::socket::shutdown_both, ignored);
+        mSocket.close(ignored);
+    }
+}
+
+void Session::startTimer(){
+    mTimer.expires_from_now(mTimeout);
+    mTimer.async_wait(mStrand.wrap(std::bind(&Session::onTimeout, shared_from_this(), std::placeholders::_1)));
+}
+
+void Session::onTimeout(const boost::system::error_code& error){
+    //cancelled or re-armed for the next step
+    if(error==boost::asio::error::operation_aborted || mTimer.expires_at()>boost::asio::deadline_timer::traits_type::now()){
+        return;
+    }
+    
+    //closing the socket makes the pending step complete with an error
+    close();
+}
@@ -0,0 +1,581 @@
+//
+//  Spool.cpp
+//  MailBlock
+//
+//  Created by Sylvain Vriens on 25/04/2013.
+//
+//
+
+#include "Spool.h"
+#include "MappedFile.h"
+#include "AttachmentCache.h"
+
+#include <cstring>
+#include <algorithm>
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+#endif
+
+using namespace cinder::mail;
+
+namespace {
+    
+    //every record starts with a header, followed by the payload
+    //the numbers are stored in the byte order of the machine
+    const uint32_t  RECORD_MAGIC = 0x4c50534d;
+    const size_t    RECORD_HEADER_SIZE = 32;
+    
+    enum RecordType {
+        RECORD_ENTRY = 1, //an envelope and the serialized message
+        RECORD_ACK = 2 //ids of entries that are done
+    };
+    
+    struct RecordHeader {
+        uint32_t mMagic;
+        uint32_t mType;
+        uint64_t mId;
+        uint64_t mSize;
+        uint64_t mChecksum;
+    };
+    
+    //writes the file buffers to the disk, false when they might not have arrived there
+    bool flushFile(std::FILE* file){
+        if(std::fflush(file)!=0) return false;
+#if defined(_WIN32)
+        return _commit(_fileno(file))==0;
+#else
+        return fsync(fileno(file))==0;
+#endif
+    }
+    
+    //cuts off what was written after the size, a record that failed halfway would end the segment for recovery
+    bool truncateFile(std::FILE* file, uint64_t size){
+        std::clearerr(file);
+        std::fflush(file);
+#if defined(_WIN32)
+        bool truncated = _chsize_s(_fileno(file), size)==0;
+#else
+        bool truncated = ftruncate(fileno(file), size)==0;
+#endif
+        std::fseek(file, 0, SEEK_END);
+        return truncated;
+    }
+    
+    //makes a new file in the directory durable, false when it might not be
+    bool flushDirectory(const ci::fs::path& directory){
+#if !defined(_WIN32)
+        int fd = ::open(directory.string().c_str(), O_RDONLY);
+        if(fd<0) return false;
+        //some file systems can not sync a directory, their entries are durable already
+        bool flushed = fsync(fd)==0 || errno==EINVAL;
+        ::close(fd);
+        return flushed;
+#else
+        return true;
+#endif
+    }
+    
+    void appendNumber(std::string& data, uint32_t value){
+        data.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+    
+    //the size of the envelope at the start of an entry payload
+    size_t getEnvelopeSize(const char* payload, size_t size){
+        uint32_t count;
+        if(size<sizeof(count)) return size;
+        memcpy(&count, payload, sizeof(count));
+        
+        size_t offset = sizeof(count);
+        for(uint32_t i=0; i<count; ++i){
+            uint32_t length;
+            if(size - offset<sizeof(length)) return size;
+            memcpy(&length, payload + offset, sizeof(length));
+            offset += sizeof(length);
+            if(size - offset<length) return size;
+            offset += length;
+        }
+        return offset;
+    }
+    
+    //the message of an entry is hashed in blocks of this size, the last one can be shorter or empty
+    //so the checksum is the same whether the message is written and read as a whole or in pieces
+    const size_t CHECKSUM_BLOCK_SIZE = 64*1024;
+    
+    //the checksum of a record, hashing the envelope and the message of an entry apart so they are not copied together
+    class Checksum {
+    public:
+        Checksum(const char* head, size_t size) : mHash(AttachmentCache::hash(head, size)){
+            mBlock.reserve(CHECKSUM_BLOCK_SIZE);
+        }
+        
+        void update(const char* data, size_t size){
+            while(size){
+                //a full block is only hashed once more follows, the last one is hashed by finish
+                if(mBlock.size()==CHECKSUM_BLOCK_SIZE){
+                    mHash = AttachmentCache::hash(mBlock.data(), mBlock.size(), mHash);
+                    mBlock.clear();
+                }
+                size_t length = std::min(CHECKSUM_BLOCK_SIZE - mBlock.size(), size);
+                mBlock.append(data, length);
+                data += length;
+                size -= length;
+            }
+        }
+        
+        uint64_t finish() const{
+            return AttachmentCache::hash(mBlock.data(), mBlock.size(), mHash);
+        }
+        
+    private:
+        uint64_t    mHash;
+        std::string mBlock;
+    };
+    
+    uint64_t getChecksum(const char* head, size_t headSize, const char* rest, size_t restSize){
+        Checksum checksum(head, headSize);
+        checksum.update(rest, restSize);
+        return checksum.finish();
+    }
+    
+    //the envelope at the start of an entry payload
+    std::string createEnvelope(const Message::Headers& envelope){
+        std::string head;
+        appendNumber(head, static_cast<uint32_t>(envelope.size()));
+        for(auto& line: envelope){
+            appendNumber(head, static_cast<uint32_t>(line.size()));
+            head += line;
+        }
+        return head;
+    }
+    
+    //splits an entry payload in the envelope and the message
+    bool parseEntry(const char* payload, size_t size, Message::Headers& envelope, std::string& data){
+        const char* end = payload + size;
+        uint32_t count;
+        if(size<sizeof(count)) return false;
+        memcpy(&count, payload, sizeof(count));
+        payload += sizeof(count);
+        
+        envelope.clear();
+        for(uint32_t i=0; i<count; ++i){
+            uint32_t length;
+            if(end - payload<(ptrdiff_t)sizeof(length)) return false;
+            memcpy(&length, payload, sizeof(length));
+            payload += sizeof(length);
+            if(end - payload<(ptrdiff_t)length) return false;
+            envelope.push_back(std::string(payload, length));
+            payload += length;
+        }
+        
+        data.assign(payload, end);
+        return true;
+    }
+    
+}
+
+Spool::Spool(const ci::fs::path& directory, size_t segmentSize) : mDirectory(directory), mSegmentSize(segmentSize), mNextId(1), mSegment(0), mFile(NULL), mOffset(0), mStreaming(false), mSyncWrites(1), mSyncDelay(0), mUnsynced(0){
+    ci::fs::create_directories(mDirectory);
+    
+    std::lock_guard<std::mutex> lock(mMutex);
+    recover();
+    
+    //never append to a recovered segment, its end might be half written
+    //when it can not be opened, the first write tries again
+    mSegment = mSegments.empty() ? 0 : mSegments.rbegin()->first;
+    openSegment(mSegment + 1);
+    removeSegments();
+}
+
+Spool::~Spool(){
+    std::lock_guard<std::mutex> lock(mMutex);
+    if(mFile){
+        flushFile(mFile);
+        std::fclose(mFile);
+    }
+}
+
+ci::fs::path Spool::getPath(uint32_t segment) const{
+    char name[32];
+    snprintf(name, sizeof(name), "%08u.spool", segment);
+    return mDirectory / name;
+}
+
+void Spool::recover(){
+    std::vector<uint32_t> segments;
+    for(ci::fs::directory_iterator itr(mDirectory); itr!=ci::fs::directory_iterator(); ++itr){
+        std::string name = itr->path().filename().string();
+        unsigned segment;
+        if(name.size()==14 && sscanf(name.c_str(), "%08u.spool", &segment)==1){
+            segments.push_back(segment);
+        }
+    }
+    std::sort(segments.begin(), segments.end());
+    
+    for(auto segment: segments){
+        mSegments[segment] = 0;
+        recoverSegment(segment);
+    }
+}
+
+void Spool::recoverSegment(uint32_t segment){
+    MappedFileRef file = MappedFile::open(getPath(segment));
+    if(!file) return;
+    
+    const char* data = file->getData();
+    uint64_t size = file->getSize();
+    uint64_t offset = 0;
+    while(offset + RECORD_HEADER_SIZE<=size){
+        RecordHeader header;
+        memcpy(&header, data + offset, sizeof(header));
+        uint64_t payload = offset + RECORD_HEADER_SIZE;
+        
+        //a record that was not written completely ends the segment
+        if(header.mMagic!=RECORD_MAGIC || header.mSize>size - payload) break;
+        size_t head = header.mType==RECORD_ENTRY ? getEnvelopeSize(data + payload, header.mSize) : header.mSize;
+        if(getChecksum(data + payload, head, data + payload + head, header.mSize - head)!=header.mChecksum) break;
+        
+        if(header.mType==RECORD_ENTRY){
+            //an entry that was moved by compaction replaces its older copy
+            std::map<uint64_t, Location>::iterator itr = mEntries.find(header.mId);
+            if(itr!=mEntries.end()){
+                --mSegments[itr->second.mSegment];
+            }
+            Location& location = mEntries[header.mId];
+            location.mSegment = segment;
+            location.mOffset = payload;
+            location.mSize = header.mSize;
+            ++mSegments[segment];
+            mNextId = std::max(mNextId, header.mId + 1);
+        }else if(header.mType==RECORD_ACK){
+            for(uint64_t i=0; i+sizeof(uint64_t)<=header.mSize; i+=sizeof(uint64_t)){
+                uint64_t id;
+                memcpy(&id, data + payload + i, sizeof(id));
+                std::map<uint64_t, Location>::iterator itr = mEntries.find(id);
+                if(itr!=mEntries.end()){
+                    --mSegments[itr->second.mSegment];
+                    mEntries.erase(itr);
+                }
+            }
+        }
+        
+        offset = payload + header.mSize;
+    }
+}
+
+bool Spool::openSegment(uint32_t segment){
+    if(mFile){
+        //the unsynced writes of the old segment have to be durable before the new one is used
+        if(!flushFile(mFile)) return false;
+        std::fclose(mFile);
+        mFile = NULL;
+        mUnsynced = 0;
+    }
+    
+    //not opened for appending, the header of a streamed record is written after its payload
+    std::FILE* file = std::fopen(getPath(segment).string().c_str(), "wb+");
+    if(!file) return false;
+    if(!flushDirectory(mDirectory)){
+        std::fclose(file);
+        boost::system::error_code error;
+        ci::fs::remove(getPath(segment), error);
+        return false;
+    }
+    
+    mSegment = segment;
+    mFile = file;
+    mOffset = 0;
+    mSegments[segment] = 0;
+    return true;
+}
+
+bool Spool::write(uint8_t type, uint64_t id, const char* payload, size_t size, const char* extra, size_t extraSize, uint64_t& offset){
+    if(!mFile || mOffset>=mSegmentSize){
+        if(!openSegment(mSegment + 1)) return false;
+    }
+    
+    RecordHeader header;
+    header.mMagic = RECORD_MAGIC;
+    header.mType = type;
+    header.mId = id;
+    header.mSize = size + extraSize;
+    header.mChecksum = getChecksum(payload, size, extra ? extra : "", extraSize);
+    
+    std::fseek(mFile, 0, SEEK_END);
+    bool written = std::fwrite(&header, sizeof(header), 1, mFile)==1;
+    written = written && std::fwrite(payload, 1, size, mFile)==size;
+    if(extraSize){
+        written = written && std::fwrite(extra, 1, extraSize, mFile)==extraSize;
+    }
+    return finishRecord(written, header.mSize, offset);
+}
+
+bool Spool::finishRecord(bool written, uint64_t size, uint64_t& offset){
+    //flushed to the file right away, so a failing write is seen at the record that caused it
+    written = written && std::fflush(mFile)==0;
+    
+    if(!written){
+        //records after a partial one would not be recovered, so cut it off or leave the segment
+        if(!truncateFile(mFile, mOffset)){
+            std::fclose(mFile);
+            mFile = NULL;
+        }
+        return false;
+    }
+    
+    offset = mOffset + RECORD_HEADER_SIZE;
+    mOffset = offset + size;
+    
+    if(!mUnsynced++){
+        mFirstUnsynced = std::chrono::steady_clock::now();
+    }
+    return true;
+}
+
+uint64_t Spool::append(const Message::Headers& envelope, const std::string& data, bool sync){
+    std::string head = createEnvelope(envelope);
+    
+    std::lock_guard<std::mutex> appendLock(mAppendMutex);
+    std::lock_guard<std::mutex> lock(mMutex);
+    uint64_t id = mNextId++;
+    
+    uint64_t offset;
+    if(!write(RECORD_ENTRY, id, head.data(), head.size(), data.data(), data.size(), offset)) return 0;
+    return addEntry(id, offset, head.size() + data.size(), sync);
+}
+
+uint64_t Spool::append(const Message::Headers& envelope, const Source& source, bool sync){
+    std::string head = createEnvelope(envelope);
+    
+    //the record has to stay in one piece, so no other entry is written until it is done
+    std::lock_guard<std::mutex> appendLock(mAppendMutex);
+    
+    //the header is not valid until the payload is complete, so a record that is not finished ends the segment for recovery
+    RecordHeader header;
+    header.mMagic = 0;
+    header.mType = RECORD_ENTRY;
+    header.mSize = head.size();
+    header.mChecksum = 0;
+    Checksum checksum(head.data(), head.size());
+    
+    bool written;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if(!mFile || mOffset>=mSegmentSize){
+            if(!openSegment(mSegment + 1)) return 0;
+        }
+        header.mId = mNextId++;
+        
+        std::fseek(mFile, 0, SEEK_END);
+        written = std::fwrite(&header, sizeof(header), 1, mFile)==1;
+        written = written && std::fwrite(head.data(), 1, head.size(), mFile)==head.size();
+        mStreaming = true;
+    }
+    
+    //the message is produced without the lock, so acknowledging is not held up while a large attachment is encoded
+    std::string chunk;
+    while(written && source(chunk)){
+        checksum.update(chunk.data(), chunk.size());
+        header.mSize += chunk.size();
+        
+        std::lock_guard<std::mutex> lock(mMutex);
+        written = std::fwrite(chunk.data(), 1, chunk.size(), mFile)==chunk.size();
+    }
+    
+    std::lock_guard<std::mutex> lock(mMutex);
+    mStreaming = false;
+    
+    header.mMagic = RECORD_MAGIC;
+    header.mChecksum = checksum.finish();
+    written = written && std::fseek(mFile, mOffset, SEEK_SET)==0;
+    written = written && std::fwrite(&header, sizeof(header), 1, mFile)==1;
+    std::fseek(mFile, 0, SEEK_END);
+    
+    uint64_t offset;
+    written = finishRecord(written, header.mSize, offset);
+    
+    //the acknowledgements that came in meanwhile, as a single record
+    if(!mAcknowledged.empty()){
+        uint64_t ackOffset;
+        write(RECORD_ACK, 0, reinterpret_cast<const char*>(&mAcknowledged[0]), mAcknowledged.size()*sizeof(uint64_t), ackOffset);
+        mAcknowledged.clear();
+    }
+    
+    if(!written) return 0;
+    return addEntry(header.mId, offset, header.mSize, sync);
+}
+
+uint64_t Spool::appendCopy(const Message::Headers& envelope, uint64_t entry, bool sync){
+    std::string head = createEnvelope(envelope);
+    
+    std::lock_guard<std::mutex> appendLock(mAppendMutex);
+    std::lock_guard<std::mutex> lock(mMutex);
+    
+    std::map<uint64_t, Location>::iterator itr = mEntries.find(entry);
+    if(itr==mEntries.end()) return 0;
+    const Location& location = itr->second;
+    
+    //records are flushed as they are written, so the segment that is still written can be mapped as well
+    MappedFileRef file = MappedFile::open(getPath(location.mSegment));
+    if(!file || location.mOffset + location.mSize>file->getSize()) return 0;
+    const char* payload = file->getData() + location.mOffset;
+    size_t envelopeSize = getEnvelopeSize(payload, location.mSize);
+    
+    uint64_t id = mNextId++;
+    uint64_t offset;
+    if(!write(RECORD_ENTRY, id, head.data(), head.size(), payload + envelopeSize, location.mSize - envelopeSize, offset)) return 0;
+    return addEntry(id, offset, head.size() + location.mSize - envelopeSize, sync);
+}
+
+uint64_t Spool::addEntry(uint64_t id, uint64_t offset, uint64_t size, bool sync){
+    Location location;
+    location.mSegment = mSegment;
+    location.mOffset = offset;
+    location.mSize = size;
+    mEntries[id] = location;
+    ++mSegments[mSegment];
+    
+    //not durable, so it is taken out again and the caller keeps the message
+    if(sync && !syncIfNeeded()){
+        acknowledgeLocked(id);
+        return 0;
+    }
+    return id;
+}
+
+void Spool::acknowledge(uint64_t id){
+    std::lock_guard<std::mutex> lock(mMutex);
+    acknowledgeLocked(id);
+    syncIfNeeded();
+}
+
+void Spool::acknowledgeLocked(uint64_t id){
+    std::map<uint64_t, Location>::iterator itr = mEntries.find(id);
+    if(itr==mEntries.end()) return;
+    
+    //without the record the entry comes back after a restart, which is a message sent twice at worst
+    if(mStreaming){
+        mAcknowledged.push_back(id);
+    }else{
+        uint64_t offset;
+        write(RECORD_ACK, 0, reinterpret_cast<const char*>(&id), sizeof(id), offset);
+    }
+    --mSegments[itr->second.mSegment];
+    mEntries.erase(itr);
+    
+    removeSegments();
+}
+
+bool Spool::read(uint64_t id, Message::Headers& envelope, std::string& data){
+    std::lock_guard<std::mutex> lock(mMutex);
+    
+    std::map<uint64_t, Location>::iterator itr = mEntries.find(id);
+    if(itr==mEntries.end()) return false;
+    const Location& location = itr->second;
+    
+    //the segment that is still written is read through the file, older ones are mapped
+    if(location.mSegment==mSegment && mFile){
+        std::string payload(location.mSize, 0);
+        std::fseek(mFile, location.mOffset, SEEK_SET);
+        size_t read = std::fread(&payload[0], 1, payload.size(), mFile);
+        std::fseek(mFile, 0, SEEK_END);
+        return read==payload.size() && parseEntry(payload.data(), payload.size(), envelope, data);
+    }
+    
+    MappedFileRef file = MappedFile::open(getPath(location.mSegment));
+    if(!file || location.mOffset + location.mSize>file->getSize()) return false;
+    return parseEntry(file->getData() + location.mOffset, location.mSize, envelope, data);
+}
+
+std::vector<uint64_t> Spool::getPending() const{
+    std::lock_guard<std::mutex> lock(mMutex);
+    
+    std::vector<uint64_t> pending;
+    pending.reserve(mEntries.size());
+    for(auto& entry: mEntries){
+        pending.push_back(entry.first);
+    }
+    return pending;
+}
+
+void Spool::setSyncPolicy(size_t writes, double seconds){
+    std::lock_guard<std::mutex> lock(mMutex);
+    mSyncWrites = std::max<size_t>(writes, 1);
+    mSyncDelay = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(std::max(seconds, 0.0)));
+}
+
+bool Spool::sync(){
+    std::lock_guard<std::mutex> lock(mMutex);
+    return syncLocked();
+}
+
+bool Spool::syncIfNeeded(){
+    if(!mUnsynced) return true;
+    
+    //without a delay only the amount of writes counts
+    bool late = mSyncDelay.count()>0 && std::chrono::steady_clock::now() - mFirstUnsynced>=mSyncDelay;
+    if(mUnsynced>=mSyncWrites || late){
+        return syncLocked();
+    }
+    return true;
+}
+
+bool Spool::syncLocked(){
+    if(!mUnsynced) return true;
+    if(!mFile || !flushFile(mFile)) return false;
+    mUnsynced = 0;
+    return true;
+}
+
+void Spool::compact(){
+    std::lock_guard<std::mutex> appendLock(mAppendMutex);
+    std::lock_guard<std::mutex> lock(mMutex);
+    
+    std::vector<uint64_t> moved;
+    for(auto& entry: mEntries){
+        if(entry.second.mSegment!=mSegment){
+            moved.push_back(entry.first);
+        }
+    }
+    
+    //copy the pending entries to the end with the same id, recovery takes the last copy
+    std::vector<std::pair<uint64_t, Location> > copies;
+    for(auto id: moved){
+        const Location& location = mEntries[id];
+        MappedFileRef file = MappedFile::open(getPath(location.mSegment));
+        if(!file || location.mOffset + location.mSize>file->getSize()) continue;
+        
+        const char* payload = file->getData() + location.mOffset;
+        size_t head = getEnvelopeSize(payload, location.mSize);
+        
+        //when it can not be copied it stays where it is, so its segment is kept
+        Location copy;
+        if(!write(RECORD_ENTRY, id, payload, head, payload + head, location.mSize - head, copy.mOffset)) continue;
+        copy.mSegment = mSegment;
+        copy.mSize = location.mSize;
+        copies.push_back(std::make_pair(id, copy));
+    }
+    
+    //the copies have to be on disk before the originals go, otherwise the entries are read from the originals
+    if(!syncLocked()) return;
+    for(auto& copy: copies){
+        Location& location = mEntries[copy.first];
+        --mSegments[location.mSegment];
+        ++mSegments[copy.second.mSegment];
+        location = copy.second;
+    }
+    removeSegments();
+}
+
+void Spool::removeSegments(){
+    //only from the oldest on, acknowledgements in a segment can refer to entries in older ones
+    while(!mSegments.empty() && mSegments.begin()->first!=mSegment && mSegments.begin()->second==0){
+        boost::system::error_code error;
+        ci::fs::remove(getPath(mSegments.begin()->first), error);
+        mSegments.erase(mSegments.begin());
+    }
+}